@@ -31,12 +31,20 @@ let package = Package(
             ],
             resources: [
                 .process("CollisionDetection/BroadPhase/BitonicSort/BitonicSort.metal"),
+                .process("CollisionDetection/BroadPhase/BufferFill/BufferFill.metal"),
+                .process("CollisionDetection/BroadPhase/PrefixSum/PrefixSum.metal"),
+                .process("CollisionDetection/BroadPhase/RadixSort/RadixSort.metal"),
                 .process("CollisionDetection/BroadPhase/SpatialHashing.metal"),
+                .process("CollisionDetection/BroadPhase/SpatialHashingPrimitives.metal"),
             ]
         ),
         .testTarget(
             name: "SimulationToolsTests",
             dependencies: ["SimulationTools"]
         ),
+        .testTarget(
+            name: "SimulationToolsBenchmarks",
+            dependencies: ["SimulationTools"]
+        ),
     ]
 )
@@ -3,13 +3,18 @@ using namespace metal;
 
 #include "../../../Common/Definitions.h"
 
-#define SORT(F,L,R) {           \
-    const auto v = sort(F,L,R); \
-    (L) = uint2(v.x, v.y);      \
-    (R) = uint2(v.z, v.w);      \
-}                               \
+// Every merge compares the first half of a block with the mirrored second half and cleans
+// the halves in ascending order, so the entries beyond `count` stay at the end as `UINT_MAX`
+// and are neither loaded nor stored. The count doesn't need to be padded to a power of two.
 
-static constexpr int genLeftIndex(
+/// Must match `BitonicSort.elementsPerThread`.
+#define BITONIC_SORT_ELEMENTS_PER_THREAD 4
+
+/// The threads of a tile, specialized per device from the threadgroup size and memory limits.
+constant uint bitonicSortThreadgroupWidth [[ function_constant(11) ]];
+constant uint bitonicSortTileSize = bitonicSortThreadgroupWidth * BITONIC_SORT_ELEMENTS_PER_THREAD;
+
+static constexpr uint genLeftIndex(
     const uint position,
     const uint blockSize
 ) {
@@ -18,102 +23,166 @@ static constexpr int genLeftIndex(
     return ((position & ~blockMask) << 1) | no;
 }
 
-static uint4 sort(
-    const bool reverse,
-    uint2 left,
-    uint2 right
+/// The right index of the comparator at `left`, mirrored in the first step of a merge.
+static constexpr uint genRightIndex(
+    const uint left,
+    const uint mergeSize,
+    const uint distance
+) {
+    return distance == (mergeSize >> 1) ? left ^ (mergeSize - 1) : left | distance;
+}
+
+static void compareAndSwap(
+    thread uint2& left,
+    thread uint2& right
+) {
+    if (right.x < left.x) {
+        const auto tmp = left;
+        left = right;
+        right = tmp;
+    }
+}
+
+static void compareAndSwap(
+    threadgroup uint2& left,
+    threadgroup uint2& right
 ) {
-    const bool lt = left.x < right.x;
-    const bool swap = !lt ^ reverse;
-    const bool4 dir = bool4(swap, swap, !swap, !swap); // (lt, gte) or (gte, lt)
-    const uint4 v = select(uint4(left.x, left.y, left.x, left.y),
-                           uint4(right.x, right.y, right.x, right.y),
-                               dir);
-    return v;
+    const uint2 l = left;
+    const uint2 r = right;
+    if (r.x < l.x) {
+        left = r;
+        right = l;
+    }
 }
 
-static void loadShared(
-    const uint threadGroupSize,
+/// Loads the tile with coalesced reads and moves the contiguous elements of every thread into registers.
+static void loadTile(
+    device const uint2* data,
+    const uint count,
+    const uint tileStart,
     const uint indexInThreadgroup,
-    const uint position,
+    threadgroup uint2* shared,
+    thread uint2 (&values)[BITONIC_SORT_ELEMENTS_PER_THREAD]
+) {
+    for (uint i = 0; i < BITONIC_SORT_ELEMENTS_PER_THREAD; i++) {
+        const auto index = indexInThreadgroup + i * bitonicSortThreadgroupWidth;
+        shared[index] = tileStart + index < count ? data[tileStart + index] : uint2(UINT_MAX);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    for (uint i = 0; i < BITONIC_SORT_ELEMENTS_PER_THREAD; i++) {
+        values[i] = shared[indexInThreadgroup * BITONIC_SORT_ELEMENTS_PER_THREAD + i];
+    }
+}
+
+static void storeTile(
     device uint2* data,
-    threadgroup uint2* shared
+    const uint count,
+    const uint tileStart,
+    const uint indexInThreadgroup,
+    threadgroup uint2* shared,
+    thread const uint2 (&values)[BITONIC_SORT_ELEMENTS_PER_THREAD]
 ) {
-    const auto index = genLeftIndex(position, threadGroupSize);
-    shared[indexInThreadgroup] = data[index];
-    shared[indexInThreadgroup | threadGroupSize] = data[index | threadGroupSize];
+    // Every thread only rewrites its own elements, which no other thread reads after the last barrier.
+    for (uint i = 0; i < BITONIC_SORT_ELEMENTS_PER_THREAD; i++) {
+        shared[indexInThreadgroup * BITONIC_SORT_ELEMENTS_PER_THREAD + i] = values[i];
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    for (uint i = 0; i < BITONIC_SORT_ELEMENTS_PER_THREAD; i++) {
+        const auto index = indexInThreadgroup + i * bitonicSortThreadgroupWidth;
+        if (tileStart + index < count) {
+            data[tileStart + index] = shared[index];
+        }
+    }
 }
 
-static void storeShared(
-    const uint threadGroupSize,
+/// Runs the steps of a merge from `distance` down to 1 within the tile.
+/// Steps across threads go through threadgroup memory, the last steps stay in registers.
+static void mergeTile(
+    const uint mergeSize,
+    const uint distance,
     const uint indexInThreadgroup,
-    const uint position,
-    device uint2* data,
-    threadgroup uint2* shared
+    threadgroup uint2* shared,
+    thread uint2 (&values)[BITONIC_SORT_ELEMENTS_PER_THREAD]
 ) {
-    const auto index = genLeftIndex(position, threadGroupSize);
-    data[index] = shared[indexInThreadgroup];
-    data[index | threadGroupSize] = shared[indexInThreadgroup | threadGroupSize];
+    uint step = distance;
+    if (step >= BITONIC_SORT_ELEMENTS_PER_THREAD) {
+        for (uint i = 0; i < BITONIC_SORT_ELEMENTS_PER_THREAD; i++) {
+            shared[indexInThreadgroup * BITONIC_SORT_ELEMENTS_PER_THREAD + i] = values[i];
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+        for (; step >= BITONIC_SORT_ELEMENTS_PER_THREAD; step >>= 1) {
+            for (uint i = 0; i < BITONIC_SORT_ELEMENTS_PER_THREAD / 2; i++) {
+                const auto left = genLeftIndex(indexInThreadgroup + i * bitonicSortThreadgroupWidth, step);
+                compareAndSwap(shared[left], shared[genRightIndex(left, mergeSize, step)]);
+            }
+            threadgroup_barrier(mem_flags::mem_threadgroup);
+        }
+        for (uint i = 0; i < BITONIC_SORT_ELEMENTS_PER_THREAD; i++) {
+            values[i] = shared[indexInThreadgroup * BITONIC_SORT_ELEMENTS_PER_THREAD + i];
+        }
+    }
+    for (; step > 0; step >>= 1) {
+        for (uint i = 0; i < BITONIC_SORT_ELEMENTS_PER_THREAD; i++) {
+            if ((i & step) == 0) {
+                compareAndSwap(values[i], values[genRightIndex(i, mergeSize, step)]);
+            }
+        }
+    }
 }
 
+/// Sorts every tile of `bitonicSortTileSize` entries, or up to `sortedSize` entries when the count is smaller.
 kernel void bitonicSortFirstPass(
     device uint2* data [[ buffer(0) ]],
-    constant uint& gridSize [[ buffer(1) ]],
+    constant uint& count [[ buffer(1) ]],
+    constant uint& sortedSize [[ buffer(2) ]],
     threadgroup uint2* shared [[ threadgroup(0) ]],
-    const uint threadgroupSize [[ threads_per_threadgroup ]],
     const uint indexInThreadgroup [[ thread_index_in_threadgroup ]],
-    const uint position [[ thread_position_in_grid ]]
+    const uint threadgroupIndex [[ threadgroup_position_in_grid ]]
 ) {
-    if (deviceDoesntSupportNonuniformThreadgroups && position >= gridSize) { return; }
-    loadShared(threadgroupSize, indexInThreadgroup, position, data, shared);
-    threadgroup_barrier(mem_flags::mem_threadgroup);
-    for (uint unitSize = 1; unitSize <= threadgroupSize; unitSize <<= 1) {
-        const bool reverse = (position & (unitSize)) != 0;    // to toggle direction
-        for (uint blockSize = unitSize; 0 < blockSize; blockSize >>= 1) {
-            const auto left = genLeftIndex(indexInThreadgroup, blockSize);
-            SORT(reverse, shared[left], shared[left | blockSize]);
-            threadgroup_barrier(mem_flags::mem_threadgroup);
-        }
+    const auto tileStart = threadgroupIndex * bitonicSortTileSize;
+    uint2 values[BITONIC_SORT_ELEMENTS_PER_THREAD];
+    loadTile(data, count, tileStart, indexInThreadgroup, shared, values);
+    for (uint mergeSize = 2; mergeSize <= sortedSize; mergeSize <<= 1) {
+        mergeTile(mergeSize, mergeSize >> 1, indexInThreadgroup, shared, values);
     }
-    storeShared(threadgroupSize, indexInThreadgroup, position, data, shared);
+    storeTile(data, count, tileStart, indexInThreadgroup, shared, values);
 }
 
+/// Runs a single step of a merge across tiles.
 kernel void bitonicSortGeneralPass(
     device uint2* data [[ buffer(0) ]],
-    constant uint& gridSize [[ buffer(1) ]],
+    constant uint& count [[ buffer(1) ]],
     constant uint2& params [[ buffer(2) ]],
+    constant uint& gridSize [[ buffer(3) ]],
     const uint position [[ thread_position_in_grid ]]
 ) {
     if (deviceDoesntSupportNonuniformThreadgroups && position >= gridSize) { return; }
-    const bool reverse = (position & (params.x >> 1)) != 0; // to toggle direction
-    const uint blockSize = params.y; // size of comparison sets
-    const auto left = genLeftIndex(position, blockSize);
-    SORT(reverse, data[left], data[left | blockSize]);
+    const auto mergeSize = params.x;
+    const auto distance = params.y;
+    const auto left = genLeftIndex(position, distance);
+    const auto right = genRightIndex(left, mergeSize, distance);
+    if (right >= count) { return; }
+
+    const uint2 l = data[left];
+    const uint2 r = data[right];
+    if (r.x < l.x) {
+        data[left] = r;
+        data[right] = l;
+    }
 }
 
+/// Runs the steps of a merge within every tile, after the steps across tiles.
 kernel void bitonicSortFinalPass(
-    device uint2* data,
-    constant uint& gridSize [[ buffer(1) ]],
-    constant uint2& params [[ buffer(2) ]],
+    device uint2* data [[ buffer(0) ]],
+    constant uint& count [[ buffer(1) ]],
+    constant uint& mergeSize [[ buffer(2) ]],
     threadgroup uint2* shared [[ threadgroup(0) ]],
-    const uint threadgroupSize [[ threads_per_threadgroup ]],
     const uint indexInThreadgroup [[ thread_index_in_threadgroup ]],
-    const uint position [[ thread_position_in_grid ]]
+    const uint threadgroupIndex [[ threadgroup_position_in_grid ]]
 ) {
-    if (deviceDoesntSupportNonuniformThreadgroups && position >= gridSize) { return; }
-    loadShared(threadgroupSize, indexInThreadgroup, position, data, shared);
-    const auto unitSize = params.x;
-    const auto blockSize = params.y;
-    const auto num = 10 + 1;
-    // Toggle direction.
-    const bool reverse = (position & (unitSize >> 1)) != 0;
-    for (uint i = 0; i < num; ++i) {
-        const auto width = blockSize >> i;
-        const auto left = genLeftIndex(indexInThreadgroup, width);
-        SORT(reverse, shared[left], shared[left | width]);
-        threadgroup_barrier(mem_flags::mem_threadgroup);
-    }
-    storeShared(threadgroupSize, indexInThreadgroup, position, data, shared);
+    const auto tileStart = threadgroupIndex * bitonicSortTileSize;
+    uint2 values[BITONIC_SORT_ELEMENTS_PER_THREAD];
+    loadTile(data, count, tileStart, indexInThreadgroup, shared, values);
+    mergeTile(mergeSize, bitonicSortTileSize >> 1, indexInThreadgroup, shared, values);
+    storeTile(data, count, tileStart, indexInThreadgroup, shared, values);
 }
-
-#undef SORT
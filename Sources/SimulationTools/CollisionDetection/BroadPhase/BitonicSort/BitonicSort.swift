@@ -1,104 +1,105 @@
-import Metal
+import MetalTools
 
+/// In-place ascending sort of `SIMD2<UInt32>` entries by their first component.
+///
+/// Tiles of `tileSize` entries are sorted in threadgroup memory, the first steps of every merge
+/// across tiles are separate dispatches and the last steps run within the tiles again.
+/// The count doesn't need to be a power of two, entries beyond it are neither read nor written.
 final class BitonicSort {
     // MARK: - Properties
 
+    /// Must match `BITONIC_SORT_ELEMENTS_PER_THREAD` in `BitonicSort.metal`.
+    static let elementsPerThread = 4
+
+    /// The threads of a tile, the largest power of two fitting the device threadgroup size and memory.
+    let threadgroupWidth: Int
+    var tileSize: Int { self.threadgroupWidth * Self.elementsPerThread }
+
     private let firstPass: FirstPass
     private let generalPass: GeneralPass
     private let finalPass: FinalPass
 
+    // MARK: - Init
+
     init(
-        library: MTLLibrary
+        library: PipelineLibrary
     ) throws {
-        self.firstPass = try .init(
-            library: library
-        )
-        self.generalPass = try .init(
-            library: library
-        )
-        self.finalPass = try .init(
-            library: library
-        )
+        let device = library.device
+        let tileElementsLength = MemoryLayout<SIMD2<UInt32>>.stride * Self.elementsPerThread
+        var threadgroupWidth = min(
+            device.maxThreadsPerThreadgroup.width,
+            device.maxThreadgroupMemoryLength / tileElementsLength
+        ).previousPowerOfTwo
+
+        // The tile passes are specialized for the width, which has to fit the compiled pipeline states.
+        var firstPass = try FirstPass(library: library, threadgroupWidth: threadgroupWidth)
+        var finalPass = try FinalPass(library: library, threadgroupWidth: threadgroupWidth)
+        while threadgroupWidth > 1 {
+            let maxThreadgroupWidth = min(
+                firstPass.pipelineState.maxTotalThreadsPerThreadgroup,
+                finalPass.pipelineState.maxTotalThreadsPerThreadgroup
+            )
+            guard maxThreadgroupWidth < threadgroupWidth else { break }
+            threadgroupWidth = maxThreadgroupWidth.previousPowerOfTwo
+            firstPass = try FirstPass(library: library, threadgroupWidth: threadgroupWidth)
+            finalPass = try FinalPass(library: library, threadgroupWidth: threadgroupWidth)
+        }
+
+        self.threadgroupWidth = threadgroupWidth
+        self.firstPass = firstPass
+        self.generalPass = try .init(library: library)
+        self.finalPass = finalPass
     }
 
+    // MARK: - Encode
+
     func encode(
         data: MTLBuffer,
         count: Int,
         in commandBuffer: MTLCommandBuffer
     ) {
-        let elementStride = data.length / count
-        let gridSize = count >> 1
-        let unitSize = min(
-            gridSize,
-            self.generalPass
-                .pipelineState
-                .maxTotalThreadsPerThreadgroup
-        )
+        commandBuffer.compute { encoder in
+            encoder.label = "Bitonic Sort"
+            self.encode(data: data, count: count, using: encoder)
+        }
+    }
 
-        var params = SIMD2<UInt32>(repeating: 1)
+    /// Encodes every pass into `encoder`, the serial dispatches order the dependent passes.
+    func encode(
+        data: MTLBuffer,
+        count: Int,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        guard count > 1 else { return }
+        let tileSize = self.tileSize
+        let sortedSize = count.nextPowerOfTwo
 
         self.firstPass.encode(
             data: data,
-            elementStride: elementStride,
-            gridSize: gridSize,
-            unitSize: unitSize,
-            in: commandBuffer
-        )
-        params.x = .init(unitSize << 1)
-
-        while params.x < count {
-            params.y = params.x
-            params.x <<= 1
-            repeat {
-                if unitSize < params.y {
-                    self.generalPass.encode(
-                        data: data,
-                        params: params,
-                        gridSize: gridSize,
-                        unitSize: unitSize,
-                        in: commandBuffer
-                    )
-                    params.y >>= 1
-                } else {
-                    self.finalPass.encode(
-                        data: data,
-                        elementStride: elementStride,
-                        params: params,
-                        gridSize: gridSize,
-                        unitSize: unitSize,
-                        in: commandBuffer
-                    )
-                    params.y = .zero
-                }
-            } while params.y > .zero
-        }
-    }
-    
-    static func buffer(
-        count: Int,
-        options: MTLResourceOptions = .cpuCacheModeWriteCombined,
-        bufferAllocator: MTLBufferAllocator
-    ) throws -> (buffer: MTLBuffer, paddedCount: Int) {
-        return try Self.buffer(
             count: count,
-            paddingValue: SIMD2<UInt32>(UInt32.max, UInt32.max),
-            bufferAllocator: bufferAllocator
+            sortedSize: min(sortedSize, tileSize),
+            using: encoder
         )
-    }
 
-    private static func buffer<T>(
-        count: Int,
-        paddingValue: T,
-        bufferAllocator: MTLBufferAllocator
-    ) throws -> (buffer: MTLBuffer, paddedCount: Int) {
-        let paddedCount = 1 << UInt(ceil(log2f(.init(count))))
-        var count = count
-        if paddedCount > count {
-            count += paddedCount - count
+        var mergeSize = tileSize << 1
+        while mergeSize <= sortedSize {
+            var distance = mergeSize >> 1
+            while distance >= tileSize {
+                self.generalPass.encode(
+                    data: data,
+                    count: count,
+                    params: .init(UInt32(mergeSize), UInt32(distance)),
+                    using: encoder
+                )
+                distance >>= 1
+            }
+            self.finalPass.encode(
+                data: data,
+                count: count,
+                mergeSize: mergeSize,
+                using: encoder
+            )
+            mergeSize <<= 1
         }
-        return try (
-            buffer: bufferAllocator.buffer(for: T.self, count: count),
-            paddedCount: paddedCount
-        )
     }
 }
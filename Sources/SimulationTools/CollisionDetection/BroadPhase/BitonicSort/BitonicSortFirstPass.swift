@@ -1,25 +1,22 @@
-import Metal
+import MetalTools
 
 extension BitonicSort {
     final class FirstPass {
         // MARK: - Properties
 
         let pipelineState: MTLComputePipelineState
-        private let deviceSupportsNonuniformThreadgroups: Bool
+        private let threadgroupWidth: Int
 
         // MARK: - Init
 
         init(
-            library: MTLLibrary
+            library: PipelineLibrary,
+            threadgroupWidth: Int
         ) throws {
-            self.deviceSupportsNonuniformThreadgroups = library.device
-                .supports(feature: .nonUniformThreadgroups)
+            self.threadgroupWidth = threadgroupWidth
 
-            let constantValues = MTLFunctionConstantValues()
-            constantValues.set(
-                self.deviceSupportsNonuniformThreadgroups,
-                at: 0
-            )
+            var constantValues = FunctionConstants()
+            constantValues.set(UInt32(threadgroupWidth), at: 11)
 
             self.pipelineState = try library.computePipelineState(
                 function: "bitonicSortFirstPass",
@@ -31,50 +28,25 @@ extension BitonicSort {
 
         func encode(
             data: MTLBuffer,
-            elementStride: Int,
-            gridSize: Int,
-            unitSize: Int,
-            in commandBuffer: MTLCommandBuffer
-        ) {
-            commandBuffer.compute { encoder in
-                encoder.label = "Bitonic Sort First Pass"
-                self.encode(
-                    data: data,
-                    elementStride: elementStride,
-                    gridSize: gridSize,
-                    unitSize: unitSize,
-                    using: encoder
-                )
-            }
-        }
-
-        func encode(
-            data: MTLBuffer,
-            elementStride: Int,
-            gridSize: Int,
-            unitSize: Int,
+            count: Int,
+            sortedSize: Int,
             using encoder: MTLComputeCommandEncoder
         ) {
-            encoder.setBuffers(data)
-            encoder.setValue(UInt32(gridSize), at: 1)
+            let tileSize = self.threadgroupWidth * BitonicSort.elementsPerThread
+            let tilesCount = (count + tileSize - 1) / tileSize
+
+            encoder.setBuffer(data, offset: 0, index: 0)
+            encoder.setValue(UInt32(count), at: 1)
+            encoder.setValue(UInt32(sortedSize), at: 2)
             encoder.setThreadgroupMemoryLength(
-                (elementStride * unitSize) << 1,
+                tileSize * MemoryLayout<SIMD2<UInt32>>.stride,
                 index: 0
             )
-
-            if self.deviceSupportsNonuniformThreadgroups {
-                encoder.dispatch1d(
-                    state: self.pipelineState,
-                    exactly: gridSize,
-                    threadgroupWidth: unitSize
-                )
-            } else {
-                encoder.dispatch1d(
-                    state: self.pipelineState,
-                    covering: gridSize,
-                    threadgroupWidth: unitSize
-                )
-            }
+            encoder.dispatch1d(
+                state: self.pipelineState,
+                covering: tilesCount * self.threadgroupWidth,
+                threadgroupWidth: self.threadgroupWidth
+            )
         }
     }
 }
@@ -1,22 +1,19 @@
-import Metal
+import MetalTools
 
 extension BitonicSort {
     final class GeneralPass {
         // MARK: - Properties
 
         let pipelineState: MTLComputePipelineState
-        private let deviceSupportsNonuniformThreadgroups: Bool
 
         // MARK: - Init
 
         init(
-            library: MTLLibrary
+            library: PipelineLibrary
         ) throws {
-            self.deviceSupportsNonuniformThreadgroups = library.device.supports(feature: .nonUniformThreadgroups)
-
-            let constantValues = MTLFunctionConstantValues()
+            var constantValues = FunctionConstants()
             constantValues.set(
-                self.deviceSupportsNonuniformThreadgroups,
+                library.device.supports(feature: .nonUniformThreadgroups),
                 at: 0
             )
 
@@ -28,49 +25,21 @@ extension BitonicSort {
 
         // MARK: - Encode
 
+        /// Dispatches one thread per comparator with its left entry below `count`.
         func encode(
             data: MTLBuffer,
+            count: Int,
             params: SIMD2<UInt32>,
-            gridSize: Int,
-            unitSize: Int,
-            in commandBuffer: MTLCommandBuffer
-        ) {
-            commandBuffer.compute { encoder in
-                encoder.label = "Bitonic Sort General Pass"
-                self.encode(
-                    data: data,
-                    params: params,
-                    gridSize: gridSize,
-                    unitSize: unitSize,
-                    using: encoder
-                )
-            }
-        }
-
-        func encode(
-            data: MTLBuffer,
-            params: SIMD2<UInt32>,
-            gridSize: Int,
-            unitSize: Int,
             using encoder: MTLComputeCommandEncoder
         ) {
-            encoder.setBuffers(data)
-            encoder.setValue(UInt32(gridSize), at: 1)
-            encoder.setValue(params, at: 2)
+            let distance = Int(params.y)
+            let gridSize = count / (distance << 1) * distance + min(count % (distance << 1), distance)
 
-            if self.deviceSupportsNonuniformThreadgroups {
-                encoder.dispatch1d(
-                    state: self.pipelineState,
-                    exactly: gridSize,
-                    threadgroupWidth: unitSize
-                )
-            } else {
-                encoder.dispatch1d(
-                    state: self.pipelineState,
-                    covering: gridSize,
-                    threadgroupWidth: unitSize
-                )
-            }
+            encoder.setBuffer(data, offset: 0, index: 0)
+            encoder.setValue(UInt32(count), at: 1)
+            encoder.setValue(params, at: 2)
+            encoder.setValue(UInt32(gridSize), at: 3)
+            encoder.dispatch1d(state: self.pipelineState, exactlyOrCovering: gridSize)
         }
     }
 }
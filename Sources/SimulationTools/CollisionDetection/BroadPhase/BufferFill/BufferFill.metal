@@ -0,0 +1,13 @@
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void fillBufferValues(
+    device uint* data [[ buffer(0) ]],
+    constant uint& value [[ buffer(1) ]],
+    constant uint& count [[ buffer(2) ]],
+    const uint gid [[ thread_position_in_grid ]]
+) {
+    if (gid < count) {
+        data[gid] = value;
+    }
+}
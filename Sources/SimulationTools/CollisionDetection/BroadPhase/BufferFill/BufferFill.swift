@@ -0,0 +1,36 @@
+import MetalTools
+
+/// Fills `UInt32` values from a compute encoder, so a reset doesn't need a blit encoder in between dispatches.
+final class BufferFill {
+    // MARK: - Properties
+
+    static let threadgroupSize = 256
+
+    private let fillState: MTLComputePipelineState
+
+    // MARK: - Init
+
+    init(library: PipelineLibrary) throws {
+        self.fillState = try library.computePipelineState(function: "fillBufferValues")
+    }
+
+    // MARK: - Encode
+
+    /// Sets the first `count` `UInt32` values of `buffer` to `value`.
+    func encode(
+        buffer: MTLBuffer,
+        value: UInt32,
+        count: Int,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        guard count > 0 else { return }
+        encoder.setBuffer(buffer, offset: 0, index: 0)
+        encoder.setValue(value, at: 1)
+        encoder.setValue(UInt32(count), at: 2)
+        encoder.dispatch1d(
+            state: self.fillState,
+            covering: count,
+            threadgroupWidth: Self.threadgroupSize
+        )
+    }
+}
@@ -0,0 +1,190 @@
+import Foundation
+import MetalTools
+
+/// The GPU timings and statistics of the `SpatialHashing` builds, recorded while set as `SpatialHashing.instrumentation`.
+///
+/// Every build resets and rewrites the statistics and timestamps, which are readable after its command buffer completes.
+/// The stages are timed on devices sampling counters at dispatch boundaries.
+/// Devices sampling at stage boundaries only, like Apple GPUs, time the whole build of the `in commandBuffer` variants,
+/// the `using encoder` variants aren't timed there.
+public final class BuildInstrumentation {
+    /// The timed stages of a build, in encoding order.
+    public enum Stage: Int, CaseIterable {
+        case resetCellBounds
+        /// Converting the positions and computing their hashes.
+        case hashing
+        case sort
+        /// Reordering the positions and computing the cell bounds.
+        case cellBounds
+        /// Finding the collision candidates or pairs of the vertices.
+        case query
+        /// Inserting the primitives or swept bounds and finding their pairs.
+        case primitiveGrid
+    }
+
+    /// `(found candidates or pairs, vertices which dropped candidates, pairs or candidates beyond the capacity,
+    /// occupied slots, max slot occupancy)`.
+    public let statistics: MTLTypedBuffer<UInt32>
+    /// The timestamps at the start of the build, after every stage and at the end, `nil` without timestamp counters.
+    let counterSampleBuffer: MTLCounterSampleBuffer?
+    /// Whether the stages are sampled within the build encoder, otherwise only its start and end are.
+    let samplesAtDispatchBoundary: Bool
+
+    static let statisticsCount = 5
+    static let startSampleIndex = 0
+    static let endSampleIndex = Stage.allCases.count + 1
+
+    private let device: MTLDevice
+    private var recordedStages: [Stage] = []
+    /// Whether the last build sampled its start and end.
+    private var isBuildTimed = false
+    /// Whether the next build is encoded into an encoder created with `computePassDescriptor`.
+    private var samplesNextEncoder = false
+    /// The CPU and GPU timestamps sampled when the last build was encoded.
+    private var encodingTimestamps: (cpu: MTLTimestamp, gpu: MTLTimestamp) = (0, 0)
+
+    /// Creates the statistics buffer and, when the device supports timestamp counters, the counter sample buffer.
+    ///
+    /// - Parameter device: The Metal device for resource allocation.
+    /// - Throws: An error if the buffers cannot be created.
+    public init(device: MTLDevice) throws {
+        self.device = device
+        self.statistics = try device.typedBuffer(for: UInt32.self, count: Self.statisticsCount)
+
+        let timestampCounterSet = device.counterSets?.first {
+            $0.name == MTLCommonCounterSet.timestamp.rawValue
+        }
+        if let timestampCounterSet,
+           device.supportsCounterSampling(.atDispatchBoundary) || device.supportsCounterSampling(.atStageBoundary) {
+            let descriptor = MTLCounterSampleBufferDescriptor()
+            descriptor.label = "Spatial Hashing Timestamps"
+            descriptor.counterSet = timestampCounterSet
+            descriptor.storageMode = .shared
+            descriptor.sampleCount = Self.endSampleIndex + 1
+            self.counterSampleBuffer = try device.makeCounterSampleBuffer(descriptor: descriptor)
+        } else {
+            self.counterSampleBuffer = nil
+        }
+        self.samplesAtDispatchBoundary = device.supportsCounterSampling(.atDispatchBoundary)
+    }
+
+    // MARK: - Statistics
+
+    /// The number of collision candidates or pairs found by the last build, including the pairs beyond the capacity.
+    public var foundCount: Int { self.statistic(at: 0) }
+    /// The number of vertices which found more candidates than their list holds, as in `SpatialHashing.overflowedVerticesCount`.
+    /// A vertex with exactly `maxCollisionCandidatesCount` candidates isn't counted.
+    public var overflowedVerticesCount: Int { self.statistic(at: 1) }
+    /// The number of collision pairs or compact candidates which didn't fit in the list capacity.
+    public var droppedPairsCount: Int { self.statistic(at: 2) }
+    /// The number of hash table slots holding at least one vertex, zero for the primitive grid builds.
+    public var occupiedSlotsCount: Int { self.statistic(at: 3) }
+    /// The maximum number of vertices in a slot, zero for the primitive grid builds.
+    public var maxSlotOccupancy: Int { self.statistic(at: 4) }
+
+    private func statistic(at index: Int) -> Int {
+        Int(self.statistics.values?[index] ?? 0)
+    }
+
+    // MARK: - Timings
+
+    /// The GPU duration of the whole last build in seconds, `nil` when it wasn't timed.
+    public var buildDuration: TimeInterval? {
+        guard self.isBuildTimed,
+              let resolved = self.resolveTimestamps(),
+              let start = resolved.timestamps[Self.startSampleIndex],
+              let end = resolved.timestamps[Self.endSampleIndex],
+              end >= start
+        else { return nil }
+        return Double(end - start) * resolved.secondsPerTick
+    }
+
+    /// The GPU duration of every stage of the last build in seconds, empty when the stages weren't timed.
+    public var stageDurations: [Stage: TimeInterval] {
+        guard !self.recordedStages.isEmpty,
+              let resolved = self.resolveTimestamps(),
+              var previous = resolved.timestamps[Self.startSampleIndex]
+        else { return [:] }
+        var durations: [Stage: TimeInterval] = [:]
+        for stage in self.recordedStages {
+            guard let timestamp = resolved.timestamps[Self.sampleIndex(after: stage)], timestamp >= previous
+            else { return [:] }
+            durations[stage] = Double(timestamp - previous) * resolved.secondsPerTick
+            previous = timestamp
+        }
+        return durations
+    }
+
+    /// The resolved timestamps, `nil` for the failed samples, and the duration of a GPU tick
+    /// from the CPU and GPU timestamps sampled at encoding and now.
+    private func resolveTimestamps() -> (timestamps: [MTLTimestamp?], secondsPerTick: Double)? {
+        guard let counterSampleBuffer = self.counterSampleBuffer,
+              let data = counterSampleBuffer.resolveCounterRange(0 ..< Self.endSampleIndex + 1)
+        else { return nil }
+        let timestamps = data.withUnsafeBytes { bytes in
+            bytes.bindMemory(to: MTLCounterResultTimestamp.self).map { result -> MTLTimestamp? in
+                result.timestamp == MTLCounterErrorValue ? nil : result.timestamp
+            }
+        }
+
+        var cpuTimestamp = MTLTimestamp()
+        var gpuTimestamp = MTLTimestamp()
+        self.device.sampleTimestamps(&cpuTimestamp, gpuTimestamp: &gpuTimestamp)
+        let cpuSpan = Double(cpuTimestamp - self.encodingTimestamps.cpu)
+        let gpuSpan = Double(gpuTimestamp - self.encodingTimestamps.gpu)
+        // CPU timestamps are in nanoseconds.
+        let secondsPerTick = gpuSpan > 0 ? cpuSpan / gpuSpan * 1e-9 : 1e-9
+        return (timestamps, secondsPerTick)
+    }
+
+    // MARK: - Encode
+
+    static func sampleIndex(after stage: Stage) -> Int {
+        stage.rawValue + 1
+    }
+
+    /// Starts recording a build, expects the reset of `statistics` to be encoded before.
+    func begin(using encoder: MTLComputeCommandEncoder) {
+        var cpuTimestamp = MTLTimestamp()
+        var gpuTimestamp = MTLTimestamp()
+        self.device.sampleTimestamps(&cpuTimestamp, gpuTimestamp: &gpuTimestamp)
+        self.encodingTimestamps = (cpu: cpuTimestamp, gpu: gpuTimestamp)
+        self.recordedStages = []
+        self.isBuildTimed = self.samplesAtDispatchBoundary || self.samplesNextEncoder
+        self.samplesNextEncoder = false
+        self.sample(at: Self.startSampleIndex, using: encoder)
+    }
+
+    /// Samples the end of `stage` when the stages are timed.
+    func record(_ stage: Stage, using encoder: MTLComputeCommandEncoder) {
+        guard self.sample(at: Self.sampleIndex(after: stage), using: encoder) else { return }
+        self.recordedStages.append(stage)
+    }
+
+    func end(using encoder: MTLComputeCommandEncoder) {
+        self.sample(at: Self.endSampleIndex, using: encoder)
+    }
+
+    @discardableResult
+    private func sample(at index: Int, using encoder: MTLComputeCommandEncoder) -> Bool {
+        guard self.samplesAtDispatchBoundary, let counterSampleBuffer = self.counterSampleBuffer
+        else { return false }
+        encoder.sampleCounters(sampleBuffer: counterSampleBuffer, sampleIndex: index, barrier: true)
+        return true
+    }
+
+    /// A pass descriptor sampling the start and end of the encoder on devices sampling at stage boundaries only,
+    /// `nil` when the build samples its stages itself or can't be timed.
+    func computePassDescriptor() -> MTLComputePassDescriptor? {
+        guard !self.samplesAtDispatchBoundary, let counterSampleBuffer = self.counterSampleBuffer
+        else { return nil }
+        let descriptor = MTLComputePassDescriptor()
+        descriptor.dispatchType = .serial
+        let attachment = descriptor.sampleBufferAttachments[0]!
+        attachment.sampleBuffer = counterSampleBuffer
+        attachment.startOfEncoderSampleIndex = Self.startSampleIndex
+        attachment.endOfEncoderSampleIndex = Self.endSampleIndex
+        self.samplesNextEncoder = true
+        return descriptor
+    }
+}
@@ -0,0 +1,101 @@
+import MetalTools
+
+/// A compact list of the collision candidates of every vertex, sized by the candidates found rather than per vertex.
+///
+/// `build` counts the candidates of every vertex, allocates their range from `count` and writes them on a second
+/// traversal, so a crowded vertex takes as many candidates as it finds and a lonely one takes none.
+/// The candidates of vertex `i` are `candidates[offset ..< offset + count]` with `(offset, count) = vertexCandidateRanges[i]`,
+/// every pair is listed from both of its vertices.
+///
+/// `count` exceeds `capacity` when the list overflowed. The vertices beyond the capacity then have truncated
+/// or empty ranges, and `reserveCapacity(count)` sizes the list for the next builds.
+public final class CollisionCandidates {
+    /// The candidates list, valid up to `min(count, capacity)`.
+    public private(set) var candidates: MTLTypedBuffer<UInt32>
+    /// The `(offset, count)` of the candidates of every vertex.
+    public let vertexCandidateRanges: MTLTypedBuffer<SIMD2<UInt32>>
+    /// A single `UInt32` with the number of found candidates.
+    /// It exceeds `capacity` when the candidates list overflowed.
+    public let count: MTLTypedBuffer<UInt32>
+
+    public var capacity: Int { self.candidates.count }
+
+    private let bufferAllocator: MTLBufferAllocator
+
+    /// Creates a candidates list.
+    ///
+    /// - Parameters:
+    ///   - device: The Metal device for resource allocation.
+    ///   - vertexCount: The maximum number of vertices.
+    ///   - capacity: The maximum number of candidates of all vertices.
+    /// - Throws: An error if the buffers cannot be created.
+    public convenience init(
+        device: MTLDevice,
+        vertexCount: Int,
+        capacity: Int
+    ) throws {
+        try self.init(
+            bufferAllocator: .init(type: .device(device)),
+            vertexCount: vertexCount,
+            capacity: capacity
+        )
+    }
+
+    /// Creates a candidates list.
+    ///
+    /// - Parameters:
+    ///   - heap: The Metal heap for resource allocation.
+    ///   - vertexCount: The maximum number of vertices.
+    ///   - capacity: The maximum number of candidates of all vertices.
+    /// - Throws: An error if the buffers cannot be created.
+    public convenience init(
+        heap: MTLHeap,
+        vertexCount: Int,
+        capacity: Int
+    ) throws {
+        try self.init(
+            bufferAllocator: .init(type: .heap(heap)),
+            vertexCount: vertexCount,
+            capacity: capacity
+        )
+    }
+
+    init(
+        bufferAllocator: MTLBufferAllocator,
+        vertexCount: Int,
+        capacity: Int
+    ) throws {
+        self.candidates = try .init(count: max(capacity, 1), bufferAllocator: bufferAllocator)
+        self.vertexCandidateRanges = try .init(count: vertexCount, bufferAllocator: bufferAllocator)
+        self.count = try .init(count: 1, bufferAllocator: bufferAllocator)
+        self.bufferAllocator = bufferAllocator
+    }
+
+    /// Grows the candidates list to hold at least `minimumCapacity` candidates.
+    ///
+    /// The capacity grows by at least half, so a scene getting denser frame by frame reallocates rarely.
+    /// Has no effect when the capacity suffices. Must not be called while a build writing the list is in flight.
+    /// - Parameter minimumCapacity: The number of candidates the next builds find, usually the `count` of an overflowed build.
+    /// - Throws: An error if the buffer cannot be allocated.
+    public func reserveCapacity(_ minimumCapacity: Int) throws {
+        guard minimumCapacity > self.capacity else { return }
+        self.candidates = try .init(
+            count: max(minimumCapacity, self.capacity + self.capacity / 2),
+            bufferAllocator: self.bufferAllocator
+        )
+    }
+}
+
+public extension CollisionCandidates {
+    /// Calculates the total size of buffers required for a candidates list.
+    ///
+    /// - Parameters:
+    ///   - vertexCount: The maximum number of vertices.
+    ///   - capacity: The maximum number of candidates of all vertices.
+    /// - Returns: The total size of buffers in bytes.
+    static func totalBuffersSize(vertexCount: Int, capacity: Int) -> Int {
+        max(capacity, 1) * MemoryLayout<UInt32>.stride
+            + vertexCount * MemoryLayout<SIMD2<UInt32>>.stride
+            + MemoryLayout<UInt32>.stride
+    }
+}
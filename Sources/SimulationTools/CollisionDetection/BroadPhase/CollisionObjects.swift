@@ -0,0 +1,93 @@
+import MetalTools
+
+/// Several objects hashed into one shared grid by a single `SpatialHashing` build.
+///
+/// The vertices of the objects are laid out one object after another, object `i` owns
+/// `vertexRanges[i]` of the positions. Two vertices collide only when the group of each object
+/// is in the mask of the other, so objects can be excluded from each other or from themselves.
+public final class CollisionObjects {
+    /// An object of `vertexCount` consecutive vertices.
+    public struct Object: Hashable {
+        public var vertexCount: Int
+        /// The group bits of the object.
+        public var group: UInt32
+        /// The groups the object collides with.
+        public var mask: UInt32
+
+        public init(vertexCount: Int, group: UInt32 = 1, mask: UInt32 = .max) {
+            self.vertexCount = vertexCount
+            self.group = group
+            self.mask = mask
+        }
+    }
+
+    public let objects: [Object]
+    /// The vertices owned by every object.
+    public let vertexRanges: [Range<Int>]
+    /// The positions of all objects, filled by `encodeMerge` or written directly.
+    public let positions: MTLTypedBuffer<SIMD4<Float>>
+    /// The `(group, mask)` of the object of every vertex.
+    let vertexFilters: MTLTypedBuffer<SIMD2<UInt32>>
+
+    public var vertexCount: Int { self.vertexRanges.last?.upperBound ?? 0 }
+
+    /// Creates the objects table.
+    ///
+    /// - Parameters:
+    ///   - device: The Metal device for resource allocation.
+    ///   - objects: The objects in the order of their vertices.
+    /// - Throws: An error if the buffers cannot be created.
+    public init(device: MTLDevice, objects: [Object]) throws {
+        var vertexRanges = [Range<Int>]()
+        var filters = [SIMD2<UInt32>]()
+        for object in objects {
+            let start = vertexRanges.last?.upperBound ?? 0
+            vertexRanges.append(start ..< start + object.vertexCount)
+            filters += repeatElement(SIMD2(object.group, object.mask), count: object.vertexCount)
+        }
+        self.objects = objects
+        self.vertexRanges = vertexRanges
+        self.positions = try device.typedBuffer(for: SIMD4<Float>.self, count: max(filters.count, 1))
+        self.vertexFilters = try device.typedBuffer(with: filters.isEmpty ? [.zero] : filters)
+    }
+
+    /// The object owning `vertex`.
+    public func objectIndex(of vertex: UInt32) -> Int {
+        var low = 0
+        var high = self.vertexRanges.count
+        while low < high {
+            let middle = (low + high) / 2
+            if self.vertexRanges[middle].upperBound <= Int(vertex) {
+                low = middle + 1
+            } else {
+                high = middle
+            }
+        }
+        return low
+    }
+
+    /// Copies the positions of every object into its range of `positions`.
+    ///
+    /// - Parameters:
+    ///   - objectPositions: The positions of every object, at least `vertexCount` of the object each.
+    ///   - commandBuffer: The Metal command buffer to encode the copies into.
+    public func encodeMerge(
+        positions objectPositions: [MTLTypedBuffer<SIMD4<Float>>],
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        precondition(objectPositions.count == self.objects.count, "Positions count doesn't match the objects count")
+        let stride = MemoryLayout<SIMD4<Float>>.stride
+        commandBuffer.blit { encoder in
+            for (positions, range) in zip(objectPositions, self.vertexRanges) where !range.isEmpty {
+                precondition(positions.count >= range.count, "Object positions are fewer than its vertices")
+                encoder.copy(
+                    from: positions.buffer,
+                    sourceOffset: 0,
+                    to: self.positions.buffer,
+                    destinationOffset: range.lowerBound * stride,
+                    size: range.count * stride
+                )
+            }
+        }
+    }
+}
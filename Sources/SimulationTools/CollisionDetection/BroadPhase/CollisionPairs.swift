@@ -0,0 +1,113 @@
+import MetalTools
+
+/// A compact, variable-length list of collision pairs.
+///
+/// Every pair is stored once as `(i, j)` with `i < j`. The pairs of vertex `i` are contiguous,
+/// `vertexPairRanges[i]` holds their `(offset, count)` in `pairs`.
+///
+/// `build` also writes `dispatchArguments`, so kernels processing the pairs can be dispatched
+/// with `dispatchThreadgroups(state:using:)` without reading the count on the CPU.
+/// Such kernels have to skip the threads beyond `min(count, capacity)`.
+public final class CollisionPairs {
+    /// The pairs list, valid up to `min(count, capacity)`.
+    public let pairs: MTLTypedBuffer<SIMD2<UInt32>>
+    /// The `(offset, count)` of the pairs of every vertex.
+    public let vertexPairRanges: MTLTypedBuffer<SIMD2<UInt32>>
+    /// A single `UInt32` with the number of found pairs.
+    /// It exceeds `capacity` when the pairs list overflowed.
+    public let count: MTLTypedBuffer<UInt32>
+    /// The threadgroups covering the stored pairs with one thread per pair.
+    public let dispatchArguments: MTLTypedBuffer<MTLDispatchThreadgroupsIndirectArguments>
+    /// The threadgroup width `dispatchArguments` are computed for.
+    public let dispatchThreadgroupWidth: Int
+
+    public var capacity: Int { self.pairs.count }
+
+    /// Creates a pairs list.
+    ///
+    /// - Parameters:
+    ///   - device: The Metal device for resource allocation.
+    ///   - vertexCount: The maximum number of vertices.
+    ///   - capacity: The maximum number of pairs.
+    ///   - dispatchThreadgroupWidth: The threadgroup width of the kernels processing the pairs.
+    /// - Throws: An error if the buffers cannot be created.
+    public convenience init(
+        device: MTLDevice,
+        vertexCount: Int,
+        capacity: Int,
+        dispatchThreadgroupWidth: Int = 64
+    ) throws {
+        try self.init(
+            bufferAllocator: .init(type: .device(device)),
+            vertexCount: vertexCount,
+            capacity: capacity,
+            dispatchThreadgroupWidth: dispatchThreadgroupWidth
+        )
+    }
+
+    /// Creates a pairs list.
+    ///
+    /// - Parameters:
+    ///   - heap: The Metal heap for resource allocation.
+    ///   - vertexCount: The maximum number of vertices.
+    ///   - capacity: The maximum number of pairs.
+    ///   - dispatchThreadgroupWidth: The threadgroup width of the kernels processing the pairs.
+    /// - Throws: An error if the buffers cannot be created.
+    public convenience init(
+        heap: MTLHeap,
+        vertexCount: Int,
+        capacity: Int,
+        dispatchThreadgroupWidth: Int = 64
+    ) throws {
+        try self.init(
+            bufferAllocator: .init(type: .heap(heap)),
+            vertexCount: vertexCount,
+            capacity: capacity,
+            dispatchThreadgroupWidth: dispatchThreadgroupWidth
+        )
+    }
+
+    init(
+        bufferAllocator: MTLBufferAllocator,
+        vertexCount: Int,
+        capacity: Int,
+        dispatchThreadgroupWidth: Int
+    ) throws {
+        self.pairs = try .init(count: max(capacity, 1), bufferAllocator: bufferAllocator)
+        self.vertexPairRanges = try .init(count: vertexCount, bufferAllocator: bufferAllocator)
+        self.count = try .init(count: 1, bufferAllocator: bufferAllocator)
+        self.dispatchArguments = try .init(count: 1, bufferAllocator: bufferAllocator)
+        self.dispatchThreadgroupWidth = dispatchThreadgroupWidth
+    }
+
+    /// Dispatches `state` with one thread per stored pair using `dispatchArguments`.
+    ///
+    /// - Parameters:
+    ///   - state: The pipeline state to dispatch.
+    ///   - encoder: The compute command encoder encoded after the `build` that filled the pairs.
+    public func dispatchThreadgroups(
+        state: MTLComputePipelineState,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        encoder.setComputePipelineState(state)
+        encoder.dispatchThreadgroups(
+            indirectBuffer: self.dispatchArguments.buffer,
+            indirectBufferOffset: 0,
+            threadsPerThreadgroup: MTLSize(width: self.dispatchThreadgroupWidth, height: 1, depth: 1)
+        )
+    }
+}
+
+public extension CollisionPairs {
+    /// Calculates the total size of buffers required for a pairs list.
+    ///
+    /// - Parameters:
+    ///   - vertexCount: The maximum number of vertices.
+    ///   - capacity: The maximum number of pairs.
+    /// - Returns: The total size of buffers in bytes.
+    static func totalBuffersSize(vertexCount: Int, capacity: Int) -> Int {
+        (max(capacity, 1) + vertexCount) * MemoryLayout<SIMD2<UInt32>>.stride
+            + MemoryLayout<UInt32>.stride
+            + MemoryLayout<MTLDispatchThreadgroupsIndirectArguments>.stride
+    }
+}
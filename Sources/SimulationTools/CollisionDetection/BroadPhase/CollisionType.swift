@@ -2,4 +2,19 @@ import Foundation
 
 public enum SelfCollisionType: String, Hashable, CaseIterable  {
     case vertexToVertex
+    /// Triangles are inserted into every cell their bounds overlap, vertices query them.
+    case vertexToTriangle
+    /// Edges are inserted into every cell their bounds overlap, edges query them.
+    case edgeToEdge
+}
+
+extension SelfCollisionType {
+    /// The number of vertex indices of a primitive, `nil` for `vertexToVertex`.
+    var primitiveVerticesCount: Int? {
+        switch self {
+        case .vertexToVertex: return nil
+        case .vertexToTriangle: return 3
+        case .edgeToEdge: return 2
+        }
+    }
 }
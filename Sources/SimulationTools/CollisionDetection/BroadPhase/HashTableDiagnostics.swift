@@ -0,0 +1,52 @@
+import MetalTools
+
+/// The occupancy of the `SpatialHashing` hash table, written by `encodeDiagnostics`.
+///
+/// A slot is a hash table entry, a cell is a distinct grid coordinate.
+/// Slots holding more than one cell are scanned for every cell they hold,
+/// which costs extra distance checks in the queries.
+public final class HashTableDiagnostics {
+    /// `(occupied slots, max slot occupancy, distinct cells, slots with colliding cells, saturated slots)`.
+    public let counters: MTLTypedBuffer<UInt32>
+    /// The number of vertices of a slot compared to tell its cells apart, which bounds the work per slot.
+    public static let maxDiagnosedSlotOccupancy = 64
+    /// The capacity of the hash table of the last diagnosed build.
+    public internal(set) var hashTableCapacity: Int = 0
+
+    /// Creates the diagnostics counters.
+    ///
+    /// - Parameter device: The Metal device for resource allocation.
+    /// - Throws: An error if the buffer cannot be created.
+    public init(device: MTLDevice) throws {
+        self.counters = try device.typedBuffer(for: UInt32.self, count: 5)
+    }
+
+    /// The number of slots holding at least one vertex.
+    public var occupiedSlotsCount: Int { self.counter(at: 0) }
+    /// The maximum number of vertices in a slot.
+    public var maxSlotOccupancy: Int { self.counter(at: 1) }
+    /// The number of distinct occupied cells, among the first `maxDiagnosedSlotOccupancy` vertices of every slot.
+    public var occupiedCellsCount: Int { self.counter(at: 2) }
+    /// The number of slots holding more than one cell among their first `maxDiagnosedSlotOccupancy` vertices.
+    public var collidingSlotsCount: Int { self.counter(at: 3) }
+    /// The number of slots holding more than `maxDiagnosedSlotOccupancy` vertices,
+    /// which cells count and collision rate are lower bounds.
+    public var saturatedSlotsCount: Int { self.counter(at: 4) }
+
+    /// The ratio of occupied slots to the hash table capacity.
+    public var loadFactor: Float {
+        self.hashTableCapacity > 0 ? Float(self.occupiedSlotsCount) / Float(self.hashTableCapacity) : 0
+    }
+
+    /// The ratio of occupied cells sharing a slot with another cell.
+    public var collisionRate: Float {
+        let occupiedCellsCount = self.occupiedCellsCount
+        return occupiedCellsCount > 0
+             ? Float(occupiedCellsCount - self.occupiedSlotsCount + self.collidingSlotsCount) / Float(occupiedCellsCount)
+             : 0
+    }
+
+    private func counter(at index: Int) -> Int {
+        Int(self.counters.values?[index] ?? 0)
+    }
+}
@@ -0,0 +1,40 @@
+#include <metal_stdlib>
+using namespace metal;
+
+#include "../../../Common/PrefixSumCommon.h"
+
+#define PREFIX_SUM_THREADGROUP_SIZE 256
+
+kernel void prefixSumScanBlocks(
+    device uint* data [[ buffer(0) ]],
+    device uint* blockSums [[ buffer(1) ]],
+    constant uint& count [[ buffer(2) ]],
+    const uint gid [[ thread_position_in_grid ]],
+    const uint threadIndex [[ thread_index_in_threadgroup ]],
+    const uint blockIndex [[ threadgroup_position_in_grid ]]
+) {
+    threadgroup uint shared[PREFIX_SUM_THREADGROUP_SIZE];
+
+    const uint value = gid < count ? data[gid] : 0;
+    const uint2 sum = threadgroupExclusiveSum<PREFIX_SUM_THREADGROUP_SIZE>(value, shared, threadIndex);
+
+    if (gid < count) {
+        data[gid] = sum.x;
+    }
+    if (threadIndex == 0) {
+        blockSums[blockIndex] = sum.y;
+    }
+}
+
+kernel void prefixSumAddBlockOffsets(
+    device uint* data [[ buffer(0) ]],
+    device const uint* blockOffsets [[ buffer(1) ]],
+    constant uint& count [[ buffer(2) ]],
+    const uint gid [[ thread_position_in_grid ]],
+    const uint blockIndex [[ threadgroup_position_in_grid ]]
+) {
+    if (gid >= count) { return; }
+    data[gid] += blockOffsets[blockIndex];
+}
+
+#undef PREFIX_SUM_THREADGROUP_SIZE
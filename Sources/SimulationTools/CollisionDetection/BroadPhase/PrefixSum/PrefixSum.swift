@@ -0,0 +1,118 @@
+import MetalTools
+
+/// In-place exclusive prefix sum over `UInt32` values.
+///
+/// Each level scans blocks of `threadgroupSize` elements and writes the block totals
+/// into a smaller buffer, which is scanned recursively and added back.
+final class PrefixSum {
+    // MARK: - Properties
+
+    /// Must match `PREFIX_SUM_THREADGROUP_SIZE` in `PrefixSum.metal`.
+    static let threadgroupSize = 256
+
+    private(set) var maxCount: Int
+
+    private let scanBlocksState: MTLComputePipelineState
+    private let addBlockOffsetsState: MTLComputePipelineState
+    private var blockSums: [MTLBuffer]
+
+    // MARK: - Init
+
+    init(
+        library: PipelineLibrary,
+        maxCount: Int,
+        bufferAllocator: MTLBufferAllocator
+    ) throws {
+        self.maxCount = maxCount
+        self.scanBlocksState = try library.computePipelineState(function: "prefixSumScanBlocks")
+        self.addBlockOffsetsState = try library.computePipelineState(function: "prefixSumAddBlockOffsets")
+        self.blockSums = try Self.blockSumsBuffers(maxCount: maxCount, bufferAllocator: bufferAllocator)
+    }
+
+    /// Reallocates the scratch buffers for up to `maxCount` elements, keeping the pipeline states.
+    func reallocate(maxCount: Int, bufferAllocator: MTLBufferAllocator) throws {
+        self.blockSums = try Self.blockSumsBuffers(maxCount: maxCount, bufferAllocator: bufferAllocator)
+        self.maxCount = maxCount
+    }
+
+    private static func blockSumsBuffers(maxCount: Int, bufferAllocator: MTLBufferAllocator) throws -> [MTLBuffer] {
+        try self.blockSumsCounts(maxCount: maxCount).map {
+            try bufferAllocator.buffer(for: UInt32.self, count: $0)
+        }
+    }
+
+    // MARK: - Encode
+
+    func encode(
+        data: MTLBuffer,
+        count: Int,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        commandBuffer.compute { encoder in
+            encoder.label = "Prefix Sum"
+            self.encode(data: data, count: count, using: encoder)
+        }
+    }
+
+    func encode(
+        data: MTLBuffer,
+        count: Int,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        precondition(count <= self.maxCount, "Prefix sum count exceeds the allocated capacity")
+        guard count > 0 else { return }
+
+        var levels: [(buffer: MTLBuffer, count: Int)] = []
+        var levelBuffer = data
+        var levelCount = count
+
+        repeat {
+            let blockSums = self.blockSums[levels.count]
+            encoder.setBuffer(levelBuffer, offset: 0, index: 0)
+            encoder.setBuffer(blockSums, offset: 0, index: 1)
+            encoder.setValue(UInt32(levelCount), at: 2)
+            encoder.dispatch1d(
+                state: self.scanBlocksState,
+                covering: levelCount,
+                threadgroupWidth: Self.threadgroupSize
+            )
+
+            levels.append((buffer: levelBuffer, count: levelCount))
+            levelBuffer = blockSums
+            levelCount = Self.blocksCount(for: levelCount)
+        } while levelCount > 1
+
+        // The top level fits into a single block, so its offsets are already final.
+        for level in (0 ..< levels.count - 1).reversed() {
+            encoder.setBuffer(levels[level].buffer, offset: 0, index: 0)
+            encoder.setBuffer(self.blockSums[level], offset: 0, index: 1)
+            encoder.setValue(UInt32(levels[level].count), at: 2)
+            encoder.dispatch1d(
+                state: self.addBlockOffsetsState,
+                covering: levels[level].count,
+                threadgroupWidth: Self.threadgroupSize
+            )
+        }
+    }
+
+    // MARK: - Sizes
+
+    static func blocksCount(for count: Int) -> Int {
+        (count + self.threadgroupSize - 1) / self.threadgroupSize
+    }
+
+    static func blockSumsCounts(maxCount: Int) -> [Int] {
+        var counts: [Int] = []
+        var count = max(maxCount, 1)
+        repeat {
+            count = self.blocksCount(for: count)
+            counts.append(count)
+        } while count > 1
+        return counts
+    }
+
+    /// The lengths of the scratch buffers required to scan up to `maxCount` elements.
+    static func scratchBufferLengths(maxCount: Int) -> [Int] {
+        self.blockSumsCounts(maxCount: maxCount).map { $0 * MemoryLayout<UInt32>.stride }
+    }
+}
@@ -0,0 +1,93 @@
+#include <metal_stdlib>
+using namespace metal;
+
+#include "../../../Common/PrefixSumCommon.h"
+
+#define RADIX_SORT_THREADGROUP_SIZE 256
+#define RADIX_SORT_BITS_PER_PASS 4
+#define RADIX_SORT_BUCKETS_COUNT (1 << RADIX_SORT_BITS_PER_PASS)
+#define RADIX_SORT_DIGIT_MASK (RADIX_SORT_BUCKETS_COUNT - 1)
+
+static uint radixDigit(const uint2 element, const uint shift) {
+    return (element.x >> shift) & RADIX_SORT_DIGIT_MASK;
+}
+
+/// Counts the digits of every block and stores them digit-major,
+/// so a single exclusive scan yields the global scatter offset of each (digit, block).
+kernel void radixSortHistogram(
+    device const uint2* data [[ buffer(0) ]],
+    device uint* blockHistograms [[ buffer(1) ]],
+    constant uint& count [[ buffer(2) ]],
+    constant uint& shift [[ buffer(3) ]],
+    const uint gid [[ thread_position_in_grid ]],
+    const uint threadIndex [[ thread_index_in_threadgroup ]],
+    const uint blockIndex [[ threadgroup_position_in_grid ]],
+    const uint blocksCount [[ threadgroups_per_grid ]]
+) {
+    threadgroup atomic_uint histogram[RADIX_SORT_BUCKETS_COUNT];
+
+    if (threadIndex < RADIX_SORT_BUCKETS_COUNT) {
+        atomic_store_explicit(&histogram[threadIndex], 0, memory_order_relaxed);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    if (gid < count) {
+        atomic_fetch_add_explicit(&histogram[radixDigit(data[gid], shift)], 1, memory_order_relaxed);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    if (threadIndex < RADIX_SORT_BUCKETS_COUNT) {
+        blockHistograms[threadIndex * blocksCount + blockIndex] = atomic_load_explicit(&histogram[threadIndex], memory_order_relaxed);
+    }
+}
+
+/// Sorts every block locally by the current digit with stable 1-bit splits
+/// and scatters it to the offsets produced by the scanned histograms.
+kernel void radixSortScatter(
+    device const uint2* data [[ buffer(0) ]],
+    device uint2* sortedData [[ buffer(1) ]],
+    device const uint* blockOffsets [[ buffer(2) ]],
+    constant uint& count [[ buffer(3) ]],
+    constant uint& shift [[ buffer(4) ]],
+    const uint gid [[ thread_position_in_grid ]],
+    const uint threadIndex [[ thread_index_in_threadgroup ]],
+    const uint blockIndex [[ threadgroup_position_in_grid ]],
+    const uint blocksCount [[ threadgroups_per_grid ]]
+) {
+    threadgroup uint2 sharedData[RADIX_SORT_THREADGROUP_SIZE];
+    threadgroup uint sharedScan[RADIX_SORT_THREADGROUP_SIZE];
+    threadgroup uint digitStart[RADIX_SORT_BUCKETS_COUNT];
+
+    // Out of range elements get the largest digit and stay behind the valid ones.
+    uint2 element = gid < count ? data[gid] : uint2(UINT_MAX);
+
+    for (uint bit = 0; bit < RADIX_SORT_BITS_PER_PASS; bit++) {
+        const uint bitValue = (radixDigit(element, shift) >> bit) & 1;
+        const uint2 zeros = threadgroupExclusiveSum<RADIX_SORT_THREADGROUP_SIZE>(1 - bitValue, sharedScan, threadIndex);
+        const uint destination = bitValue == 0
+                               ? zeros.x
+                               : zeros.y + (threadIndex - zeros.x);
+
+        sharedData[destination] = element;
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+        element = sharedData[threadIndex];
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+
+    const uint digit = radixDigit(element, shift);
+    if (threadIndex == 0 || radixDigit(sharedData[threadIndex - 1], shift) != digit) {
+        digitStart[digit] = threadIndex;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    const uint blockStart = blockIndex * RADIX_SORT_THREADGROUP_SIZE;
+    if (blockStart + threadIndex >= count) { return; }
+
+    const uint rank = threadIndex - digitStart[digit];
+    sortedData[blockOffsets[digit * blocksCount + blockIndex] + rank] = element;
+}
+
+#undef RADIX_SORT_DIGIT_MASK
+#undef RADIX_SORT_BUCKETS_COUNT
+#undef RADIX_SORT_BITS_PER_PASS
+#undef RADIX_SORT_THREADGROUP_SIZE
@@ -0,0 +1,199 @@
+import MetalTools
+
+/// Stable LSD radix sort of `SIMD2<UInt32>` elements by their `x` component.
+///
+/// Every pass sorts `bitsPerPass` bits of the key with a block histogram,
+/// a prefix scan of the histograms and a stable scatter.
+/// The pass count is rounded up to an even number so the result always ends up back in `data`.
+final class RadixSort {
+    // MARK: - Properties
+
+    /// Must match `RADIX_SORT_THREADGROUP_SIZE` in `RadixSort.metal`.
+    static let threadgroupSize = 256
+    /// Must match `RADIX_SORT_BITS_PER_PASS` in `RadixSort.metal`.
+    static let bitsPerPass = 4
+    static let bucketsCount = 1 << bitsPerPass
+
+    private(set) var capacity: Int
+
+    private let histogramState: MTLComputePipelineState
+    private let scatterState: MTLComputePipelineState
+    private let prefixSum: PrefixSum
+
+    private var scratch: MTLBuffer
+    private var blockHistograms: MTLBuffer
+
+    // MARK: - Init
+
+    init(
+        library: PipelineLibrary,
+        capacity: Int,
+        bufferAllocator: MTLBufferAllocator
+    ) throws {
+        let histogramsCount = Self.histogramsCount(for: capacity)
+
+        self.capacity = capacity
+        self.histogramState = try library.computePipelineState(function: "radixSortHistogram")
+        self.scatterState = try library.computePipelineState(function: "radixSortScatter")
+        self.prefixSum = try .init(
+            library: library,
+            maxCount: histogramsCount,
+            bufferAllocator: bufferAllocator
+        )
+        self.scratch = try bufferAllocator.buffer(for: SIMD2<UInt32>.self, count: max(capacity, 1))
+        self.blockHistograms = try bufferAllocator.buffer(for: UInt32.self, count: max(histogramsCount, 1))
+    }
+
+    /// Reallocates the scratch buffers for up to `capacity` elements, keeping the pipeline states.
+    func reallocate(capacity: Int, bufferAllocator: MTLBufferAllocator) throws {
+        let histogramsCount = Self.histogramsCount(for: capacity)
+        try self.prefixSum.reallocate(maxCount: histogramsCount, bufferAllocator: bufferAllocator)
+        self.scratch = try bufferAllocator.buffer(for: SIMD2<UInt32>.self, count: max(capacity, 1))
+        self.blockHistograms = try bufferAllocator.buffer(for: UInt32.self, count: max(histogramsCount, 1))
+        self.capacity = capacity
+    }
+
+    // MARK: - Encode
+
+    /// Sorts the first `count` elements of `data`.
+    ///
+    /// - Parameters:
+    ///   - data: The buffer of `SIMD2<UInt32>` key-value pairs.
+    ///   - count: The number of elements to sort.
+    ///   - keyBits: The number of significant low bits of the keys.
+    ///   - commandBuffer: The command buffer to encode the sort into.
+    func encode(
+        data: MTLBuffer,
+        count: Int,
+        keyBits: Int,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        commandBuffer.compute { encoder in
+            encoder.label = "Radix Sort"
+            self.encode(
+                data: data,
+                count: count,
+                keyBits: keyBits,
+                using: encoder
+            )
+        }
+    }
+
+    func encode(
+        data: MTLBuffer,
+        count: Int,
+        keyBits: Int,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        precondition(count <= self.capacity, "Radix sort count exceeds the allocated capacity")
+        guard count > 1 else { return }
+
+        self.encode(
+            data: data,
+            maxCount: count,
+            keyBits: keyBits,
+            setCount: { encoder, index in encoder.setValue(UInt32(count), at: index) },
+            using: encoder
+        )
+    }
+
+    /// Sorts the first `count` elements of `data`, where `count` is read on the GPU.
+    ///
+    /// - Parameters:
+    ///   - data: The buffer of `SIMD2<UInt32>` key-value pairs.
+    ///   - countBuffer: The buffer containing the `UInt32` number of elements to sort.
+    ///   - countBufferOffset: The offset of the count in `countBuffer`.
+    ///   - maxCount: The upper bound of the count, used to size the dispatches.
+    ///   - keyBits: The number of significant low bits of the keys.
+    ///   - encoder: The compute command encoder to encode the sort into.
+    func encode(
+        data: MTLBuffer,
+        countBuffer: MTLBuffer,
+        countBufferOffset: Int,
+        maxCount: Int,
+        keyBits: Int,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        precondition(maxCount <= self.capacity, "Radix sort count exceeds the allocated capacity")
+        guard maxCount > 1 else { return }
+
+        self.encode(
+            data: data,
+            maxCount: maxCount,
+            keyBits: keyBits,
+            setCount: { encoder, index in
+                encoder.setBuffer(countBuffer, offset: countBufferOffset, index: index)
+            },
+            using: encoder
+        )
+    }
+
+    private func encode(
+        data: MTLBuffer,
+        maxCount: Int,
+        keyBits: Int,
+        setCount: (MTLComputeCommandEncoder, Int) -> Void,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        let histogramsCount = Self.histogramsCount(for: maxCount)
+
+        for pass in 0 ..< Self.passesCount(keyBits: keyBits) {
+            let (source, destination) = pass.isMultiple(of: 2)
+                                      ? (data, self.scratch)
+                                      : (self.scratch, data)
+            let shift = UInt32(pass * Self.bitsPerPass)
+
+            encoder.setBuffer(source, offset: 0, index: 0)
+            encoder.setBuffer(self.blockHistograms, offset: 0, index: 1)
+            setCount(encoder, 2)
+            encoder.setValue(shift, at: 3)
+            encoder.dispatch1d(
+                state: self.histogramState,
+                covering: maxCount,
+                threadgroupWidth: Self.threadgroupSize
+            )
+
+            self.prefixSum.encode(
+                data: self.blockHistograms,
+                count: histogramsCount,
+                using: encoder
+            )
+
+            encoder.setBuffer(source, offset: 0, index: 0)
+            encoder.setBuffer(destination, offset: 0, index: 1)
+            encoder.setBuffer(self.blockHistograms, offset: 0, index: 2)
+            setCount(encoder, 3)
+            encoder.setValue(shift, at: 4)
+            encoder.dispatch1d(
+                state: self.scatterState,
+                covering: maxCount,
+                threadgroupWidth: Self.threadgroupSize
+            )
+        }
+    }
+
+    // MARK: - Sizes
+
+    /// The number of significant bits of keys in `0 ..< keysCount`.
+    static func keyBits(keysCount: Int) -> Int {
+        keysCount > 1 ? Int.bitWidth - (keysCount - 1).leadingZeroBitCount : 1
+    }
+
+    static func passesCount(keyBits: Int) -> Int {
+        let passesCount = (min(keyBits, UInt32.bitWidth) + self.bitsPerPass - 1) / self.bitsPerPass
+        return passesCount + passesCount % 2
+    }
+
+    static func histogramsCount(for count: Int) -> Int {
+        ((count + self.threadgroupSize - 1) / self.threadgroupSize) * self.bucketsCount
+    }
+
+    /// The lengths of the scratch buffers required to sort up to `capacity` elements.
+    static func scratchBufferLengths(capacity: Int) -> [Int] {
+        let histogramsCount = self.histogramsCount(for: capacity)
+        return [
+            max(capacity, 1) * MemoryLayout<SIMD2<UInt32>>.stride,
+            max(histogramsCount, 1) * MemoryLayout<UInt32>.stride
+        ] + PrefixSum.scratchBufferLengths(maxCount: histogramsCount)
+    }
+}
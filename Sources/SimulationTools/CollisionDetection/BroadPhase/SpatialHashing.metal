@@ -1,14 +1,116 @@
 #include "../../Common/BroadPhaseCommon.h"
 #include "../../Common/Definitions.h"
 
+/// `cellStart` holds `hashTableCapacity + 1` exclusive offsets and `cellEnd` is `cellStart[hash + 1]`.
+constant bool usesCellOffsets [[ function_constant(1) ]];
+
+/// A sorted position with `usesCellRelativePositions`: the position within the cell as 16 bit unorm
+/// and the cell coordinates wrapped to 16 bits.
+struct CellRelativePosition {
+    packed_ushort3 offset;
+    packed_short3 cell;
+};
+
+/// A decoded sorted position. With `usesCellRelativePositions` `position` is relative to the origin of `cell`,
+/// otherwise it's the world position.
+struct StoredPosition {
+    int3 cell;
+    float3 position;
+};
+
+/// The positions buffers are declared as `half4` and hold `CellRelativePosition` with `usesCellRelativePositions`
+/// and `float4` with `usesFullPrecisionPositions`.
+static StoredPosition loadStoredPosition(constant half4* positions, uint index, float cellSize) {
+    if (usesCellRelativePositions) {
+        CellRelativePosition stored = reinterpret_cast<constant CellRelativePosition*>(positions)[index];
+        return { int3(short3(stored.cell)), float3(ushort3(stored.offset)) * (cellSize / 65535.0) };
+    }
+    float3 position = usesFullPrecisionPositions
+                    ? reinterpret_cast<constant float4*>(positions)[index].xyz
+                    : float3(positions[index].xyz);
+    return { hashCoord(position, cellSize), position };
+}
+
+/// The vector from `b` to `a`, exact for nearby cells wherever they are.
+static float3 storedPositionsDifference(StoredPosition a, StoredPosition b, float cellSize) {
+    if (usesCellRelativePositions) {
+        return float3(wrapCell(a.cell - b.cell)) * cellSize + (a.position - b.position);
+    }
+    return a.position - b.position;
+}
+
+/// Marks the cells occupied by the previous build as empty.
+/// The previous sorted hash table is the list of touched cells, so the cost scales with the vertex count
+/// rather than with `hashTableCapacity`.
+kernel void resetCellBoundaries(
+    device uint* cellStart [[ buffer(0) ]],
+    device const uint2* hashTable [[ buffer(1) ]],
+    constant uint& gridSize [[ buffer(2) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint hash = hashTable[gid].x;
+    if (gid > 0 && hashTable[gid - 1].x == hash) { return; }
+    cellStart[hash] = UINT_MAX;
+}
+
+/// Writes the stored position of `positions[index]` and returns its cell as the queries decode it.
+static int3 storePosition(
+    constant float4* positions,
+    device half4* outPositions,
+    uint index,
+    float cellSize
+) {
+    float4 position = positions[index];
+    if (usesCellRelativePositions) {
+        // The cell isn't clamped to the dense grid domain, so the offset stays within the cell.
+        float3 scaledPosition = position.xyz / cellSize;
+        float3 cell = floor(scaledPosition);
+        ushort3 offset = ushort3(rint(saturate(scaledPosition - cell) * 65535.0));
+        short3 storedCell = short3(wrapCell(int3(cell)));
+        CellRelativePosition stored = { packed_ushort3(offset), packed_short3(storedCell) };
+        reinterpret_cast<device CellRelativePosition*>(outPositions)[index] = stored;
+        return gridCell(int3(storedCell));
+    }
+    if (usesFullPrecisionPositions) {
+        reinterpret_cast<device float4*>(outPositions)[index] = position;
+        return hashCoord(position.xyz, cellSize);
+    }
+    half4 halfPosition = half4(position);
+    outPositions[index] = halfPosition;
+    return hashCoord(float3(halfPosition.xyz), cellSize);
+}
+
+/// Copies the stored position `positions[sourceIndex]` to `outPositions[index]`.
+static void reorderPosition(
+    constant half4* positions,
+    device half4* outPositions,
+    uint sourceIndex,
+    uint index
+) {
+    if (usesCellRelativePositions) {
+        reinterpret_cast<device CellRelativePosition*>(outPositions)[index] =
+            reinterpret_cast<constant CellRelativePosition*>(positions)[sourceIndex];
+        return;
+    }
+    if (usesFullPrecisionPositions) {
+        float3 position = reinterpret_cast<constant float4*>(positions)[sourceIndex].xyz;
+        reinterpret_cast<device float4*>(outPositions)[index] = float4(position, 1.0);
+        return;
+    }
+    half3 position = half3(positions[sourceIndex].xyz);
+    outPositions[index] = half4(position, 1.0);
+}
+
 kernel void convertToHalfPrecisionPositions(
    constant float4 *positions [[ buffer(0) ]],
    device half4 *outPositions [[ buffer(1) ]],
-   constant uint& gridSize [[ buffer(2) ]],
+   constant float& cellSize [[ buffer(2) ]],
+   constant uint& gridSize [[ buffer(3) ]],
    uint gid [[thread_position_in_grid]]
 ) {
     if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
-    outPositions[gid] = half4(positions[gid]);
+    storePosition(positions, outPositions, gid, cellSize);
 }
 
 kernel void reorderHalfPrecisionPositions(
@@ -19,30 +121,172 @@ kernel void reorderHalfPrecisionPositions(
    uint gid [[thread_position_in_grid]]
 ) {
     if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
-    uint2 hashAndIndex = hashTable[gid];
-    half3 position = half3(positions[hashAndIndex.y].xyz);
-    outPositions[gid] = half4(position, 1.0);
+    reorderPosition(positions, outPositions, hashTable[gid].y, gid);
+}
+
+/// Converts the positions and writes the hash and index of every vertex in one pass.
+kernel void convertPositionsAndComputeVertexHashAndIndex(
+    constant float4* positions [[ buffer(0) ]],
+    device half4* outPositions [[ buffer(1) ]],
+    device uint2* hashTable [[ buffer(2) ]],
+    constant uint& hashTableCapacity [[ buffer(3) ]],
+    constant float& cellSize [[ buffer(4) ]],
+    constant uint& gridSize [[ buffer(5) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    int3 cell = storePosition(positions, outPositions, gid, cellSize);
+    uint hash = getHash(cell, hashTableCapacity);
+    hashTable[gid] = uint2(hash, gid);
+}
+
+/// Converts the positions and counts the vertices of every cell in one pass.
+kernel void convertPositionsAndCountCellVertices(
+    constant float4* positions [[ buffer(0) ]],
+    device half4* outPositions [[ buffer(1) ]],
+    device uint2* hashAndRank [[ buffer(2) ]],
+    device atomic_uint* cellCounts [[ buffer(3) ]],
+    constant uint& hashTableCapacity [[ buffer(4) ]],
+    constant float& cellSize [[ buffer(5) ]],
+    constant uint& gridSize [[ buffer(6) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    int3 cell = storePosition(positions, outPositions, gid, cellSize);
+    uint hash = getHash(cell, hashTableCapacity);
+    uint rank = atomic_fetch_add_explicit(&cellCounts[hash], 1, memory_order_relaxed);
+    hashAndRank[gid] = uint2(hash, rank);
+}
+
+kernel void scatterVertexHashAndIndex(
+    device const uint2* hashAndRank [[ buffer(0) ]],
+    device const uint* cellStart [[ buffer(1) ]],
+    device uint2* hashTable [[ buffer(2) ]],
+    constant uint& gridSize [[ buffer(3) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint2 vertexHashAndRank = hashAndRank[gid];
+    hashTable[cellStart[vertexHashAndRank.x] + vertexHashAndRank.y] = uint2(vertexHashAndRank.x, gid);
 }
 
-kernel void computeVertexHashAndIndex(
-    device const half4* positions [[ buffer(0) ]],
+/// Incremental rebuild: recomputes the hashes in the order sorted by the previous build
+/// and flags the entries whose hash did not change.
+kernel void updateSortedVertexHashes(
+    constant half4* positions [[ buffer(0) ]],
     device uint2* hashTable [[ buffer(1) ]],
-    constant uint& hashTableCapacity [[ buffer(2) ]],
-    constant float& cellSize [[ buffer(3) ]],
+    device uint* stableFlags [[ buffer(2) ]],
+    device atomic_uint* movedCount [[ buffer(3) ]],
+    constant uint& hashTableCapacity [[ buffer(4) ]],
+    constant float& cellSize [[ buffer(5) ]],
+    constant uint& gridSize [[ buffer(6) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint2 hashAndIndex = hashTable[gid];
+    int3 cell = loadStoredPosition(positions, hashAndIndex.y, cellSize).cell;
+    uint hash = getHash(gridCell(cell), hashTableCapacity);
+    bool isStable = hash == hashAndIndex.x;
+
+    hashTable[gid] = uint2(hash, hashAndIndex.y);
+    stableFlags[gid] = isStable ? 1 : 0;
+    if (!isStable) {
+        atomic_fetch_add_explicit(movedCount, 1, memory_order_relaxed);
+    }
+    // The trailing flag is scanned into the total stable count.
+    if (gid == 0) {
+        stableFlags[gridSize] = 0;
+    }
+}
+
+/// Splits the hash table into the still sorted stable entries and the moved entries.
+/// All entries are treated as moved when more than `maxMovedCount` hashes changed, which turns the
+/// subsequent sort of the moved entries into a full sort.
+kernel void splitStableAndMovedHashes(
+    device const uint2* hashTable [[ buffer(0) ]],
+    device const uint* stableOffsets [[ buffer(1) ]],
+    device uint2* stableHashTable [[ buffer(2) ]],
+    device uint2* movedHashTable [[ buffer(3) ]],
+    device uint* incrementalCounts [[ buffer(4) ]],
+    constant uint& maxMovedCount [[ buffer(5) ]],
+    constant uint& gridSize [[ buffer(6) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint2 hashAndIndex = hashTable[gid];
+
+    if (incrementalCounts[0] > maxMovedCount) {
+        movedHashTable[gid] = hashAndIndex;
+        if (gid == 0) {
+            incrementalCounts[1] = gridSize;
+        }
+        return;
+    }
+
+    uint stableOffset = stableOffsets[gid];
+    if (stableOffsets[gid + 1] != stableOffset) {
+        stableHashTable[stableOffset] = hashAndIndex;
+    } else {
+        movedHashTable[gid - stableOffset] = hashAndIndex;
+    }
+    if (gid == 0) {
+        incrementalCounts[1] = gridSize - stableOffsets[gridSize];
+    }
+}
+
+/// The number of entries in `hashTable` with a hash less than `hash` (or less than or equal to `hash` for `upper`).
+template <bool upper>
+static uint hashTableBound(
+    device const uint2* hashTable,
+    uint count,
+    uint hash
+) {
+    uint low = 0;
+    uint high = count;
+    while (low < high) {
+        uint middle = (low + high) / 2;
+        uint middleHash = hashTable[middle].x;
+        if (upper ? middleHash <= hash : middleHash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/// Merges the stable entries with the sorted moved entries, stable entries go first within a cell.
+kernel void mergeStableAndMovedHashes(
+    device const uint2* stableHashTable [[ buffer(0) ]],
+    device const uint2* movedHashTable [[ buffer(1) ]],
+    device uint2* hashTable [[ buffer(2) ]],
+    device const uint* incrementalCounts [[ buffer(3) ]],
     constant uint& gridSize [[ buffer(4) ]],
     uint gid [[ thread_position_in_grid ]]
 ) {
     if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
-    float3 position = float3(positions[gid].xyz);
-    uint hash = getHash(hashCoord(position, cellSize), hashTableCapacity);
-    hashTable[gid] = uint2(hash, gid);
+    uint movedCount = incrementalCounts[1];
+    uint stableCount = gridSize - movedCount;
+
+    if (gid < stableCount) {
+        uint2 hashAndIndex = stableHashTable[gid];
+        hashTable[gid + hashTableBound<false>(movedHashTable, movedCount, hashAndIndex.x)] = hashAndIndex;
+    } else {
+        uint movedIndex = gid - stableCount;
+        uint2 hashAndIndex = movedHashTable[movedIndex];
+        hashTable[movedIndex + hashTableBound<true>(stableHashTable, stableCount, hashAndIndex.x)] = hashAndIndex;
+    }
 }
 
-kernel void computeCellBoundaries(
+/// Gathers the sorted positions and writes the start and end of every occupied cell in one pass.
+/// Every thread compares its hash with the previous entry, which is shared through `sharedHash`.
+kernel void reorderPositionsAndComputeCellBoundaries(
     device uint* cellStart [[ buffer(0) ]],
     device uint* cellEnd [[ buffer(1) ]],
     device const uint2* hashTable [[ buffer(2) ]],
     constant uint& gridSize [[ buffer(3) ]],
+    constant half4* positions [[ buffer(4) ]],
+    device half4* outPositions [[ buffer(5) ]],
     uint gid [[ thread_position_in_grid ]],
     uint threadIdx [[ thread_position_in_threadgroup ]],
     threadgroup uint* sharedHash [[ threadgroup(0) ]]
@@ -50,6 +294,8 @@ kernel void computeCellBoundaries(
     if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
     uint2 hashIndex = hashTable[gid];
     uint hash = hashIndex.x;
+    reorderPosition(positions, outPositions, hashIndex.y, gid);
+
     sharedHash[threadIdx + 1] = hash;
     if (gid > 0 && threadIdx == 0) {
         sharedHash[0] = hashTable[gid - 1].x;
@@ -69,6 +315,246 @@ kernel void computeCellBoundaries(
     }
 }
 
+/// Set when the connected vertices are the sorted adjacency lists of `VertexAdjacency`:
+/// `vertexCount + 1` offsets into the same buffer followed by the lists.
+constant bool usesAdjacencyLists [[ function_constant(9) ]];
+
+struct ConnectedVertices {
+    uint4 vertices[MAX_CONNECTED_VERTICES / 4];
+    uint simdCount;
+    /// The sorted adjacency list with `usesAdjacencyLists`.
+    constant uint* sortedVertices;
+    uint sortedCount;
+};
+
+static ConnectedVertices loadConnectedVertices(
+    constant uint* connectedVertices,
+    uint connectedVerticesCount,
+    uint index
+) {
+    ConnectedVertices result;
+    if (usesAdjacencyLists) {
+        uint offset = connectedVertices[index];
+        result.simdCount = 0;
+        result.sortedVertices = connectedVertices + offset;
+        result.sortedCount = connectedVertices[index + 1] - offset;
+        return result;
+    }
+    result.simdCount = (connectedVerticesCount + 3) / 4;
+    result.sortedVertices = connectedVertices;
+    result.sortedCount = 0;
+
+    for (uint i = 0; i < result.simdCount; i++) {
+        uint baseIndex = index * connectedVerticesCount + i * 4;
+        // The last vector is padded when the count isn't a multiple of 4.
+        uint4 vertices = uint4(UINT_MAX);
+        for (uint j = 0; j < 4 && i * 4 + j < connectedVerticesCount; j++) {
+            vertices[j] = connectedVertices[baseIndex + j];
+        }
+        result.vertices[i] = vertices;
+    }
+    return result;
+}
+
+static bool isConnected(thread const ConnectedVertices& connectedVertices, uint vertex) {
+    if (usesAdjacencyLists) {
+        uint low = 0;
+        uint high = connectedVertices.sortedCount;
+        while (low < high) {
+            uint middle = (low + high) / 2;
+            uint middleVertex = connectedVertices.sortedVertices[middle];
+            if (middleVertex == vertex) { return true; }
+            if (middleVertex < vertex) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return false;
+    }
+    for (uint i = 0; i < connectedVertices.simdCount; i++) {
+        if (any(connectedVertices.vertices[i] == vertex)) { return true; }
+    }
+    return false;
+}
+
+/// Set when the vertices of several objects are hashed together and every vertex has a `(group, mask)` filter.
+constant bool usesCollisionFilters [[ function_constant(10) ]];
+
+/// Whether the objects of two vertices collide: the group of each has to be in the mask of the other.
+static bool canCollide(uint2 filter, uint2 otherFilter) {
+    return (filter.x & otherFilter.y) != 0 && (otherFilter.x & filter.y) != 0;
+}
+
+/// Set when the outputs index the vertices by their position in the sorted hash table instead of their index,
+/// so the candidates of neighbor vertices are neighbors in memory.
+constant bool writesSortedIndices [[ function_constant(12) ]];
+
+/// The index written for the vertex `index` at `sortedIndex` of the sorted hash table.
+static uint outputIndex(uint sortedIndex, uint index) {
+    return writesSortedIndices ? sortedIndex : index;
+}
+
+/// The built grid a vertex queries its collision candidates from.
+struct CollisionGrid {
+    constant uint2* hashTable;
+    constant uint* cellStart;
+    constant uint* cellEnd;
+    constant half4* sortedPositions;
+    uint hashTableCapacity;
+    float cellSize;
+    /// The `(group, mask)` of every vertex with `usesCollisionFilters`.
+    constant uint2* collisionFilters;
+};
+
+/// Whether a stencil offset belongs to the backward half, which the half stencil skips.
+static bool isBackwardOffset(int3 offset) {
+    if (offset.x != 0) { return offset.x < 0; }
+    if (offset.y != 0) { return offset.y < 0; }
+    return offset.z < 0;
+}
+
+/// Calls `visitor(candidate, distanceSq)` for every vertex in the 27 cells around `position` that is closer than
+/// `proximity`, isn't `index` and isn't connected to it. The candidate is given by its `outputIndex`. Every entry of the cells is visited, crowded cells too.
+/// The iteration stops as soon as the visitor returns `false`.
+/// The entries of a slot are checked to lie in the visited cell, as another cell of the stencil hashed
+/// into the same slot is visited from its own offset and would visit them twice.
+///
+/// With `halfStencil` only the 13 forward neighbor cells and the own cell are visited and the vertices
+/// of the own cell are visited only above `index`, so every pair is visited from one of its vertices.
+template <bool halfStencil, typename Visitor>
+static void forEachCollisionCandidate(
+    thread const CollisionGrid& grid,
+    StoredPosition position,
+    uint index,
+    thread const ConnectedVertices& connectedVertices,
+    float proximity,
+    thread Visitor& visitor
+) {
+    int3 hashPosition = gridCell(position.cell);
+    uint2 filter = usesCollisionFilters ? grid.collisionFilters[index] : uint2(0);
+    int ix = hashPosition.x;
+    int iy = hashPosition.y;
+    int iz = hashPosition.z;
+
+    for (int x = ix - 1; x <= ix + 1; x++) {
+        for (int y = iy - 1; y <= iy + 1; y++) {
+            for (int z = iz - 1; z <= iz + 1; z++) {
+                const int3 neighborCell = int3(x, y, z);
+                const int3 offset = neighborCell - hashPosition;
+                if (halfStencil && isBackwardOffset(offset)) { continue; }
+                if (!isGridCell(neighborCell)) { continue; }
+                uint hash = getHash(neighborCell, grid.hashTableCapacity);
+                uint start = grid.cellStart[hash];
+                if (!usesCellOffsets && start == UINT_MAX) { continue; }
+                uint end = usesCellOffsets ? grid.cellStart[hash + 1] : grid.cellEnd[hash];
+
+                for (uint i = start; i < end; i++) {
+                    uint collisionCandidate = grid.hashTable[i].y;
+                    if (collisionCandidate == UINT_MAX) { break; }
+                    if (collisionCandidate == index) { continue; }
+                    if (isConnected(connectedVertices, collisionCandidate)) { continue; }
+                    if (usesCollisionFilters && !canCollide(filter, grid.collisionFilters[collisionCandidate])) { continue; }
+
+                    StoredPosition candidatePosition = loadStoredPosition(grid.sortedPositions, i, grid.cellSize);
+                    if (halfStencil && all(offset == 0) && collisionCandidate < index) { continue; }
+                    if (any(wrapCell(gridCell(candidatePosition.cell)) != wrapCell(neighborCell))) { continue; }
+                    float3 diff = storedPositionsDifference(position, candidatePosition, grid.cellSize);
+                    float distanceSq = length_squared(diff);
+                    float errorSq = distanceSq - pow(proximity, 2.0);
+                    if (errorSq >= 0.0) { continue; }
+
+                    if (!visitor(outputIndex(i, collisionCandidate), distanceSq)) { return; }
+                }
+            }
+        }
+    }
+}
+
+struct CollisionCandidatesWriter {
+    device uint* collisionCandidates;
+    uint maxCollisionCandidatesCount;
+    uint count;
+    /// Set when a candidate is found beyond `maxCollisionCandidatesCount`.
+    bool overflowed;
+
+    bool operator()(uint collisionCandidate, float) {
+        if (count == maxCollisionCandidatesCount) {
+            overflowed = true;
+            return false;
+        }
+        collisionCandidates[count] = collisionCandidate;
+        count += 1;
+        return true;
+    }
+};
+
+/// Must match `SpatialHashing.maxNearestCandidatesCount`.
+#define MAX_NEAREST_CANDIDATES_COUNT 16
+
+/// The `k` nearest candidates visited so far in a bounded max-heap, the farthest candidate at the root,
+/// so a closer candidate replaces the farthest one in `log(k)` steps.
+struct NearestCandidates {
+    float distancesSq[MAX_NEAREST_CANDIDATES_COUNT];
+    uint candidates[MAX_NEAREST_CANDIDATES_COUNT];
+    uint k;
+    uint count;
+
+    bool operator()(uint candidate, float distanceSq) {
+        if (count < k) {
+            // Sift up from the new leaf.
+            uint i = count;
+            count += 1;
+            while (i > 0) {
+                uint parent = (i - 1) / 2;
+                if (distancesSq[parent] >= distanceSq) { break; }
+                distancesSq[i] = distancesSq[parent];
+                candidates[i] = candidates[parent];
+                i = parent;
+            }
+            distancesSq[i] = distanceSq;
+            candidates[i] = candidate;
+        } else if (distanceSq < distancesSq[0]) {
+            siftDown(count, candidate, distanceSq);
+        }
+        return true;
+    }
+
+    /// Places `candidate` at the root of the first `size` entries and sifts it down.
+    void siftDown(uint size, uint candidate, float distanceSq) {
+        uint i = 0;
+        while (true) {
+            uint child = 2 * i + 1;
+            if (child >= size) { break; }
+            if (child + 1 < size && distancesSq[child + 1] > distancesSq[child]) { child += 1; }
+            if (distancesSq[child] <= distanceSq) { break; }
+            distancesSq[i] = distancesSq[child];
+            candidates[i] = candidates[child];
+            i = child;
+        }
+        distancesSq[i] = distanceSq;
+        candidates[i] = candidate;
+    }
+
+    /// Writes the candidates by increasing distance, terminated with `UINT_MAX` when fewer than `maxCount`.
+    void write(device uint* output, uint maxCount) {
+        // Heap sort: the farthest candidate moves behind the shrinking heap.
+        for (uint size = count; size > 1; size--) {
+            uint last = candidates[size - 1];
+            float lastDistanceSq = distancesSq[size - 1];
+            candidates[size - 1] = candidates[0];
+            distancesSq[size - 1] = distancesSq[0];
+            siftDown(size - 1, last, lastDistanceSq);
+        }
+        for (uint i = 0; i < count; i++) {
+            output[i] = candidates[i];
+        }
+        if (count < maxCount) {
+            output[count] = UINT_MAX;
+        }
+    }
+};
+
 kernel void findCollisionCandidates(
     device uint* collisionCandidates [[ buffer(0) ]],
     constant uint2* hashTable [[ buffer(1) ]],
@@ -82,71 +568,943 @@ kernel void findCollisionCandidates(
     constant uint& maxCollisionCandidatesCount [[ buffer(9) ]],
     constant uint& connectedVerticesCount [[ buffer(10) ]],
     constant uint& gridSize [[ buffer(11) ]],
+    constant uint2* collisionFilters [[ buffer(14) ]],
+    device atomic_uint* overflowedVerticesCount [[ buffer(15) ]],
     uint gid [[ thread_position_in_grid ]]
 ) {
     if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
     uint index = hashTable[gid].y;
     if (index == UINT_MAX) { return; }
 
-    float3 position = float3(sortedPositions[gid].xyz);
-    int3 hashPosition = hashCoord(position, cellSize);
-    int ix = hashPosition.x;
-    int iy = hashPosition.y;
-    int iz = hashPosition.z;
+    const CollisionGrid grid = {
+        hashTable, cellStart, cellEnd, sortedPositions, hashTableCapacity, cellSize, collisionFilters
+    };
+    const ConnectedVertices connected = loadConnectedVertices(connectedVertices, connectedVerticesCount, index);
+    const StoredPosition position = loadStoredPosition(sortedPositions, gid, cellSize);
+    const float proximity = cellSize * spacingScale;
+
+    CollisionCandidatesWriter writer = {
+        collisionCandidates + outputIndex(gid, index) * maxCollisionCandidatesCount,
+        maxCollisionCandidatesCount,
+        0,
+        false
+    };
+    forEachCollisionCandidate<false>(grid, position, index, connected, proximity, writer);
     
-    uint4 simdConnectedVertices[MAX_CONNECTED_VERTICES / 4];
-    uint simdConnectedVerticesCount = connectedVerticesCount / 4;
+    if (writer.count < maxCollisionCandidatesCount) {
+        writer.collisionCandidates[writer.count] = UINT_MAX;
+    }
+    if (writer.overflowed) {
+        atomic_fetch_add_explicit(overflowedVerticesCount, 1, memory_order_relaxed);
+    }
+}
 
-    for (uint i = 0; i < simdConnectedVerticesCount; i++) {
-        uint baseIndex = index * connectedVerticesCount + i * 4;
-        
-        simdConnectedVertices[i] = uint4(
-            connectedVertices[baseIndex],
-            connectedVertices[baseIndex + 1],
-            connectedVertices[baseIndex + 2],
-            connectedVertices[baseIndex + 3]
-        );
-    }
-        
+/// `findCollisionCandidates` keeping the `maxCollisionCandidatesCount` nearest candidates, up to
+/// `MAX_NEAREST_CANDIDATES_COUNT`, sorted by increasing distance.
+kernel void findNearestCollisionCandidates(
+    device uint* collisionCandidates [[ buffer(0) ]],
+    constant uint2* hashTable [[ buffer(1) ]],
+    constant uint* cellStart [[ buffer(2) ]],
+    constant uint* cellEnd [[ buffer(3) ]],
+    constant half4* sortedPositions [[ buffer(4) ]],
+    constant uint* connectedVertices [[buffer(5)]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant float& spacingScale [[ buffer(7) ]],
+    constant float& cellSize [[ buffer(8) ]],
+    constant uint& maxCollisionCandidatesCount [[ buffer(9) ]],
+    constant uint& connectedVerticesCount [[ buffer(10) ]],
+    constant uint& gridSize [[ buffer(11) ]],
+    constant uint2* collisionFilters [[ buffer(14) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint index = hashTable[gid].y;
+    if (index == UINT_MAX) { return; }
+
+    const CollisionGrid grid = {
+        hashTable, cellStart, cellEnd, sortedPositions, hashTableCapacity, cellSize, collisionFilters
+    };
+    const ConnectedVertices connected = loadConnectedVertices(connectedVertices, connectedVerticesCount, index);
+    const StoredPosition position = loadStoredPosition(sortedPositions, gid, cellSize);
     const float proximity = cellSize * spacingScale;
-    
-    uint candidatesCount = 0;
-    
-    for (int x = ix - 1; x <= ix + 1; x++) {
-        for (int y = iy - 1; y <= iy + 1; y++) {
-            for (int z = iz - 1; z <= iz + 1; z++) {
-                uint hash = getHash(int3(x, y, z), hashTableCapacity);
-                uint start = cellStart[hash];
-                if (start == UINT_MAX) { continue; }
-                uint end = min(cellEnd[hash], start + maxCollisionCandidatesCount);
-                
-                for (uint i = start; i < end; i++) {
-                    uint collisionCandidate = hashTable[i].y;
-                    if (collisionCandidate == UINT_MAX) { break; }
-                    if (collisionCandidate == index) { continue; }
 
-                    bool isConnected = false;
-                    for (uint j = 0; j < simdConnectedVerticesCount; j++) {
-                        isConnected = any(simdConnectedVertices[j] == collisionCandidate);
-                        if (isConnected) { break; }
+    NearestCandidates nearest;
+    nearest.k = min(maxCollisionCandidatesCount, uint(MAX_NEAREST_CANDIDATES_COUNT));
+    nearest.count = 0;
+    forEachCollisionCandidate<false>(grid, position, index, connected, proximity, nearest);
+    nearest.write(collisionCandidates + outputIndex(gid, index) * maxCollisionCandidatesCount, maxCollisionCandidatesCount);
+}
+
+/// `findCollisionCandidates` with the SIMD group visiting the neighbor cells together.
+///
+/// The lanes of a SIMD group hold consecutive sorted vertices, which mostly share their neighbor cells.
+/// For every stencil offset the group visits the distinct neighbor cells of its lanes one at a time:
+/// the cell entries are loaded once, one entry per lane, and broadcast to the lanes querying that cell.
+/// Unlike `findCollisionCandidates` all the threads of a SIMD group have to run, so the grid must be
+/// dispatched covering `gridSize` in full threadgroups.
+kernel void findCollisionCandidatesCooperative(
+    device uint* collisionCandidates [[ buffer(0) ]],
+    constant uint2* hashTable [[ buffer(1) ]],
+    constant uint* cellStart [[ buffer(2) ]],
+    constant uint* cellEnd [[ buffer(3) ]],
+    constant half4* sortedPositions [[ buffer(4) ]],
+    constant uint* connectedVertices [[buffer(5)]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant float& spacingScale [[ buffer(7) ]],
+    constant float& cellSize [[ buffer(8) ]],
+    constant uint& maxCollisionCandidatesCount [[ buffer(9) ]],
+    constant uint& connectedVerticesCount [[ buffer(10) ]],
+    constant uint& gridSize [[ buffer(11) ]],
+    constant uint2* collisionFilters [[ buffer(14) ]],
+    device atomic_uint* overflowedVerticesCount [[ buffer(15) ]],
+    uint gid [[ thread_position_in_grid ]],
+    uint simdLane [[ thread_index_in_simdgroup ]],
+    uint simdWidth [[ threads_per_simdgroup ]]
+) {
+    // Threads beyond the grid keep taking part in the SIMD group operations.
+    const uint sortedIndex = min(gid, gridSize - 1);
+    const uint index = hashTable[sortedIndex].y;
+    const bool isActive = gid < gridSize && index != UINT_MAX;
+
+    const ConnectedVertices connected = loadConnectedVertices(connectedVertices, connectedVerticesCount, isActive ? index : 0);
+    const StoredPosition position = loadStoredPosition(sortedPositions, sortedIndex, cellSize);
+    const float proximity = cellSize * spacingScale;
+    const int3 cell = gridCell(position.cell);
+    const uint2 filter = usesCollisionFilters && isActive ? collisionFilters[index] : uint2(0);
+    device uint* candidates = collisionCandidates + (isActive ? outputIndex(sortedIndex, index) : 0) * maxCollisionCandidatesCount;
+    uint count = 0;
+    bool overflowed = false;
+
+    for (int x = -1; x <= 1; x++) {
+        for (int y = -1; y <= 1; y++) {
+            for (int z = -1; z <= 1; z++) {
+                int3 neighborCell = cell + int3(x, y, z);
+                uint hash = getHash(neighborCell, hashTableCapacity);
+                bool isPending = isActive && isGridCell(neighborCell);
+
+                while (simd_any(isPending)) {
+                    const uint cellHash = simd_min(isPending ? hash : UINT_MAX);
+                    const bool isQuerying = isPending && hash == cellHash;
+                    isPending = isPending && !isQuerying;
+
+                    uint start = cellStart[cellHash];
+                    if (!usesCellOffsets && start == UINT_MAX) { continue; }
+                    uint end = usesCellOffsets ? cellStart[cellHash + 1] : cellEnd[cellHash];
+
+                    for (uint chunkStart = start; chunkStart < end; chunkStart += simdWidth) {
+                        uint entry = chunkStart + simdLane;
+                        uint entryVertex = entry < end ? hashTable[entry].y : UINT_MAX;
+                        StoredPosition entryPosition = entry < end
+                                                     ? loadStoredPosition(sortedPositions, entry, cellSize)
+                                                     : StoredPosition { int3(0), float3(0.0) };
+                        uint chunkCount = min(simdWidth, end - chunkStart);
+
+                        for (uint i = 0; i < chunkCount; i++) {
+                            uint collisionCandidate = simd_shuffle(entryVertex, i);
+                            uint outputCandidate = simd_shuffle(outputIndex(entry, entryVertex), i);
+                            StoredPosition candidatePosition = {
+                                simd_shuffle(entryPosition.cell, i),
+                                simd_shuffle(entryPosition.position, i)
+                            };
+
+                            if (!isQuerying || overflowed) { continue; }
+                            if (collisionCandidate == UINT_MAX || collisionCandidate == index) { continue; }
+                            // Another cell of the stencil hashed into the same slot visits its own entries.
+                            if (any(wrapCell(gridCell(candidatePosition.cell)) != wrapCell(neighborCell))) { continue; }
+                            if (isConnected(connected, collisionCandidate)) { continue; }
+                            if (usesCollisionFilters && !canCollide(filter, collisionFilters[collisionCandidate])) { continue; }
+                            float3 diff = storedPositionsDifference(position, candidatePosition, cellSize);
+                            if (length_squared(diff) - pow(proximity, 2.0) >= 0.0) { continue; }
+
+                            if (count == maxCollisionCandidatesCount) {
+                                overflowed = true;
+                                continue;
+                            }
+                            candidates[count] = outputCandidate;
+                            count += 1;
+                        }
                     }
-                    if (isConnected) { continue; }
+                }
+            }
+        }
+    }
+
+    if (isActive && count < maxCollisionCandidatesCount) {
+        candidates[count] = UINT_MAX;
+    }
+    if (overflowed) {
+        atomic_fetch_add_explicit(overflowedVerticesCount, 1, memory_order_relaxed);
+    }
+}
+
+struct CollisionPairsCounter {
+    uint index;
+    uint count;
+
+    bool operator()(uint collisionCandidate, float) {
+        count += collisionCandidate > index ? 1 : 0;
+        return true;
+    }
+};
+
+struct CollisionPairsWriter {
+    device uint2* collisionPairs;
+    uint index;
+    uint capacity;
+    uint count;
+
+    bool operator()(uint collisionCandidate, float) {
+        if (collisionCandidate < index) { return true; }
+        if (count >= capacity) { return false; }
+        collisionPairs[count] = uint2(index, collisionCandidate);
+        count += 1;
+        return true;
+    }
+};
+
+/// Writes every pair once as `(i, j)` with `i < j` into a compact list.
+/// The pairs of a vertex are contiguous and described by `vertexPairRanges[i] = (offset, count)`.
+/// `collisionPairsCount` receives the number of requested pairs, which exceeds
+/// `collisionPairsCapacity` when the pairs list overflowed.
+kernel void findCollisionPairs(
+    device uint2* collisionPairs [[ buffer(0) ]],
+    constant uint2* hashTable [[ buffer(1) ]],
+    constant uint* cellStart [[ buffer(2) ]],
+    constant uint* cellEnd [[ buffer(3) ]],
+    constant half4* sortedPositions [[ buffer(4) ]],
+    constant uint* connectedVertices [[buffer(5)]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant float& spacingScale [[ buffer(7) ]],
+    constant float& cellSize [[ buffer(8) ]],
+    constant uint& collisionPairsCapacity [[ buffer(9) ]],
+    constant uint& connectedVerticesCount [[ buffer(10) ]],
+    constant uint& gridSize [[ buffer(11) ]],
+    device uint2* vertexPairRanges [[ buffer(12) ]],
+    device atomic_uint* collisionPairsCount [[ buffer(13) ]],
+    constant uint2* collisionFilters [[ buffer(14) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint index = hashTable[gid].y;
+    if (index == UINT_MAX) { return; }
+
+    const CollisionGrid grid = {
+        hashTable, cellStart, cellEnd, sortedPositions, hashTableCapacity, cellSize, collisionFilters
+    };
+    const ConnectedVertices connected = loadConnectedVertices(connectedVertices, connectedVerticesCount, index);
+    const StoredPosition position = loadStoredPosition(sortedPositions, gid, cellSize);
+    const float proximity = cellSize * spacingScale;
+
+    const uint outputVertex = outputIndex(gid, index);
+    CollisionPairsCounter counter = { outputVertex, 0 };
+    forEachCollisionCandidate<false>(grid, position, index, connected, proximity, counter);
+
+    uint offset = 0;
+    uint capacity = 0;
+    if (counter.count > 0) {
+        offset = atomic_fetch_add_explicit(collisionPairsCount, counter.count, memory_order_relaxed);
+        capacity = offset < collisionPairsCapacity ? min(counter.count, collisionPairsCapacity - offset) : 0;
+    }
+
+    CollisionPairsWriter writer = { collisionPairs + offset, outputVertex, capacity, 0 };
+    if (capacity > 0) {
+        forEachCollisionCandidate<false>(grid, position, index, connected, proximity, writer);
+    }
+    vertexPairRanges[outputVertex] = uint2(offset, writer.count);
+}
+
+struct CompactCandidatesCounter {
+    uint count;
+
+    bool operator()(uint collisionCandidate, float) {
+        count += 1;
+        return true;
+    }
+};
+
+struct CompactCandidatesWriter {
+    device uint* collisionCandidates;
+    uint capacity;
+    uint count;
+
+    bool operator()(uint collisionCandidate, float) {
+        if (count >= capacity) { return false; }
+        collisionCandidates[count] = collisionCandidate;
+        count += 1;
+        return true;
+    }
+};
+
+/// `findCollisionCandidates` into a compact list: the candidates of a vertex are counted, allocated from
+/// `collisionCandidatesCount` and written on a second traversal, described by `vertexCandidateRanges[i] = (offset, count)`.
+/// `collisionCandidatesCount` receives the number of found candidates, which exceeds
+/// `collisionCandidatesCapacity` when the candidates list overflowed.
+kernel void findCompactCollisionCandidates(
+    device uint* collisionCandidates [[ buffer(0) ]],
+    constant uint2* hashTable [[ buffer(1) ]],
+    constant uint* cellStart [[ buffer(2) ]],
+    constant uint* cellEnd [[ buffer(3) ]],
+    constant half4* sortedPositions [[ buffer(4) ]],
+    constant uint* connectedVertices [[buffer(5)]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant float& spacingScale [[ buffer(7) ]],
+    constant float& cellSize [[ buffer(8) ]],
+    constant uint& collisionCandidatesCapacity [[ buffer(9) ]],
+    constant uint& connectedVerticesCount [[ buffer(10) ]],
+    constant uint& gridSize [[ buffer(11) ]],
+    device uint2* vertexCandidateRanges [[ buffer(12) ]],
+    device atomic_uint* collisionCandidatesCount [[ buffer(13) ]],
+    constant uint2* collisionFilters [[ buffer(14) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint index = hashTable[gid].y;
+    if (index == UINT_MAX) { return; }
+
+    const CollisionGrid grid = {
+        hashTable, cellStart, cellEnd, sortedPositions, hashTableCapacity, cellSize, collisionFilters
+    };
+    const ConnectedVertices connected = loadConnectedVertices(connectedVertices, connectedVerticesCount, index);
+    const StoredPosition position = loadStoredPosition(sortedPositions, gid, cellSize);
+    const float proximity = cellSize * spacingScale;
+
+    CompactCandidatesCounter counter = { 0 };
+    forEachCollisionCandidate<false>(grid, position, index, connected, proximity, counter);
+
+    uint offset = 0;
+    uint capacity = 0;
+    if (counter.count > 0) {
+        offset = atomic_fetch_add_explicit(collisionCandidatesCount, counter.count, memory_order_relaxed);
+        capacity = offset < collisionCandidatesCapacity ? min(counter.count, collisionCandidatesCapacity - offset) : 0;
+    }
+
+    CompactCandidatesWriter writer = { collisionCandidates + offset, capacity, 0 };
+    if (capacity > 0) {
+        forEachCollisionCandidate<false>(grid, position, index, connected, proximity, writer);
+    }
+    vertexCandidateRanges[outputIndex(gid, index)] = uint2(offset, writer.count);
+}
+
+// MARK: - Point Query
+
+/// A point decoded like the sorted positions, at full precision.
+static StoredPosition pointStoredPosition(float3 point, float cellSize) {
+    if (usesCellRelativePositions) {
+        float3 scaledPoint = point / cellSize;
+        float3 cell = floor(scaledPoint);
+        return { wrapCell(int3(cell)), (scaledPoint - cell) * cellSize };
+    }
+    return { hashCoord(point, cellSize), point };
+}
+
+/// Calls `visitor(vertex, distanceSq)` for every sorted vertex closer than `radius` to `point`, given by its `outputIndex`.
+/// Every cell overlapped by the sphere is visited once, and the entries of a slot holding other cells are skipped.
+template <typename Visitor>
+static void forEachPointCandidate(
+    thread const CollisionGrid& grid,
+    float3 point,
+    float radius,
+    thread Visitor& visitor
+) {
+    const StoredPosition position = pointStoredPosition(point, grid.cellSize);
+    const int3 lowerCell = gridCell(hashCoord(point - radius, grid.cellSize));
+    const int3 upperCell = gridCell(hashCoord(point + radius, grid.cellSize));
+
+    for (int x = lowerCell.x; x <= upperCell.x; x++) {
+        for (int y = lowerCell.y; y <= upperCell.y; y++) {
+            for (int z = lowerCell.z; z <= upperCell.z; z++) {
+                const int3 cell = int3(x, y, z);
+                uint hash = getHash(cell, grid.hashTableCapacity);
+                uint start = grid.cellStart[hash];
+                if (!usesCellOffsets && start == UINT_MAX) { continue; }
+                uint end = usesCellOffsets ? grid.cellStart[hash + 1] : grid.cellEnd[hash];
+
+                for (uint i = start; i < end; i++) {
+                    uint vertex = grid.hashTable[i].y;
+                    if (vertex == UINT_MAX) { break; }
 
-                    float3 candidatePosition = float3(sortedPositions[i].xyz);
-                    float3 diff = position - candidatePosition;
+                    StoredPosition vertexPosition = loadStoredPosition(grid.sortedPositions, i, grid.cellSize);
+                    if (any(wrapCell(gridCell(vertexPosition.cell)) != wrapCell(cell))) { continue; }
+                    float3 diff = storedPositionsDifference(position, vertexPosition, grid.cellSize);
                     float distanceSq = length_squared(diff);
-                    float errorSq = distanceSq - pow(proximity, 2.0);
-                    if (errorSq >= 0.0) { continue; }
+                    if (distanceSq >= radius * radius) { continue; }
 
-                    collisionCandidates[index * maxCollisionCandidatesCount + candidatesCount] = collisionCandidate;
-                    candidatesCount += 1;
-                    if (candidatesCount >= maxCollisionCandidatesCount) { return; }
+                    if (!visitor(outputIndex(i, vertex), distanceSq)) { return; }
                 }
             }
         }
     }
-    
-    if (candidatesCount < maxCollisionCandidatesCount) {
-        collisionCandidates[index * maxCollisionCandidatesCount + candidatesCount] = UINT_MAX;
+}
+
+struct PointPairsCounter {
+    uint count;
+
+    bool operator()(uint, float) {
+        count += 1;
+        return true;
+    }
+};
+
+struct PointPairsWriter {
+    device uint2* collisionPairs;
+    uint point;
+    uint capacity;
+    uint count;
+
+    bool operator()(uint vertex, float) {
+        if (count >= capacity) { return false; }
+        collisionPairs[count] = uint2(point, vertex);
+        count += 1;
+        return true;
+    }
+};
+
+/// Writes the `(point, vertex)` pairs of every point and the sorted vertices closer than `radius`
+/// into a compact list, `vertexPairRanges[point] = (offset, count)`.
+kernel void findPointPairs(
+    device uint2* collisionPairs [[ buffer(0) ]],
+    constant uint2* hashTable [[ buffer(1) ]],
+    constant uint* cellStart [[ buffer(2) ]],
+    constant uint* cellEnd [[ buffer(3) ]],
+    constant half4* sortedPositions [[ buffer(4) ]],
+    constant float4* points [[ buffer(5) ]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant float& radius [[ buffer(7) ]],
+    constant float& cellSize [[ buffer(8) ]],
+    constant uint& collisionPairsCapacity [[ buffer(9) ]],
+    device uint2* vertexPairRanges [[ buffer(10) ]],
+    device atomic_uint* collisionPairsCount [[ buffer(11) ]],
+    constant uint& gridSize [[ buffer(12) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    const CollisionGrid grid = {
+        hashTable, cellStart, cellEnd, sortedPositions, hashTableCapacity, cellSize, nullptr
+    };
+    const float3 point = points[gid].xyz;
+
+    PointPairsCounter counter = { 0 };
+    forEachPointCandidate(grid, point, radius, counter);
+
+    uint offset = 0;
+    uint capacity = 0;
+    if (counter.count > 0) {
+        offset = atomic_fetch_add_explicit(collisionPairsCount, counter.count, memory_order_relaxed);
+        capacity = offset < collisionPairsCapacity ? min(counter.count, collisionPairsCapacity - offset) : 0;
+    }
+
+    PointPairsWriter writer = { collisionPairs + offset, gid, capacity, 0 };
+    if (capacity > 0) {
+        forEachPointCandidate(grid, point, radius, writer);
+    }
+    vertexPairRanges[gid] = uint2(offset, writer.count);
+}
+
+/// Writes the `nearestCount` sorted vertices nearest to every point and closer than `radius`,
+/// up to `MAX_NEAREST_CANDIDATES_COUNT`, by increasing distance.
+kernel void findNearestPointVertices(
+    device uint* nearestVertices [[ buffer(0) ]],
+    constant uint2* hashTable [[ buffer(1) ]],
+    constant uint* cellStart [[ buffer(2) ]],
+    constant uint* cellEnd [[ buffer(3) ]],
+    constant half4* sortedPositions [[ buffer(4) ]],
+    constant float4* points [[ buffer(5) ]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant float& radius [[ buffer(7) ]],
+    constant float& cellSize [[ buffer(8) ]],
+    constant uint& nearestCount [[ buffer(9) ]],
+    constant uint& gridSize [[ buffer(10) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    const CollisionGrid grid = {
+        hashTable, cellStart, cellEnd, sortedPositions, hashTableCapacity, cellSize, nullptr
+    };
+
+    NearestCandidates nearest;
+    nearest.k = min(nearestCount, uint(MAX_NEAREST_CANDIDATES_COUNT));
+    nearest.count = 0;
+    forEachPointCandidate(grid, points[gid].xyz, radius, nearest);
+    nearest.write(nearestVertices + gid * nearestCount, nearestCount);
+}
+
+// MARK: - Half Stencil Query
+
+struct HalfStencilPairsCounter {
+    uint count;
+
+    bool operator()(uint, float) {
+        count += 1;
+        return true;
+    }
+};
+
+struct HalfStencilPairsWriter {
+    device uint2* collisionPairs;
+    uint index;
+    uint capacity;
+    uint count;
+
+    bool operator()(uint collisionCandidate, float) {
+        if (count >= capacity) { return false; }
+        collisionPairs[count] = uint2(min(index, collisionCandidate), max(index, collisionCandidate));
+        count += 1;
+        return true;
+    }
+};
+
+/// `findCollisionPairs` visiting the half stencil, so every pair is distance tested once.
+/// The pairs are still written as `(i, j)` with `i < j`, but `vertexPairRanges[i]` describes
+/// the pairs found by vertex `i`, which also contain pairs `(j, i)`.
+kernel void findCollisionPairsHalfStencil(
+    device uint2* collisionPairs [[ buffer(0) ]],
+    constant uint2* hashTable [[ buffer(1) ]],
+    constant uint* cellStart [[ buffer(2) ]],
+    constant uint* cellEnd [[ buffer(3) ]],
+    constant half4* sortedPositions [[ buffer(4) ]],
+    constant uint* connectedVertices [[buffer(5)]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant float& spacingScale [[ buffer(7) ]],
+    constant float& cellSize [[ buffer(8) ]],
+    constant uint& collisionPairsCapacity [[ buffer(9) ]],
+    constant uint& connectedVerticesCount [[ buffer(10) ]],
+    constant uint& gridSize [[ buffer(11) ]],
+    device uint2* vertexPairRanges [[ buffer(12) ]],
+    device atomic_uint* collisionPairsCount [[ buffer(13) ]],
+    constant uint2* collisionFilters [[ buffer(14) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint index = hashTable[gid].y;
+    if (index == UINT_MAX) { return; }
+
+    const CollisionGrid grid = {
+        hashTable, cellStart, cellEnd, sortedPositions, hashTableCapacity, cellSize, collisionFilters
+    };
+    const ConnectedVertices connected = loadConnectedVertices(connectedVertices, connectedVerticesCount, index);
+    const StoredPosition position = loadStoredPosition(sortedPositions, gid, cellSize);
+    const float proximity = cellSize * spacingScale;
+
+    HalfStencilPairsCounter counter = { 0 };
+    forEachCollisionCandidate<true>(grid, position, index, connected, proximity, counter);
+
+    uint offset = 0;
+    uint capacity = 0;
+    if (counter.count > 0) {
+        offset = atomic_fetch_add_explicit(collisionPairsCount, counter.count, memory_order_relaxed);
+        capacity = offset < collisionPairsCapacity ? min(counter.count, collisionPairsCapacity - offset) : 0;
+    }
+
+    const uint outputVertex = outputIndex(gid, index);
+    HalfStencilPairsWriter writer = { collisionPairs + offset, outputVertex, capacity, 0 };
+    if (capacity > 0) {
+        forEachCollisionCandidate<true>(grid, position, index, connected, proximity, writer);
+    }
+    vertexPairRanges[outputVertex] = uint2(offset, writer.count);
+}
+
+/// Appends every found pair to the candidates of both of its vertices.
+struct MirroredCandidatesWriter {
+    device uint* collisionCandidates;
+    device atomic_uint* collisionCandidatesCounts;
+    uint index;
+    uint maxCollisionCandidatesCount;
+
+    void append(uint vertex, uint collisionCandidate) {
+        uint slot = atomic_fetch_add_explicit(&collisionCandidatesCounts[vertex], 1, memory_order_relaxed);
+        if (slot < maxCollisionCandidatesCount) {
+            collisionCandidates[vertex * maxCollisionCandidatesCount + slot] = collisionCandidate;
+        }
+    }
+
+    bool operator()(uint collisionCandidate, float) {
+        append(index, collisionCandidate);
+        append(collisionCandidate, index);
+        return true;
     }
+};
+
+/// `findCollisionCandidates` visiting the half stencil and mirroring every pair into the candidates
+/// of both vertices. The candidates are unordered and terminated by `terminateCollisionCandidates`.
+kernel void findCollisionCandidatesHalfStencil(
+    device uint* collisionCandidates [[ buffer(0) ]],
+    constant uint2* hashTable [[ buffer(1) ]],
+    constant uint* cellStart [[ buffer(2) ]],
+    constant uint* cellEnd [[ buffer(3) ]],
+    constant half4* sortedPositions [[ buffer(4) ]],
+    constant uint* connectedVertices [[buffer(5)]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant float& spacingScale [[ buffer(7) ]],
+    constant float& cellSize [[ buffer(8) ]],
+    constant uint& maxCollisionCandidatesCount [[ buffer(9) ]],
+    constant uint& connectedVerticesCount [[ buffer(10) ]],
+    constant uint& gridSize [[ buffer(11) ]],
+    device atomic_uint* collisionCandidatesCounts [[ buffer(12) ]],
+    constant uint2* collisionFilters [[ buffer(14) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint index = hashTable[gid].y;
+    if (index == UINT_MAX) { return; }
+
+    const CollisionGrid grid = {
+        hashTable, cellStart, cellEnd, sortedPositions, hashTableCapacity, cellSize, collisionFilters
+    };
+    const ConnectedVertices connected = loadConnectedVertices(connectedVertices, connectedVerticesCount, index);
+    const StoredPosition position = loadStoredPosition(sortedPositions, gid, cellSize);
+    const float proximity = cellSize * spacingScale;
+
+    MirroredCandidatesWriter writer = {
+        collisionCandidates, collisionCandidatesCounts, outputIndex(gid, index), maxCollisionCandidatesCount
+    };
+    forEachCollisionCandidate<true>(grid, position, index, connected, proximity, writer);
+}
+
+kernel void terminateCollisionCandidates(
+    device uint* collisionCandidates [[ buffer(0) ]],
+    constant uint* collisionCandidatesCounts [[ buffer(1) ]],
+    constant uint& maxCollisionCandidatesCount [[ buffer(2) ]],
+    constant uint& gridSize [[ buffer(3) ]],
+    device atomic_uint* overflowedVerticesCount [[ buffer(4) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint count = collisionCandidatesCounts[gid];
+    if (count < maxCollisionCandidatesCount) {
+        collisionCandidates[gid * maxCollisionCandidatesCount + count] = UINT_MAX;
+    } else if (count > maxCollisionCandidatesCount) {
+        // The mirrored pairs beyond the budget were counted but not written.
+        atomic_fetch_add_explicit(overflowedVerticesCount, 1, memory_order_relaxed);
+    }
+}
+
+/// Writes the `MTLDispatchThreadgroupsIndirectArguments` covering the stored collision pairs.
+kernel void writeCollisionPairsDispatchArguments(
+    device uint* dispatchArguments [[ buffer(0) ]],
+    device const uint* collisionPairsCount [[ buffer(1) ]],
+    constant uint& collisionPairsCapacity [[ buffer(2) ]],
+    constant uint& threadgroupWidth [[ buffer(3) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (gid > 0) { return; }
+    uint count = min(collisionPairsCount[0], collisionPairsCapacity);
+    dispatchArguments[0] = (count + threadgroupWidth - 1) / threadgroupWidth;
+    dispatchArguments[1] = 1;
+    dispatchArguments[2] = 1;
+}
+
+// MARK: - Hierarchical Grid
+
+/// The level a vertex of `radius` is inserted at: the finest level which cells are at least the vertex diameter,
+/// the cell size doubling from one level to the next. Vertices too large for the coarsest level are clamped to it.
+static uint gridLevel(float radius, float cellSize, uint levelsCount) {
+    uint level = 0;
+    float levelCellSize = cellSize;
+    while (level + 1 < levelsCount && 2.0 * radius > levelCellSize) {
+        level += 1;
+        levelCellSize *= 2.0;
+    }
+    return level;
+}
+
+/// The slot of `cell` of `level`. The cells of every level are offset apart, so the levels share the hash table.
+static uint getLevelHash(int3 cell, uint level, uint hashTableCapacity) {
+    return getHash(cell + int3(int(level) << 20), hashTableCapacity);
+}
+
+/// Converts the positions and writes the hash of every vertex in the cell of its level and its index.
+/// The vertices wider than the coarsest cells are counted in `clampedVerticesCount`, as the neighbor cells
+/// of their level don't cover their reach.
+kernel void convertPositionsAndComputeLevelHashAndIndex(
+    constant float4* positions [[ buffer(0) ]],
+    device half4* outPositions [[ buffer(1) ]],
+    device uint2* hashTable [[ buffer(2) ]],
+    constant uint& hashTableCapacity [[ buffer(3) ]],
+    constant float& cellSize [[ buffer(4) ]],
+    constant uint& gridSize [[ buffer(5) ]],
+    constant float* radii [[ buffer(6) ]],
+    constant uint& levelsCount [[ buffer(7) ]],
+    device atomic_uint* clampedVerticesCount [[ buffer(8) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    storePosition(positions, outPositions, gid, cellSize);
+    // The cell of the stored position, which the queries decode.
+    float3 position = usesFullPrecisionPositions ? positions[gid].xyz : float3(half3(positions[gid].xyz));
+    uint level = gridLevel(radii[gid], cellSize, levelsCount);
+    float levelCellSize = cellSize * float(1 << level);
+    if (2.0 * radii[gid] > levelCellSize) {
+        atomic_fetch_add_explicit(clampedVerticesCount, 1, memory_order_relaxed);
+    }
+    int3 cell = hashCoord(position, levelCellSize);
+    hashTable[gid] = uint2(getLevelHash(cell, level, hashTableCapacity), gid);
+}
+
+/// Calls `visitor(candidate, distanceSq)` for every vertex closer than the sum of the radii to the vertex `index`,
+/// which is inserted at `level`. The 27 cells around the vertex are visited at its own level and at every coarser one,
+/// as a vertex overlaps at most the neighbor cells of the levels not finer than its own.
+/// The pairs of a level are visited from the vertex with the smaller index, so every pair is visited once.
+template <typename Visitor>
+static void forEachHierarchicalCandidate(
+    thread const CollisionGrid& grid,
+    constant float* radii,
+    uint levelsCount,
+    float3 position,
+    uint index,
+    float radius,
+    thread Visitor& visitor
+) {
+    const uint level = gridLevel(radius, grid.cellSize, levelsCount);
+    for (uint candidatesLevel = level; candidatesLevel < levelsCount; candidatesLevel++) {
+        const float levelCellSize = grid.cellSize * float(1 << candidatesLevel);
+        const int3 cell = hashCoord(position, levelCellSize);
+
+        for (int x = -1; x <= 1; x++) {
+            for (int y = -1; y <= 1; y++) {
+                for (int z = -1; z <= 1; z++) {
+                    const int3 neighborCell = cell + int3(x, y, z);
+                    uint hash = getLevelHash(neighborCell, candidatesLevel, grid.hashTableCapacity);
+                    uint start = grid.cellStart[hash];
+                    if (start == UINT_MAX) { continue; }
+                    uint end = grid.cellEnd[hash];
+
+                    for (uint i = start; i < end; i++) {
+                        uint collisionCandidate = grid.hashTable[i].y;
+                        if (collisionCandidate == UINT_MAX) { break; }
+                        if (collisionCandidate == index) { continue; }
+                        if (usesCollisionFilters
+                            && !canCollide(grid.collisionFilters[index], grid.collisionFilters[collisionCandidate])) {
+                            continue;
+                        }
+
+                        // The slot may hold the cells of other levels or other cells of the level.
+                        float candidateRadius = radii[collisionCandidate];
+                        if (gridLevel(candidateRadius, grid.cellSize, levelsCount) != candidatesLevel) { continue; }
+                        if (candidatesLevel == level && collisionCandidate < index) { continue; }
+                        float3 candidatePosition = loadStoredPosition(grid.sortedPositions, i, grid.cellSize).position;
+                        if (any(hashCoord(candidatePosition, levelCellSize) != neighborCell)) { continue; }
+
+                        float distanceSq = length_squared(position - candidatePosition);
+                        if (distanceSq >= pow(radius + candidateRadius, 2.0)) { continue; }
+
+                        if (!visitor(outputIndex(i, collisionCandidate), distanceSq)) { return; }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// Writes every pair of vertices closer than the sum of their radii once as `(i, j)` with `i < j` into a compact list.
+/// `vertexPairRanges[i]` describes the pairs found by vertex `i`, which also contain pairs `(j, i)`.
+kernel void findHierarchicalCollisionPairs(
+    device uint2* collisionPairs [[ buffer(0) ]],
+    constant uint2* hashTable [[ buffer(1) ]],
+    constant uint* cellStart [[ buffer(2) ]],
+    constant uint* cellEnd [[ buffer(3) ]],
+    constant half4* sortedPositions [[ buffer(4) ]],
+    constant float* radii [[ buffer(5) ]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant uint& levelsCount [[ buffer(7) ]],
+    constant float& cellSize [[ buffer(8) ]],
+    constant uint& collisionPairsCapacity [[ buffer(9) ]],
+    constant uint& gridSize [[ buffer(11) ]],
+    device uint2* vertexPairRanges [[ buffer(12) ]],
+    device atomic_uint* collisionPairsCount [[ buffer(13) ]],
+    constant uint2* collisionFilters [[ buffer(14) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint index = hashTable[gid].y;
+    if (index == UINT_MAX) { return; }
+
+    const CollisionGrid grid = {
+        hashTable, cellStart, cellEnd, sortedPositions, hashTableCapacity, cellSize, collisionFilters
+    };
+    const float3 position = loadStoredPosition(sortedPositions, gid, cellSize).position;
+    const float radius = radii[index];
+
+    HalfStencilPairsCounter counter = { 0 };
+    forEachHierarchicalCandidate(grid, radii, levelsCount, position, index, radius, counter);
+
+    uint offset = 0;
+    uint capacity = 0;
+    if (counter.count > 0) {
+        offset = atomic_fetch_add_explicit(collisionPairsCount, counter.count, memory_order_relaxed);
+        capacity = offset < collisionPairsCapacity ? min(counter.count, collisionPairsCapacity - offset) : 0;
+    }
+
+    const uint outputVertex = outputIndex(gid, index);
+    HalfStencilPairsWriter writer = { collisionPairs + offset, outputVertex, capacity, 0 };
+    if (capacity > 0) {
+        forEachHierarchicalCandidate(grid, radii, levelsCount, position, index, radius, writer);
+    }
+    vertexPairRanges[outputVertex] = uint2(offset, writer.count);
+}
+
+// MARK: - Sorted Order
+
+/// Writes the vertex index of every entry of the sorted hash table.
+kernel void writeSortedVertices(
+    constant uint2* hashTable [[ buffer(0) ]],
+    device uint* sortedVertices [[ buffer(1) ]],
+    constant uint& gridSize [[ buffer(2) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    sortedVertices[gid] = hashTable[gid].y;
+}
+
+/// Writes the position of every vertex in the sorted hash table, the inverse of `writeSortedVertices`.
+kernel void writeSortedRanks(
+    constant uint2* hashTable [[ buffer(0) ]],
+    device uint* sortedRanks [[ buffer(1) ]],
+    constant uint& gridSize [[ buffer(2) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    sortedRanks[hashTable[gid].y] = gid;
+}
+
+/// Gathers the per-vertex values of `wordsCount` 32 bit words into the sorted order: `output[i] = input[hashTable[i].y]`.
+kernel void permuteToSortedOrder(
+    device const uint* input [[ buffer(0) ]],
+    device uint* output [[ buffer(1) ]],
+    constant uint2* hashTable [[ buffer(2) ]],
+    constant uint& wordsCount [[ buffer(3) ]],
+    constant uint& gridSize [[ buffer(4) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint source = hashTable[gid].y * wordsCount;
+    uint destination = gid * wordsCount;
+    for (uint i = 0; i < wordsCount; i++) {
+        output[destination + i] = input[source + i];
+    }
+}
+
+/// Scatters the per-vertex values in the sorted order back to the vertex order: `output[hashTable[i].y] = input[i]`.
+kernel void permuteFromSortedOrder(
+    device const uint* input [[ buffer(0) ]],
+    device uint* output [[ buffer(1) ]],
+    constant uint2* hashTable [[ buffer(2) ]],
+    constant uint& wordsCount [[ buffer(3) ]],
+    constant uint& gridSize [[ buffer(4) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint source = gid * wordsCount;
+    uint destination = hashTable[gid].y * wordsCount;
+    for (uint i = 0; i < wordsCount; i++) {
+        output[destination + i] = input[source + i];
+    }
+}
+
+// MARK: - Diagnostics
+
+/// Must match `HashTableDiagnostics.maxDiagnosedSlotOccupancy`.
+#define MAX_DIAGNOSED_SLOT_OCCUPANCY 64
+
+/// Walks the sorted hash table from the first entry of every occupied slot and accumulates
+/// `diagnostics = (occupied slots, max slot occupancy, distinct cells, slots with colliding cells, saturated slots)`.
+/// The entries of a slot aren't ordered by cell, so the distinct cells are found by comparing every entry
+/// with the previous ones. Only the first `MAX_DIAGNOSED_SLOT_OCCUPANCY` entries of a slot are compared,
+/// which bounds the work of a thread, and the slots holding more are counted as saturated.
+kernel void computeHashTableDiagnostics(
+    constant uint2* hashTable [[ buffer(0) ]],
+    constant half4* sortedPositions [[ buffer(1) ]],
+    device atomic_uint* diagnostics [[ buffer(2) ]],
+    constant float& cellSize [[ buffer(3) ]],
+    constant uint& gridSize [[ buffer(4) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint hash = hashTable[gid].x;
+    if (gid > 0 && hashTable[gid - 1].x == hash) { return; }
+
+    uint end = gid + 1;
+    while (end < gridSize && hashTable[end].x == hash) { end++; }
+
+    const uint diagnosedEnd = min(end, gid + MAX_DIAGNOSED_SLOT_OCCUPANCY);
+    uint distinctCellsCount = 0;
+    for (uint i = gid; i < diagnosedEnd; i++) {
+        int3 cell = gridCell(loadStoredPosition(sortedPositions, i, cellSize).cell);
+        bool isFirstOccurrence = true;
+        for (uint j = gid; j < i && isFirstOccurrence; j++) {
+            isFirstOccurrence = any(gridCell(loadStoredPosition(sortedPositions, j, cellSize).cell) != cell);
+        }
+        distinctCellsCount += isFirstOccurrence ? 1 : 0;
+    }
+
+    atomic_fetch_add_explicit(&diagnostics[0], 1, memory_order_relaxed);
+    atomic_fetch_max_explicit(&diagnostics[1], end - gid, memory_order_relaxed);
+    atomic_fetch_add_explicit(&diagnostics[2], distinctCellsCount, memory_order_relaxed);
+    if (distinctCellsCount > 1) {
+        atomic_fetch_add_explicit(&diagnostics[3], 1, memory_order_relaxed);
+    }
+    if (end != diagnosedEnd) {
+        atomic_fetch_add_explicit(&diagnostics[4], 1, memory_order_relaxed);
+    }
+}
+
+#undef MAX_DIAGNOSED_SLOT_OCCUPANCY
+
+// MARK: - Build Statistics
+
+/// Adds the candidates of every vertex to `statistics[0]` and copies the vertices which dropped candidates
+/// to `statistics[1]`. A full list doesn't tell a vertex with exactly `maxCollisionCandidatesCount` candidates
+/// from one that dropped some, so the count comes from the query itself.
+kernel void computeCollisionCandidatesStatistics(
+    device const uint* collisionCandidates [[ buffer(0) ]],
+    device atomic_uint* statistics [[ buffer(1) ]],
+    constant uint& maxCollisionCandidatesCount [[ buffer(2) ]],
+    constant uint& gridSize [[ buffer(3) ]],
+    device const uint* overflowedVerticesCount [[ buffer(4) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (gid == 0) {
+        atomic_store_explicit(&statistics[1], overflowedVerticesCount[0], memory_order_relaxed);
+    }
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    device const uint* candidates = collisionCandidates + gid * maxCollisionCandidatesCount;
+    uint count = 0;
+    while (count < maxCollisionCandidatesCount && candidates[count] != UINT_MAX) { count++; }
+
+    // One atomic per SIMD group keeps the contention on the counter low.
+    uint candidatesCount = simd_sum(count);
+    if (simd_is_first()) {
+        atomic_fetch_add_explicit(&statistics[0], candidatesCount, memory_order_relaxed);
+    }
+}
+
+/// Writes the found pairs to `statistics[0]` and the pairs beyond the capacity to `statistics[2]`.
+kernel void writeCollisionPairsStatistics(
+    device const uint* collisionPairsCount [[ buffer(0) ]],
+    device uint* statistics [[ buffer(1) ]],
+    constant uint& collisionPairsCapacity [[ buffer(2) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (gid > 0) { return; }
+    uint count = collisionPairsCount[0];
+    statistics[0] = count;
+    statistics[2] = count > collisionPairsCapacity ? count - collisionPairsCapacity : 0;
+}
+
+/// Adds the occupied slots to `statistics[3]` and the maximum slot occupancy to `statistics[4]`.
+/// A cheaper subset of `computeHashTableDiagnostics`, which also tells the cells of a slot apart.
+kernel void computeSlotOccupancyStatistics(
+    device const uint2* hashTable [[ buffer(0) ]],
+    device atomic_uint* statistics [[ buffer(1) ]],
+    constant uint& gridSize [[ buffer(2) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    uint hash = hashTable[gid].x;
+    if (gid > 0 && hashTable[gid - 1].x == hash) { return; }
+
+    uint end = gid + 1;
+    while (end < gridSize && hashTable[end].x == hash) { end++; }
+
+    atomic_fetch_add_explicit(&statistics[3], 1, memory_order_relaxed);
+    atomic_fetch_max_explicit(&statistics[4], end - gid, memory_order_relaxed);
 }
@@ -0,0 +1,150 @@
+import MetalTools
+
+extension SpatialHashing {
+    /// Rebuilds the hash table from the order sorted by the previous build.
+    ///
+    /// The hashes are recomputed in the previous order, the entries with unchanged
+    /// hashes are still sorted and only the moved ones are sorted and merged back.
+    /// When more than `fullSortThreshold` of the `count` hashes changed, all entries are sorted instead.
+    final class IncrementalRebuild {
+        // MARK: - Properties
+
+        let fullSortThreshold: Float
+
+        private let updateSortedVertexHashesState: MTLComputePipelineState
+        private let splitStableAndMovedHashesState: MTLComputePipelineState
+        private let mergeStableAndMovedHashesState: MTLComputePipelineState
+
+        private let bufferFill: BufferFill
+        private let prefixSum: PrefixSum
+        private let radixSort: RadixSort
+        /// Whether `radixSort` is owned rather than shared with the hash table sort.
+        private let ownsRadixSort: Bool
+
+        private var stableOffsets: MTLBuffer
+        private var stableHashTable: MTLBuffer
+        private var movedHashTable: MTLBuffer
+        /// The number of changed hashes followed by the number of entries to sort.
+        private var counts: MTLBuffer
+
+        // MARK: - Init
+
+        init(
+            library: PipelineLibrary,
+            constantValues: FunctionConstants,
+            capacity: Int,
+            fullSortThreshold: Float,
+            radixSort: RadixSort?,
+            bufferAllocator: MTLBufferAllocator
+        ) throws {
+            self.fullSortThreshold = fullSortThreshold
+            self.updateSortedVertexHashesState = try library.computePipelineState(
+                function: "updateSortedVertexHashes",
+                constants: constantValues
+            )
+            self.splitStableAndMovedHashesState = try library.computePipelineState(
+                function: "splitStableAndMovedHashes",
+                constants: constantValues
+            )
+            self.mergeStableAndMovedHashesState = try library.computePipelineState(
+                function: "mergeStableAndMovedHashes",
+                constants: constantValues
+            )
+            self.bufferFill = try .init(library: library)
+            self.prefixSum = try .init(
+                library: library,
+                maxCount: capacity + 1,
+                bufferAllocator: bufferAllocator
+            )
+            self.radixSort = try radixSort ?? .init(
+                library: library,
+                capacity: capacity,
+                bufferAllocator: bufferAllocator
+            )
+            self.ownsRadixSort = radixSort == nil
+            self.stableOffsets = try bufferAllocator.buffer(for: UInt32.self, count: capacity + 1)
+            self.stableHashTable = try bufferAllocator.buffer(for: SIMD2<UInt32>.self, count: capacity)
+            self.movedHashTable = try bufferAllocator.buffer(for: SIMD2<UInt32>.self, count: capacity)
+            self.counts = try bufferAllocator.buffer(for: UInt32.self, count: 2)
+        }
+
+        /// Reallocates the buffers for up to `capacity` vertices, keeping the pipeline states.
+        /// A shared radix sort is reallocated by its owner.
+        func reallocate(capacity: Int, bufferAllocator: MTLBufferAllocator) throws {
+            try self.prefixSum.reallocate(maxCount: capacity + 1, bufferAllocator: bufferAllocator)
+            if self.ownsRadixSort {
+                try self.radixSort.reallocate(capacity: capacity, bufferAllocator: bufferAllocator)
+            }
+            self.stableOffsets = try bufferAllocator.buffer(for: UInt32.self, count: capacity + 1)
+            self.stableHashTable = try bufferAllocator.buffer(for: SIMD2<UInt32>.self, count: capacity)
+            self.movedHashTable = try bufferAllocator.buffer(for: SIMD2<UInt32>.self, count: capacity)
+            self.counts = try bufferAllocator.buffer(for: UInt32.self, count: 2)
+        }
+
+        // MARK: - Encode
+
+        /// Re-sorts `hashTable`, which must contain the result of the previous build for `count` vertices.
+        func encode(
+            positions: MTLBuffer,
+            hashTable: MTLBuffer,
+            count: Int,
+            hashTableCapacity: Int,
+            cellSize: Float,
+            using encoder: MTLComputeCommandEncoder
+        ) {
+            encoder.pushDebugGroup("Incremental Rebuild")
+            self.bufferFill.encode(buffer: self.counts, value: .zero, count: 2, using: encoder)
+
+            encoder.setBuffer(positions, offset: 0, index: 0)
+            encoder.setBuffer(hashTable, offset: 0, index: 1)
+            encoder.setBuffer(self.stableOffsets, offset: 0, index: 2)
+            encoder.setBuffer(self.counts, offset: 0, index: 3)
+            encoder.setValue(UInt32(hashTableCapacity), at: 4)
+            encoder.setValue(cellSize, at: 5)
+            encoder.setValue(UInt32(count), at: 6)
+            encoder.dispatch1d(state: self.updateSortedVertexHashesState, exactlyOrCovering: count)
+
+            self.prefixSum.encode(data: self.stableOffsets, count: count + 1, using: encoder)
+
+            encoder.setBuffer(hashTable, offset: 0, index: 0)
+            encoder.setBuffer(self.stableOffsets, offset: 0, index: 1)
+            encoder.setBuffer(self.stableHashTable, offset: 0, index: 2)
+            encoder.setBuffer(self.movedHashTable, offset: 0, index: 3)
+            encoder.setBuffer(self.counts, offset: 0, index: 4)
+            // The threshold is a fraction of the vertices of this build, not of the capacity.
+            let maxMovedCount = Int(Float(count) * self.fullSortThreshold)
+            encoder.setValue(UInt32(maxMovedCount), at: 5)
+            encoder.setValue(UInt32(count), at: 6)
+            encoder.dispatch1d(state: self.splitStableAndMovedHashesState, exactlyOrCovering: count)
+
+            self.radixSort.encode(
+                data: self.movedHashTable,
+                countBuffer: self.counts,
+                countBufferOffset: MemoryLayout<UInt32>.stride,
+                maxCount: count,
+                keyBits: RadixSort.keyBits(keysCount: hashTableCapacity),
+                using: encoder
+            )
+
+            encoder.setBuffer(self.stableHashTable, offset: 0, index: 0)
+            encoder.setBuffer(self.movedHashTable, offset: 0, index: 1)
+            encoder.setBuffer(hashTable, offset: 0, index: 2)
+            encoder.setBuffer(self.counts, offset: 0, index: 3)
+            encoder.setValue(UInt32(count), at: 4)
+            encoder.dispatch1d(state: self.mergeStableAndMovedHashesState, exactlyOrCovering: count)
+            encoder.popDebugGroup()
+        }
+
+        // MARK: - Sizes
+
+        static func bufferLengths(capacity: Int, sharesRadixSort: Bool) -> [Int] {
+            let radixSortLengths = sharesRadixSort ? [] : RadixSort.scratchBufferLengths(capacity: capacity)
+            return [
+                (capacity + 1) * MemoryLayout<UInt32>.stride,
+                capacity * MemoryLayout<SIMD2<UInt32>>.stride,
+                capacity * MemoryLayout<SIMD2<UInt32>>.stride,
+                MemoryLayout<UInt32>.stride * 2
+            ] + PrefixSum.scratchBufferLengths(maxCount: capacity + 1) + radixSortLengths
+        }
+    }
+}
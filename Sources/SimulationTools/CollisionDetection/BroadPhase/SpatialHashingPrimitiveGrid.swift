@@ -0,0 +1,182 @@
+import MetalTools
+
+extension SpatialHashing {
+    /// A grid of primitives (triangles, edges or vertices) inserted into every cell their bounds overlap.
+    ///
+    /// The primitive cells are counted per hash, scanned into offsets and scattered,
+    /// so the cell bounds come out of the scan without a sort. Vertices or primitives then query
+    /// the cells overlapped by their bounds inflated by the proximity.
+    /// With previous positions the bounds are swept over the step.
+    /// The primitives and queries overlapping more than `cellsLimit` cells are skipped and counted.
+    ///
+    /// For `vertexToVertex` every vertex is a primitive, which is set by the function constant 2.
+    final class PrimitiveGrid {
+        // MARK: - Properties
+
+        let collisionType: SelfCollisionType
+        let primitiveVerticesCount: Int
+        let cellsLimit: Int
+        private(set) var cellEntriesCapacity: Int
+
+        private let countPrimitiveCellsState: MTLComputePipelineState
+        private let insertPrimitiveCellsState: MTLComputePipelineState
+        private let findPrimitivePairsState: MTLComputePipelineState
+
+        private let bufferFill: BufferFill
+        private let prefixSum: PrefixSum
+
+        /// The cell ends after the insertion, followed by the total number of primitive cells.
+        private var cellOffsets: MTLBuffer
+        /// The `(primitive, index of the cell in the primitive cell range)` of every primitive cell.
+        private var cellEntries: MTLBuffer
+        private var hashTableCapacity: Int
+
+        // MARK: - Init
+
+        init(
+            library: PipelineLibrary,
+            constantValues: FunctionConstants,
+            collisionType: SelfCollisionType,
+            cellsLimit: Int,
+            hashTableCapacity: Int,
+            cellEntriesCapacity: Int,
+            bufferAllocator: MTLBufferAllocator
+        ) throws {
+            self.collisionType = collisionType
+            self.primitiveVerticesCount = collisionType.primitiveVerticesCount ?? 1
+            self.cellsLimit = cellsLimit
+            self.cellEntriesCapacity = cellEntriesCapacity
+            self.hashTableCapacity = hashTableCapacity
+            self.countPrimitiveCellsState = try library.computePipelineState(
+                function: "countPrimitiveCells",
+                constants: constantValues
+            )
+            self.insertPrimitiveCellsState = try library.computePipelineState(
+                function: "insertPrimitiveCells",
+                constants: constantValues
+            )
+            self.findPrimitivePairsState = try library.computePipelineState(
+                function: collisionType == .vertexToTriangle ? "findVertexTrianglePairs" : "findPrimitivePairs",
+                constants: constantValues
+            )
+            self.bufferFill = try .init(library: library)
+            self.prefixSum = try .init(
+                library: library,
+                maxCount: hashTableCapacity + 1,
+                bufferAllocator: bufferAllocator
+            )
+            self.cellOffsets = try bufferAllocator.buffer(for: UInt32.self, count: hashTableCapacity + 1)
+            self.cellEntries = try bufferAllocator.buffer(for: SIMD2<UInt32>.self, count: max(cellEntriesCapacity, 1))
+        }
+
+        /// Reallocates the buffers for the new capacities, keeping the pipeline states.
+        func reallocate(
+            hashTableCapacity: Int,
+            cellEntriesCapacity: Int,
+            bufferAllocator: MTLBufferAllocator
+        ) throws {
+            try self.prefixSum.reallocate(maxCount: hashTableCapacity + 1, bufferAllocator: bufferAllocator)
+            self.cellOffsets = try bufferAllocator.buffer(for: UInt32.self, count: hashTableCapacity + 1)
+            self.cellEntries = try bufferAllocator.buffer(for: SIMD2<UInt32>.self, count: max(cellEntriesCapacity, 1))
+            self.hashTableCapacity = hashTableCapacity
+            self.cellEntriesCapacity = cellEntriesCapacity
+        }
+
+        // MARK: - Encode
+
+        /// Inserts the primitives and writes the pairs of every query into `collisionPairs`.
+        /// Expects the resets of `collisionPairs.count` and `counts` to be encoded before.
+        ///
+        /// - Parameters:
+        ///   - previousPositions: The positions at the start of the step, the bounds are swept when present.
+        ///   - primitives: The vertex indices of the primitives, `nil` for `vertexToVertex`.
+        ///   - counts: Receives the required cell entries and the skipped primitives and queries.
+        func encode(
+            positions: MTLTypedBuffer<SIMD4<Float>>,
+            previousPositions: MTLTypedBuffer<SIMD4<Float>>?,
+            primitives: MTLTypedBuffer<UInt32>?,
+            collisionPairs: CollisionPairs,
+            counts: MTLTypedBuffer<UInt32>,
+            cellSize: Float,
+            spacingScale: Float,
+            using encoder: MTLComputeCommandEncoder
+        ) {
+            precondition(
+                previousPositions.map { $0.count == positions.count } ?? true,
+                "Previous positions count doesn't match the positions count"
+            )
+            // The vertex indices aren't read for `vertexToVertex`, any buffer can be bound.
+            let primitivesBuffer = primitives?.buffer ?? positions.buffer
+            let primitivesCount = primitives.map { $0.count / self.primitiveVerticesCount } ?? positions.count
+            let queriesCount = self.collisionType == .vertexToTriangle ? positions.count : primitivesCount
+            precondition(
+                collisionPairs.vertexPairRanges.count >= queriesCount,
+                "Collision pairs have fewer pair ranges than queries"
+            )
+            // The swept bounds of the same positions are the bounds at the current positions.
+            let previousPositionsBuffer = (previousPositions ?? positions).buffer
+
+            self.bufferFill.encode(
+                buffer: self.cellOffsets,
+                value: .zero,
+                count: self.hashTableCapacity + 1,
+                using: encoder
+            )
+
+            encoder.setBuffer(positions.buffer, offset: 0, index: 0)
+            encoder.setBuffer(previousPositionsBuffer, offset: 0, index: 1)
+            encoder.setBuffer(primitivesBuffer, offset: 0, index: 2)
+            encoder.setBuffer(self.cellOffsets, offset: 0, index: 3)
+            encoder.setValue(UInt32(self.primitiveVerticesCount), at: 4)
+            encoder.setValue(UInt32(self.hashTableCapacity), at: 5)
+            encoder.setValue(cellSize, at: 6)
+            encoder.setValue(UInt32(primitivesCount), at: 7)
+            encoder.setValue(UInt32(self.cellsLimit), at: 8)
+            encoder.setBuffer(counts.buffer, offset: 0, index: 9)
+            encoder.dispatch1d(state: self.countPrimitiveCellsState, exactlyOrCovering: primitivesCount)
+
+            self.prefixSum.encode(data: self.cellOffsets, count: self.hashTableCapacity + 1, using: encoder)
+
+            encoder.setBuffer(positions.buffer, offset: 0, index: 0)
+            encoder.setBuffer(previousPositionsBuffer, offset: 0, index: 1)
+            encoder.setBuffer(primitivesBuffer, offset: 0, index: 2)
+            encoder.setBuffer(self.cellOffsets, offset: 0, index: 3)
+            encoder.setBuffer(self.cellEntries, offset: 0, index: 4)
+            encoder.setValue(UInt32(self.primitiveVerticesCount), at: 5)
+            encoder.setValue(UInt32(self.hashTableCapacity), at: 6)
+            encoder.setValue(cellSize, at: 7)
+            encoder.setValue(UInt32(self.cellEntriesCapacity), at: 8)
+            encoder.setValue(UInt32(primitivesCount), at: 9)
+            encoder.setValue(UInt32(self.cellsLimit), at: 10)
+            encoder.dispatch1d(state: self.insertPrimitiveCellsState, exactlyOrCovering: primitivesCount)
+
+            encoder.setBuffer(collisionPairs.pairs.buffer, offset: 0, index: 0)
+            encoder.setBuffer(positions.buffer, offset: 0, index: 1)
+            encoder.setBuffer(previousPositionsBuffer, offset: 0, index: 2)
+            encoder.setBuffer(primitivesBuffer, offset: 0, index: 3)
+            encoder.setBuffer(self.cellOffsets, offset: 0, index: 4)
+            encoder.setBuffer(self.cellEntries, offset: 0, index: 5)
+            encoder.setValue(UInt32(self.hashTableCapacity), at: 6)
+            encoder.setValue(UInt32(self.cellEntriesCapacity), at: 7)
+            encoder.setValue(cellSize, at: 8)
+            encoder.setValue(spacingScale, at: 9)
+            encoder.setValue(UInt32(collisionPairs.capacity), at: 10)
+            encoder.setBuffer(collisionPairs.vertexPairRanges.buffer, offset: 0, index: 11)
+            encoder.setBuffer(collisionPairs.count.buffer, offset: 0, index: 12)
+            encoder.setValue(UInt32(queriesCount), at: 13)
+            encoder.setValue(UInt32(self.primitiveVerticesCount), at: 14)
+            encoder.setValue(UInt32(self.cellsLimit), at: 15)
+            encoder.setBuffer(counts.buffer, offset: 0, index: 16)
+            encoder.dispatch1d(state: self.findPrimitivePairsState, exactlyOrCovering: queriesCount)
+        }
+
+        // MARK: - Sizes
+
+        static func bufferLengths(hashTableCapacity: Int, cellEntriesCapacity: Int) -> [Int] {
+            [
+                (hashTableCapacity + 1) * MemoryLayout<UInt32>.stride,
+                max(cellEntriesCapacity, 1) * MemoryLayout<SIMD2<UInt32>>.stride
+            ] + PrefixSum.scratchBufferLengths(maxCount: hashTableCapacity + 1)
+        }
+    }
+}
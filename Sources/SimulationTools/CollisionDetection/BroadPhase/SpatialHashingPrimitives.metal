@@ -0,0 +1,375 @@
+#include "../../Common/BroadPhaseCommon.h"
+#include "../../Common/Definitions.h"
+
+// Primitives (triangles, edges or vertices) are inserted into every cell overlapped by their bounds.
+// After `insertPrimitiveCells` the entries of the cell with hash `h` are
+// `cellEntries[h > 0 ? cellOffsets[h - 1] : 0 ..< cellOffsets[h]]`.
+// An entry is `(primitive, index of the cell in the primitive cell range)`, so the entries of the other cells
+// of a primitive hashed into the same slot are told apart without deduplicating the hashes on insertion.
+// A primitive overlapping more than `cellsLimit` cells isn't inserted, and a query bound overlapping more
+// isn't queried, both are counted in `primitiveGridCounts[1]`.
+// The bounds cover the primitive at both `previousPositions` and `positions`, binding the same buffer
+// for both gives the bounds at the current positions.
+
+#define MAX_PRIMITIVE_VERTICES 3
+
+/// The primitive index is the vertex index, `primitives` isn't read.
+constant bool primitivesAreVertices [[function_constant(2)]];
+
+struct Bounds {
+    float3 lower;
+    float3 upper;
+};
+
+struct Primitive {
+    uint vertices[MAX_PRIMITIVE_VERTICES];
+    uint verticesCount;
+};
+
+static Primitive loadPrimitive(
+    device const uint* primitives,
+    uint primitiveVerticesCount,
+    uint primitiveIndex
+) {
+    Primitive primitive;
+    if (primitivesAreVertices) {
+        primitive.vertices[0] = primitiveIndex;
+        primitive.verticesCount = 1;
+        return primitive;
+    }
+    primitive.verticesCount = primitiveVerticesCount;
+    for (uint i = 0; i < primitiveVerticesCount; i++) {
+        primitive.vertices[i] = primitives[primitiveIndex * primitiveVerticesCount + i];
+    }
+    return primitive;
+}
+
+/// The bounds swept by the primitive from `previousPositions` to `positions`.
+static Bounds primitiveBounds(
+    device const float4* positions,
+    device const float4* previousPositions,
+    thread const Primitive& primitive
+) {
+    Bounds bounds = { float3(INFINITY), float3(-INFINITY) };
+    for (uint i = 0; i < primitive.verticesCount; i++) {
+        float3 position = positions[primitive.vertices[i]].xyz;
+        float3 previousPosition = previousPositions[primitive.vertices[i]].xyz;
+        bounds.lower = min(bounds.lower, min(position, previousPosition));
+        bounds.upper = max(bounds.upper, max(position, previousPosition));
+    }
+    return bounds;
+}
+
+static bool sharesVertex(
+    thread const Primitive& lhs,
+    thread const Primitive& rhs
+) {
+    for (uint i = 0; i < lhs.verticesCount; i++) {
+        for (uint j = 0; j < rhs.verticesCount; j++) {
+            if (lhs.vertices[i] == rhs.vertices[j]) { return true; }
+        }
+    }
+    return false;
+}
+
+struct CellRange {
+    int3 lower;
+    int3 extent;
+};
+
+static CellRange boundsCellRange(Bounds bounds, float cellSize) {
+    int3 lower = hashCoord(bounds.lower, cellSize);
+    return { lower, hashCoord(bounds.upper, cellSize) - lower + 1 };
+}
+
+/// The number of cells of `range`, `UINT_MAX` when it exceeds `cellsLimit` or the bounds aren't finite.
+/// `cellsLimit` is at most 65535, so the products don't overflow.
+static uint rangeCellsCount(CellRange range, uint cellsLimit) {
+    if (any(range.extent < 1) || any(range.extent > int(cellsLimit))) { return UINT_MAX; }
+    uint planeCellsCount = uint(range.extent.x * range.extent.y);
+    if (planeCellsCount > cellsLimit) { return UINT_MAX; }
+    uint cellsCount = planeCellsCount * uint(range.extent.z);
+    return cellsCount > cellsLimit ? UINT_MAX : cellsCount;
+}
+
+static int3 rangeCell(CellRange range, uint index) {
+    int3 extent = range.extent;
+    int3 offset = int3(index / uint(extent.y * extent.z), (index / uint(extent.z)) % uint(extent.y), index % uint(extent.z));
+    return range.lower + offset;
+}
+
+/// Calls `visitor(hash, cellIndex)` for every cell overlapped by a primitive, in O(1) per cell.
+/// Returns the number of cells, `UINT_MAX` without visiting any when the primitive overlaps more than `cellsLimit`.
+template <typename Visitor>
+static uint forEachPrimitiveCell(
+    device const float4* positions,
+    device const float4* previousPositions,
+    device const uint* primitives,
+    uint primitiveVerticesCount,
+    uint primitiveIndex,
+    uint hashTableCapacity,
+    float cellSize,
+    uint cellsLimit,
+    thread Visitor& visitor
+) {
+    Primitive primitive = loadPrimitive(primitives, primitiveVerticesCount, primitiveIndex);
+    CellRange range = boundsCellRange(primitiveBounds(positions, previousPositions, primitive), cellSize);
+    uint cellsCount = rangeCellsCount(range, cellsLimit);
+    if (cellsCount == UINT_MAX) { return UINT_MAX; }
+
+    for (uint i = 0; i < cellsCount; i++) {
+        visitor(getHash(rangeCell(range, i), hashTableCapacity), i);
+    }
+    return cellsCount;
+}
+
+struct PrimitiveCellsCounter {
+    device atomic_uint* cellOffsets;
+
+    void operator()(uint hash, uint) {
+        atomic_fetch_add_explicit(&cellOffsets[hash], 1, memory_order_relaxed);
+    }
+};
+
+struct PrimitiveCellsWriter {
+    device atomic_uint* cellOffsets;
+    device uint2* cellEntries;
+    uint cellEntriesCapacity;
+    uint primitiveIndex;
+
+    void operator()(uint hash, uint cellIndex) {
+        uint entryIndex = atomic_fetch_add_explicit(&cellOffsets[hash], 1, memory_order_relaxed);
+        if (entryIndex < cellEntriesCapacity) {
+            cellEntries[entryIndex] = uint2(primitiveIndex, cellIndex);
+        }
+    }
+};
+
+/// Counts the cells of every primitive and adds the required cell entries to `primitiveGridCounts[0]`
+/// and the primitives overlapping more than `cellsLimit` cells to `primitiveGridCounts[1]`.
+kernel void countPrimitiveCells(
+    device const float4* positions [[ buffer(0) ]],
+    device const float4* previousPositions [[ buffer(1) ]],
+    device const uint* primitives [[ buffer(2) ]],
+    device atomic_uint* cellOffsets [[ buffer(3) ]],
+    constant uint& primitiveVerticesCount [[ buffer(4) ]],
+    constant uint& hashTableCapacity [[ buffer(5) ]],
+    constant float& cellSize [[ buffer(6) ]],
+    constant uint& gridSize [[ buffer(7) ]],
+    constant uint& cellsLimit [[ buffer(8) ]],
+    device atomic_uint* primitiveGridCounts [[ buffer(9) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    PrimitiveCellsCounter counter = { cellOffsets };
+    uint cellsCount = forEachPrimitiveCell(positions, previousPositions, primitives, primitiveVerticesCount, gid, hashTableCapacity, cellSize, cellsLimit, counter);
+    if (cellsCount == UINT_MAX) {
+        atomic_fetch_add_explicit(&primitiveGridCounts[1], 1, memory_order_relaxed);
+    } else if (cellsCount > 0) {
+        atomic_fetch_add_explicit(&primitiveGridCounts[0], cellsCount, memory_order_relaxed);
+    }
+}
+
+/// Expects `cellOffsets` to hold the exclusive scan of the cell counts, which turns into the cell ends.
+/// The entries beyond `cellEntriesCapacity` are dropped, `primitiveGridCounts[0]` tells the required capacity.
+kernel void insertPrimitiveCells(
+    device const float4* positions [[ buffer(0) ]],
+    device const float4* previousPositions [[ buffer(1) ]],
+    device const uint* primitives [[ buffer(2) ]],
+    device atomic_uint* cellOffsets [[ buffer(3) ]],
+    device uint2* cellEntries [[ buffer(4) ]],
+    constant uint& primitiveVerticesCount [[ buffer(5) ]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant float& cellSize [[ buffer(7) ]],
+    constant uint& cellEntriesCapacity [[ buffer(8) ]],
+    constant uint& gridSize [[ buffer(9) ]],
+    constant uint& cellsLimit [[ buffer(10) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    PrimitiveCellsWriter writer = { cellOffsets, cellEntries, cellEntriesCapacity, gid };
+    forEachPrimitiveCell(positions, previousPositions, primitives, primitiveVerticesCount, gid, hashTableCapacity, cellSize, cellsLimit, writer);
+}
+
+/// The grid of primitives a vertex or a primitive queries its collision candidates from.
+struct PrimitiveGrid {
+    device const float4* positions;
+    device const float4* previousPositions;
+    device const uint* primitives;
+    device const uint* cellOffsets;
+    device const uint2* cellEntries;
+    uint primitiveVerticesCount;
+    uint hashTableCapacity;
+    uint cellEntriesCapacity;
+    float cellSize;
+    uint cellsLimit;
+};
+
+/// Calls `visitor(candidate)` for every primitive whose bounds overlap the query bounds inflated by `proximity`,
+/// skipping the primitives below `minCandidate` and the ones sharing a vertex with the query.
+/// A pair is reported only in the first cell shared by both bounds, so every candidate is visited once.
+/// Returns `false` without visiting any candidate when the inflated bounds overlap more than `cellsLimit` cells.
+template <typename Visitor>
+static bool forEachPrimitiveCandidate(
+    thread const PrimitiveGrid& grid,
+    thread const Primitive& query,
+    Bounds queryBounds,
+    uint minCandidate,
+    float proximity,
+    thread Visitor& visitor
+) {
+    queryBounds.lower -= proximity;
+    queryBounds.upper += proximity;
+    CellRange queryRange = boundsCellRange(queryBounds, grid.cellSize);
+    uint queryCellsCount = rangeCellsCount(queryRange, grid.cellsLimit);
+    if (queryCellsCount == UINT_MAX) { return false; }
+
+    for (uint queryCell = 0; queryCell < queryCellsCount; queryCell++) {
+        int3 cell = rangeCell(queryRange, queryCell);
+        uint hash = getHash(cell, grid.hashTableCapacity);
+        uint start = hash > 0 ? grid.cellOffsets[hash - 1] : 0;
+        uint end = min(grid.cellOffsets[hash], grid.cellEntriesCapacity);
+
+        for (uint i = start; i < end; i++) {
+            uint2 entry = grid.cellEntries[i];
+            uint candidateIndex = entry.x;
+            if (candidateIndex < minCandidate) { continue; }
+
+            Primitive candidate = loadPrimitive(grid.primitives, grid.primitiveVerticesCount, candidateIndex);
+            if (sharesVertex(query, candidate)) { continue; }
+
+            Bounds candidateBounds = primitiveBounds(grid.positions, grid.previousPositions, candidate);
+            if (any(queryBounds.upper < candidateBounds.lower) || any(candidateBounds.upper < queryBounds.lower)) { continue; }
+
+            // Another cell of the candidate hashed into the same slot is visited from that cell.
+            CellRange candidateRange = boundsCellRange(candidateBounds, grid.cellSize);
+            if (any(rangeCell(candidateRange, entry.y) != cell)) { continue; }
+
+            int3 firstSharedCell = max(queryRange.lower, candidateRange.lower);
+            if (any(firstSharedCell != cell)) { continue; }
+
+            if (!visitor(candidateIndex)) { return true; }
+        }
+    }
+    return true;
+}
+
+struct PrimitivePairsCounter {
+    uint count;
+
+    bool operator()(uint) {
+        count += 1;
+        return true;
+    }
+};
+
+struct PrimitivePairsWriter {
+    device uint2* collisionPairs;
+    uint queryIndex;
+    uint capacity;
+    uint count;
+
+    bool operator()(uint candidateIndex) {
+        if (count >= capacity) { return false; }
+        collisionPairs[count] = uint2(queryIndex, candidateIndex);
+        count += 1;
+        return true;
+    }
+};
+
+/// Counts the candidates of a query, reserves a contiguous range of `collisionPairs` and fills it.
+static void writePrimitivePairs(
+    thread const PrimitiveGrid& grid,
+    thread const Primitive& query,
+    Bounds queryBounds,
+    uint queryIndex,
+    uint minCandidate,
+    float proximity,
+    device uint2* collisionPairs,
+    device uint2* pairRanges,
+    device atomic_uint* collisionPairsCount,
+    uint collisionPairsCapacity,
+    device atomic_uint* primitiveGridCounts
+) {
+    PrimitivePairsCounter counter = { 0 };
+    if (!forEachPrimitiveCandidate(grid, query, queryBounds, minCandidate, proximity, counter)) {
+        atomic_fetch_add_explicit(&primitiveGridCounts[1], 1, memory_order_relaxed);
+    }
+
+    uint offset = 0;
+    uint capacity = 0;
+    if (counter.count > 0) {
+        offset = atomic_fetch_add_explicit(collisionPairsCount, counter.count, memory_order_relaxed);
+        capacity = offset < collisionPairsCapacity ? min(counter.count, collisionPairsCapacity - offset) : 0;
+    }
+
+    PrimitivePairsWriter writer = { collisionPairs + offset, queryIndex, capacity, 0 };
+    if (capacity > 0) {
+        forEachPrimitiveCandidate(grid, query, queryBounds, minCandidate, proximity, writer);
+    }
+    pairRanges[queryIndex] = uint2(offset, writer.count);
+}
+
+/// Writes `(vertex, triangle)` pairs for the triangles closer than the proximity to a vertex.
+kernel void findVertexTrianglePairs(
+    device uint2* collisionPairs [[ buffer(0) ]],
+    device const float4* positions [[ buffer(1) ]],
+    device const float4* previousPositions [[ buffer(2) ]],
+    device const uint* triangles [[ buffer(3) ]],
+    device const uint* cellOffsets [[ buffer(4) ]],
+    device const uint2* cellEntries [[ buffer(5) ]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant uint& cellEntriesCapacity [[ buffer(7) ]],
+    constant float& cellSize [[ buffer(8) ]],
+    constant float& spacingScale [[ buffer(9) ]],
+    constant uint& collisionPairsCapacity [[ buffer(10) ]],
+    device uint2* vertexPairRanges [[ buffer(11) ]],
+    device atomic_uint* collisionPairsCount [[ buffer(12) ]],
+    constant uint& gridSize [[ buffer(13) ]],
+    constant uint& cellsLimit [[ buffer(15) ]],
+    device atomic_uint* primitiveGridCounts [[ buffer(16) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    const PrimitiveGrid grid = { positions, previousPositions, triangles, cellOffsets, cellEntries, 3, hashTableCapacity, cellEntriesCapacity, cellSize, cellsLimit };
+
+    Primitive vertex;
+    vertex.vertices[0] = gid;
+    vertex.verticesCount = 1;
+    Bounds bounds = primitiveBounds(positions, previousPositions, vertex);
+
+    writePrimitivePairs(grid, vertex, bounds, gid, 0, cellSize * spacingScale, collisionPairs, vertexPairRanges, collisionPairsCount, collisionPairsCapacity, primitiveGridCounts);
+}
+
+/// Writes `(e, f)` pairs with `e < f` for the primitives of the grid, which bounds are closer than the proximity.
+/// Finds the edge-edge pairs, or the vertex-vertex pairs when `primitivesAreVertices`.
+kernel void findPrimitivePairs(
+    device uint2* collisionPairs [[ buffer(0) ]],
+    device const float4* positions [[ buffer(1) ]],
+    device const float4* previousPositions [[ buffer(2) ]],
+    device const uint* primitives [[ buffer(3) ]],
+    device const uint* cellOffsets [[ buffer(4) ]],
+    device const uint2* cellEntries [[ buffer(5) ]],
+    constant uint& hashTableCapacity [[ buffer(6) ]],
+    constant uint& cellEntriesCapacity [[ buffer(7) ]],
+    constant float& cellSize [[ buffer(8) ]],
+    constant float& spacingScale [[ buffer(9) ]],
+    constant uint& collisionPairsCapacity [[ buffer(10) ]],
+    device uint2* primitivePairRanges [[ buffer(11) ]],
+    device atomic_uint* collisionPairsCount [[ buffer(12) ]],
+    constant uint& gridSize [[ buffer(13) ]],
+    constant uint& primitiveVerticesCount [[ buffer(14) ]],
+    constant uint& cellsLimit [[ buffer(15) ]],
+    device atomic_uint* primitiveGridCounts [[ buffer(16) ]],
+    uint gid [[ thread_position_in_grid ]]
+) {
+    if (deviceDoesntSupportNonuniformThreadgroups && gid >= gridSize) { return; }
+    const PrimitiveGrid grid = { positions, previousPositions, primitives, cellOffsets, cellEntries, primitiveVerticesCount, hashTableCapacity, cellEntriesCapacity, cellSize, cellsLimit };
+
+    Primitive primitive = loadPrimitive(primitives, primitiveVerticesCount, gid);
+    Bounds bounds = primitiveBounds(positions, previousPositions, primitive);
+
+    writePrimitivePairs(grid, primitive, bounds, gid, gid + 1, cellSize * spacingScale, collisionPairs, primitivePairRanges, collisionPairsCount, collisionPairsCapacity, primitiveGridCounts);
+}
+
+#undef MAX_PRIMITIVE_VERTICES
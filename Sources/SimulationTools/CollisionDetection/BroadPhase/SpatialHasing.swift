@@ -1,106 +1,638 @@
 import MetalTools
 
 public final class SpatialHashing {
+    /// The algorithm used to sort the hash table.
+    public enum SortBackend: String, Hashable, CaseIterable {
+        /// Bitonic sort over the exact vertex count, tiles sized to the device threadgroup memory are sorted in a single pass.
+        case bitonic
+        /// LSD radix sort over the exact vertex count, `hashTableCapacity` bounds the number of passes.
+        case radix
+        /// Counting sort: per-cell atomic counts, an exclusive scan and a scatter.
+        /// Writes cell offsets directly, so there is neither a global sort nor a cell boundaries pass
+        /// and the cell table is a single offsets array.
+        case counting
+    }
+
+    /// How the hash table is rebuilt on every `build` call.
+    public enum RebuildMode: Hashable {
+        /// The hash table is sorted from scratch.
+        case full
+        /// The hash table keeps the order of the previous build, only the vertices that changed
+        /// their cell are sorted and merged back. When more than `fullSortThreshold` of the vertices
+        /// changed their cell, the whole hash table is sorted.
+        /// Has no effect with the `counting` sort backend.
+        case incremental(fullSortThreshold: Float = 0.25)
+    }
+
+    /// The number of slots of the hash table the cells are hashed into.
+    public enum HashTableCapacity: Hashable {
+        /// `vertexCount * factor` slots, a cell hash is reduced with modulo.
+        case vertexCountMultiple(factor: Int = 2)
+        /// Exactly `capacity` slots, a cell hash is reduced with modulo.
+        case fixed(Int)
+        /// At least `capacity` slots rounded up to a power of two.
+        /// A cell hash is reduced with a multiplicative shift in place of modulo.
+        case powerOfTwo(atLeast: Int)
+
+        /// The number of slots for `vertexCount` vertices.
+        public func slotsCount(vertexCount: Int) -> Int {
+            switch self {
+            case let .vertexCountMultiple(factor):
+                return max(vertexCount * factor, 1)
+            case let .fixed(capacity):
+                return max(capacity, 1)
+            case let .powerOfTwo(capacity):
+                return max(capacity, 2).nextPowerOfTwo
+            }
+        }
+
+        var isPowerOfTwo: Bool {
+            if case .powerOfTwo = self { return true }
+            return false
+        }
+    }
+
+    /// How the cells are mapped to the slots of the cell table.
+    public enum Grid: Hashable {
+        /// Cells are hashed into `hashTableCapacity` slots, distinct cells may share a slot.
+        case hashed
+        /// The cells of a bounded domain are indexed with Morton codes, so no two cells share a slot
+        /// and neighbor cells are close in memory. The positions outside the bounds are clamped to the
+        /// boundary cells. The cell table spans the next power of two of the largest axis cells count
+        /// along every axis, up to 1024, and `hashTableCapacity` is ignored.
+        case dense(lowerBound: SIMD3<Float>, upperBound: SIMD3<Float>)
+    }
+
+    /// How the query threads of `build` visit the neighbor cells.
+    public enum QueryStrategy: String, Hashable, CaseIterable {
+        /// Every thread walks the 27 neighbor cells of its vertex on its own.
+        case perVertex
+        /// The threads of a SIMD group visit their distinct neighbor cells together, loading every
+        /// cell entry once and broadcasting it to the lanes querying that cell.
+        /// Pays off for dense cells, where the lanes of a SIMD group share most of their neighbor cells.
+        /// Applies to `collisionCandidates`, `collisionPairs` are found per vertex.
+        case simdGroup
+        /// Every thread walks the 13 forward neighbor cells and its own cell, so every pair is distance tested once.
+        /// `collisionCandidates` receive every pair mirrored into the candidates of both vertices in no particular order.
+        /// `collisionPairs` ranges describe the pairs found by a vertex, which also contain pairs with smaller vertices.
+        case halfStencil
+    }
+
+    /// Which candidates of a vertex fill its slots of the `collisionCandidates` buffer in `build`.
+    public enum CandidatesSelection: String, Hashable, CaseIterable {
+        /// The first candidates in the cell iteration order, the vertices finding more are counted in `overflowedVerticesCount`.
+        case firstFound
+        /// The nearest candidates by increasing distance, so a full list drops the farthest ones.
+        /// Every thread keeps up to `maxNearestCandidatesCount` candidates in a bounded max-heap
+        /// and the candidates are found per vertex whatever the query strategy.
+        case nearest
+    }
+
+    /// The maximum number of slots per vertex of the nearest candidates and the nearest vertices queries.
+    public static let maxNearestCandidatesCount = 16
+
+    /// How the positions are stored for hashing and the queries.
+    public enum PositionStorage: String, Hashable, CaseIterable {
+        /// World positions in half precision, 8 bytes per vertex.
+        /// The precision gets coarser than typical cell sizes a few thousand units away from the origin.
+        case half
+        /// The cell coordinates in 16 bits per axis and the position within the cell as 16 bit unorm, 12 bytes per vertex.
+        /// The precision is `cellSize / 65535` wherever the positions are. The cell coordinates wrap around
+        /// every 65536 cells, so cells that far apart sharing a slot yield extra candidates.
+        /// The dense grid domain has to lie within 32768 cells of the origin.
+        case cellRelative
+        /// World positions in single precision, 16 bytes per vertex.
+        /// Matches the input positions exactly, at twice the bandwidth of `half`.
+        case float
+
+        /// The size of a stored position in bytes.
+        var stride: Int {
+            switch self {
+            case .half: return MemoryLayout<SIMD4<Float16>>.stride
+            case .cellRelative: return 6 * MemoryLayout<UInt16>.stride
+            case .float: return MemoryLayout<SIMD4<Float>>.stride
+            }
+        }
+    }
+
+    /// How the vertices are indexed in the outputs of `build` and `query`.
+    public enum OutputOrder: String, Hashable, CaseIterable {
+        /// By their index in the positions buffer.
+        case vertices
+        /// By their position in the sorted hash table, so vertices of the same cell are consecutive.
+        /// The candidates and pair ranges are written per sorted index and the candidates and pairs hold sorted indices,
+        /// so a solver running in that order reads spatially coherent memory. Per-vertex attributes are moved
+        /// into and out of that order with `permute`, `encodeSortedVertices` and `encodeSortedRanks` give the permutation.
+        /// The inputs of `build`, like the connected vertices and the collision objects, stay in the vertex order.
+        case sorted
+    }
+
+    /// The direction of `permute`.
+    public enum PermutationDirection: Hashable {
+        /// Gathers values in the vertex order into the sorted order of the last build.
+        case toSortedOrder
+        /// Scatters values in the sorted order of the last build back to the vertex order.
+        case fromSortedOrder
+    }
+
+    /// The layout of the `connectedVertices` buffer passed to `build`.
+    public enum ConnectedVerticesFormat: String, Hashable, CaseIterable {
+        /// The same number of connected vertices for every vertex, up to 32, padded with `UInt32.max`.
+        /// Every candidate is compared against all of them.
+        case fixedCount
+        /// The sorted adjacency lists of a `VertexAdjacency` of any length, searched with a binary search.
+        case adjacencyLists
+    }
+
     public struct Configuration {
         let cellSize: Float
         let spacingScale: Float
         let collisionType: SelfCollisionType
+        let sortBackend: SortBackend
+        let rebuildMode: RebuildMode
+        /// The average number of cells a primitive overlaps, sizes the primitive grid
+        /// of `vertexToTriangle` and `edgeToEdge`. Primitives smaller than `cellSize` overlap at most 8.
+        /// The grid grows with `reservePrimitiveCellEntriesCapacity` when `primitiveGridCounts` exceeds it.
+        let maxCellsPerPrimitive: Int
+        /// The maximum number of cells a single primitive or swept vertex is inserted into or queries, up to 65535.
+        /// Larger bounds are skipped and counted in `primitiveGridCounts`, so a degenerate primitive
+        /// can't keep a thread busy for millions of cells.
+        let primitiveCellsLimit: Int
+        /// Allocates the grid of swept vertex bounds for the `vertexToVertex` builds with previous positions.
+        let sweptVertexBounds: Bool
+        let hashTableCapacity: HashTableCapacity
+        let grid: Grid
+        let queryStrategy: QueryStrategy
+        let candidatesSelection: CandidatesSelection
+        let positionStorage: PositionStorage
+        let connectedVerticesFormat: ConnectedVerticesFormat
+        let outputOrder: OutputOrder
+        /// The number of levels of the hierarchical grid of `build(positions:radii:collisionPairs:)`,
+        /// up to 16. The cells of the finest level are `cellSize` and double from one level to the next.
+        let levelsCount: Int
+        /// Filters the vertex pairs by the collision groups of the `CollisionObjects` passed to `build`.
+        /// The primitive grid builds of triangles, edges and swept vertices don't filter and require it off.
+        let usesCollisionGroups: Bool
         
         public init(
             cellSize: Float32,
             spacingScale: Float32 = 1,
-            collisionType: SelfCollisionType = .vertexToVertex
+            collisionType: SelfCollisionType = .vertexToVertex,
+            sortBackend: SortBackend = .bitonic,
+            rebuildMode: RebuildMode = .full,
+            maxCellsPerPrimitive: Int = 8,
+            primitiveCellsLimit: Int = 4096,
+            sweptVertexBounds: Bool = false,
+            hashTableCapacity: HashTableCapacity = .vertexCountMultiple(),
+            grid: Grid = .hashed,
+            queryStrategy: QueryStrategy = .perVertex,
+            candidatesSelection: CandidatesSelection = .firstFound,
+            positionStorage: PositionStorage = .half,
+            connectedVerticesFormat: ConnectedVerticesFormat = .fixedCount,
+            outputOrder: OutputOrder = .vertices,
+            levelsCount: Int = 1,
+            usesCollisionGroups: Bool = false
         ) {
             self.cellSize = cellSize
             self.spacingScale = spacingScale
             self.collisionType = collisionType
+            self.sortBackend = sortBackend
+            self.rebuildMode = rebuildMode
+            self.maxCellsPerPrimitive = maxCellsPerPrimitive
+            self.primitiveCellsLimit = primitiveCellsLimit
+            self.sweptVertexBounds = sweptVertexBounds
+            self.hashTableCapacity = hashTableCapacity
+            self.grid = grid
+            self.queryStrategy = queryStrategy
+            self.candidatesSelection = candidatesSelection
+            self.positionStorage = positionStorage
+            self.connectedVerticesFormat = connectedVerticesFormat
+            self.outputOrder = outputOrder
+            self.levelsCount = levelsCount
+            self.usesCollisionGroups = usesCollisionGroups
+        }
+
+        /// The first cell and the cells count along every axis of the dense grid, `nil` for the hashed grid.
+        var denseGridCells: (lower: SIMD3<Int32>, count: SIMD3<Int32>)? {
+            guard case let .dense(lowerBound, upperBound) = self.grid
+            else { return nil }
+            let lowerCell = SIMD3<Int32>((lowerBound / self.cellSize).rounded(.down))
+            let upperCell = SIMD3<Int32>((upperBound / self.cellSize).rounded(.down))
+            return (lower: lowerCell, count: upperCell &- lowerCell &+ 1)
+        }
+
+        /// The number of slots of the cell table for `vertexCount` vertices.
+        func cellTableCapacity(vertexCount: Int) -> Int {
+            guard let denseGridCells = self.denseGridCells
+            else { return self.hashTableCapacity.slotsCount(vertexCount: vertexCount) }
+            let axisBits = Int(denseGridCells.count.max()).nextPowerOfTwo.trailingZeroBitCount
+            precondition(axisBits <= 10, "Dense grid domain exceeds 1024 cells along an axis")
+            return 1 << (axisBits * 3)
+        }
+    }
+
+    private enum HashTableSort {
+        case bitonic(BitonicSort)
+        case radix(RadixSort)
+        case counting(PrefixSum)
+    }
+
+    /// The buffers sized by the vertex capacity, reallocated when the capacity changes.
+    /// They hold the grid from one build to the next and to its queries.
+    private struct Buffers {
+        let hashTable: MTLBuffer
+        let hashTableCapacity: Int
+        let cellStart: MTLBuffer
+        /// `nil` when `cellStart` holds cell offsets.
+        let cellEnd: MTLBuffer?
+        let sortedHalfPositions: MTLBuffer
+
+        init(
+            configuration: Configuration,
+            capacity: Int,
+            bufferAllocator: MTLBufferAllocator
+        ) throws {
+            self.hashTableCapacity = configuration.cellTableCapacity(vertexCount: capacity)
+            self.hashTable = try bufferAllocator.buffer(for: SIMD2<UInt32>.self, count: capacity)
+            if configuration.sortBackend == .counting {
+                self.cellStart = try bufferAllocator.buffer(for: UInt32.self, count: self.hashTableCapacity + 1)
+                self.cellEnd = nil
+            } else {
+                self.cellStart = try bufferAllocator.buffer(for: UInt32.self, count: self.hashTableCapacity)
+                self.cellEnd = try bufferAllocator.buffer(for: UInt32.self, count: self.hashTableCapacity)
+            }
+            let positionsLength = capacity * configuration.positionStorage.stride
+            self.sortedHalfPositions = try bufferAllocator.buffer(for: UInt8.self, count: positionsLength)
+        }
+
+        static func lengths(configuration: Configuration, capacity: Int) -> [Int] {
+            let hashTableCapacity = configuration.cellTableCapacity(vertexCount: capacity)
+            let cellBoundsLengths = configuration.sortBackend == .counting
+                                  ? [(hashTableCapacity + 1) * MemoryLayout<UInt32>.stride]
+                                  : [hashTableCapacity * MemoryLayout<UInt32>.stride, hashTableCapacity * MemoryLayout<UInt32>.stride]
+            return [capacity * MemoryLayout<SIMD2<UInt32>>.stride]
+                 + cellBoundsLengths
+                 + [capacity * configuration.positionStorage.stride]
+        }
+    }
+
+    /// The buffers only used within a build, allocated from the scratch allocator.
+    private struct ScratchBuffers {
+        /// The hash and the rank in its cell of every vertex, `nil` unless the sort backend is `counting`.
+        let hashAndRank: MTLBuffer?
+        /// The number of mirrored candidates of every vertex, `nil` unless the query strategy is `halfStencil`.
+        let collisionCandidatesCounts: MTLBuffer?
+        let halfPositions: MTLBuffer
+
+        init(
+            configuration: Configuration,
+            capacity: Int,
+            bufferAllocator: MTLBufferAllocator
+        ) throws {
+            self.hashAndRank = try configuration.sortBackend == .counting
+                             ? bufferAllocator.buffer(for: SIMD2<UInt32>.self, count: capacity)
+                             : nil
+            self.collisionCandidatesCounts = try configuration.queryStrategy == .halfStencil
+                                           ? bufferAllocator.buffer(for: UInt32.self, count: capacity)
+                                           : nil
+            let positionsLength = capacity * configuration.positionStorage.stride
+            self.halfPositions = try bufferAllocator.buffer(for: UInt8.self, count: positionsLength)
+        }
+
+        static func lengths(configuration: Configuration, capacity: Int) -> [Int] {
+            var lengths = [capacity * configuration.positionStorage.stride]
+            if configuration.sortBackend == .counting {
+                lengths.append(capacity * MemoryLayout<SIMD2<UInt32>>.stride)
+            }
+            if configuration.queryStrategy == .halfStencil {
+                lengths.append(capacity * MemoryLayout<UInt32>.stride)
+            }
+            return lengths
         }
     }
 
     public let configuration: Configuration
 
-    private let computeVertexHashAndIndexState: MTLComputePipelineState
-    private let computeCellBoundariesState: MTLComputePipelineState
+    private let convertPositionsAndComputeVertexHashAndIndexState: MTLComputePipelineState
+    private let convertPositionsAndCountCellVerticesState: MTLComputePipelineState
+    private let convertPositionsAndComputeLevelHashAndIndexState: MTLComputePipelineState
+    private let reorderPositionsAndComputeCellBoundariesState: MTLComputePipelineState
     private let findCollisionCandidatesState: MTLComputePipelineState
+    private let findCollisionCandidatesCooperativeState: MTLComputePipelineState
+    private let findCollisionCandidatesHalfStencilState: MTLComputePipelineState
+    private let findNearestCollisionCandidatesState: MTLComputePipelineState
+    private let terminateCollisionCandidatesState: MTLComputePipelineState
+    private let findCollisionPairsHalfStencilState: MTLComputePipelineState
+    private let findCollisionPairsState: MTLComputePipelineState
+    private let findCompactCollisionCandidatesState: MTLComputePipelineState
+    private let writeCollisionPairsDispatchArgumentsState: MTLComputePipelineState
+    private let findHierarchicalCollisionPairsState: MTLComputePipelineState
+    private let findPointPairsState: MTLComputePipelineState
+    private let findNearestPointVerticesState: MTLComputePipelineState
     private let convertToHalfPrecisionPositionsState: MTLComputePipelineState
     private let reorderHalfPrecisionPositionsState: MTLComputePipelineState
+    private let scatterVertexHashAndIndexState: MTLComputePipelineState
+    private let resetCellBoundariesState: MTLComputePipelineState
+    private let computeHashTableDiagnosticsState: MTLComputePipelineState
+    private let computeCollisionCandidatesStatisticsState: MTLComputePipelineState
+    private let writeCollisionPairsStatisticsState: MTLComputePipelineState
+    private let computeSlotOccupancyStatisticsState: MTLComputePipelineState
+    private let writeSortedVerticesState: MTLComputePipelineState
+    private let writeSortedRanksState: MTLComputePipelineState
+    private let permuteToSortedOrderState: MTLComputePipelineState
+    private let permuteFromSortedOrderState: MTLComputePipelineState
     
-    private let bitonicSort: BitonicSort
+    private let hashTableSort: HashTableSort
+    private let bufferFill: BufferFill
+    private let incrementalRebuild: IncrementalRebuild?
+    /// The grid of triangles or edges, or of the swept vertex bounds for `vertexToVertex`.
+    private let primitiveGrid: PrimitiveGrid?
+    /// The vertex count of the previous build, `nil` before the first build.
+    /// The previous sorted hash table lists the occupied cells and is the input of the incremental rebuild.
+    private var sortedHashTableCount: Int?
+    /// Whether the last vertex build hashed the levels of the hierarchical grid, which the point queries
+    /// and the diagnostics read as a single level.
+    private var sortedHashTableIsHierarchical = false
+
+    /// The maximum number of vertices of a build.
+    public private(set) var capacity: Int
+    /// The maximum number of triangles or edges for `vertexToTriangle` and `edgeToEdge`.
+    private let primitivesCount: Int
+    private let bufferAllocator: MTLBufferAllocator
+    /// Allocates the scratch buffers of the build and of the sorts, a transient heap allocator with a scratch heap.
+    private let scratchBufferAllocator: MTLBufferAllocator
+    private var buffers: Buffers
+    private var scratchBuffers: ScratchBuffers
+
+    /// Whether the scratch buffers can be used by the next build, `false` after `makeScratchBuffersAliasable`.
+    public private(set) var hasScratchBuffers = true
+
+    /// A single `UInt32` with the number of vertices of the last `collisionCandidates` buffer build
+    /// which found more candidates than `maxCollisionCandidatesCount` and dropped the rest, readable after completion.
+    /// A nonzero count calls for a larger budget or the compact `CollisionCandidates`.
+    public let overflowedVerticesCount: MTLTypedBuffer<UInt32>
+
+    /// A single `UInt32` with the number of vertices of the last hierarchical build wider than the coarsest cells,
+    /// readable after completion. Their pairs beyond the neighbor cells are missing from the result,
+    /// a nonzero count calls for a larger `cellSize` or `levelsCount`.
+    public let clampedVerticesCount: MTLTypedBuffer<UInt32>
+
+    /// Two `UInt32` of the last primitive grid build, readable after completion: the cell entries the primitives
+    /// required, which exceed `primitiveCellEntriesCapacity` when entries and their pairs were dropped,
+    /// and the primitive insertions and queries skipped for overlapping more than `primitiveCellsLimit` cells.
+    public let primitiveGridCounts: MTLTypedBuffer<UInt32>
 
-    private let halfPositions: MTLBuffer
-    private let sortedHalfPositions: MTLBuffer
+    /// The number of cell entries of the primitive grid, zero without a primitive grid.
+    public var primitiveCellEntriesCapacity: Int { self.primitiveGrid?.cellEntriesCapacity ?? 0 }
+    /// The capacity reserved with `reservePrimitiveCellEntriesCapacity`, kept when the buffers are reallocated.
+    private var reservedPrimitiveCellEntriesCapacity = 0
 
-    private let cellStart: MTLBuffer
-    private let cellEnd: MTLBuffer
-    private let hashTable: (buffer: MTLBuffer, paddedCount: Int)
-    private let hashTableCapacity: Int
+    /// Records the GPU timings and statistics of every following build when set.
+    /// The statistics cost a pass over the outputs and the hash table per build.
+    public var instrumentation: BuildInstrumentation?
+
+    private var collisionCandidatesCounts: MTLBuffer? { self.scratchBuffers.collisionCandidatesCounts }
+    private var halfPositions: MTLBuffer { self.scratchBuffers.halfPositions }
+    private var sortedHalfPositions: MTLBuffer { self.buffers.sortedHalfPositions }
+    private var cellStart: MTLBuffer { self.buffers.cellStart }
+    private var cellEnd: MTLBuffer? { self.buffers.cellEnd }
+    private var hashTable: MTLBuffer { self.buffers.hashTable }
+    private var hashTableCapacity: Int { self.buffers.hashTableCapacity }
 
     /// Initializes a new `SpatialHashing` instance.
     ///
+    /// The library and the pipeline states are shared by every instance on the same device,
+    /// so only the first instance of a configuration compiles its pipeline states.
+    /// `PipelineLibrary.useBinaryArchive` loads them from a binary archive instead.
     /// - Parameters:
     ///   - heap: The Metal heap for resource allocation.
     ///   - configuration: The configuration for spatial hashing.
-    ///   - positions: An array of vertex positions.
+    ///   - capacity: The maximum number of vertices of a build, grown with `reserveCapacity`.
+    ///   - primitivesCount: The maximum number of triangles or edges for `vertexToTriangle` and `edgeToEdge`.
     /// - Throws: An error if the Metal library or pipeline states cannot be created.
     public convenience init(
         heap: MTLHeap,
         configuration: Configuration,
-        positions: [SIMD4<Float>]
+        capacity: Int,
+        primitivesCount: Int = 0
     ) throws {
         try self.init(
             bufferAllocator: .init(type: .heap(heap)),
             configuration: configuration,
-            positions: positions
+            capacity: capacity,
+            primitivesCount: primitivesCount
         )
     }
-    
+
+    /// Initializes a new `SpatialHashing` instance which scratch buffers are transient resources of `scratchHeap`.
+    ///
+    /// The grid, read by the queries and the next build, is allocated from `heap`. The buffers only used within
+    /// a build are allocated from `scratchHeap` and `makeScratchBuffersAliasable` releases them to the other passes
+    /// allocating from it, sized with `scratchHeapSizeAndAlign`. The scratch buffers are allocated on init.
+    /// - Parameters:
+    ///   - heap: The Metal heap for the buffers kept from one build to the next.
+    ///   - scratchHeap: The Metal heap for the scratch buffers of the builds.
+    ///   - configuration: The configuration for spatial hashing.
+    ///   - capacity: The maximum number of vertices of a build, grown with `reserveCapacity`.
+    ///   - primitivesCount: The maximum number of triangles or edges for `vertexToTriangle` and `edgeToEdge`.
+    /// - Throws: An error if the Metal library or pipeline states cannot be created.
+    public convenience init(
+        heap: MTLHeap,
+        scratchHeap: MTLHeap,
+        configuration: Configuration,
+        capacity: Int,
+        primitivesCount: Int = 0
+    ) throws {
+        try self.init(
+            bufferAllocator: .init(type: .heap(heap)),
+            scratchBufferAllocator: .init(type: .heap(scratchHeap), isTransient: true),
+            configuration: configuration,
+            capacity: capacity,
+            primitivesCount: primitivesCount
+        )
+    }
+
     /// Initializes a new `SpatialHashing` instance.
     ///
+    /// The library and the pipeline states are shared by every instance on the same device,
+    /// so only the first instance of a configuration compiles its pipeline states.
+    /// `PipelineLibrary.useBinaryArchive` loads them from a binary archive instead.
     /// - Parameters:
     ///   - device: The Metal device for resource allocation.
     ///   - configuration: The configuration for spatial hashing.
-    ///   - positions: An array of vertex positions.
+    ///   - capacity: The maximum number of vertices of a build, grown with `reserveCapacity`.
+    ///   - primitivesCount: The maximum number of triangles or edges for `vertexToTriangle` and `edgeToEdge`.
     /// - Throws: An error if the Metal library or pipeline states cannot be created.
     public convenience init(
         device: MTLDevice,
         configuration: Configuration,
-        positions: [SIMD4<Float>]
+        capacity: Int,
+        primitivesCount: Int = 0
     ) throws {
         try self.init(
             bufferAllocator: .init(type: .device(device)),
             configuration: configuration,
-            positions: positions
+            capacity: capacity,
+            primitivesCount: primitivesCount
+        )
+    }
+
+    /// Initializes a new `SpatialHashing` instance with the capacity of `positions.count` vertices.
+    ///
+    /// Only the count of `positions` is used, `init(heap:configuration:capacity:primitivesCount:)`
+    /// doesn't require the positions on the CPU.
+    /// - Parameters:
+    ///   - heap: The Metal heap for resource allocation.
+    ///   - configuration: The configuration for spatial hashing.
+    ///   - positions: An array of vertex positions.
+    ///   - primitivesCount: The maximum number of triangles or edges for `vertexToTriangle` and `edgeToEdge`.
+    /// - Throws: An error if the Metal library or pipeline states cannot be created.
+    public convenience init(
+        heap: MTLHeap,
+        configuration: Configuration,
+        positions: [SIMD4<Float>],
+        primitivesCount: Int = 0
+    ) throws {
+        try self.init(
+            heap: heap,
+            configuration: configuration,
+            capacity: positions.count,
+            primitivesCount: primitivesCount
+        )
+    }
+    
+    /// Initializes a new `SpatialHashing` instance with the capacity of `positions.count` vertices.
+    ///
+    /// Only the count of `positions` is used, `init(device:configuration:capacity:primitivesCount:)`
+    /// doesn't require the positions on the CPU.
+    /// - Parameters:
+    ///   - device: The Metal device for resource allocation.
+    ///   - configuration: The configuration for spatial hashing.
+    ///   - positions: An array of vertex positions.
+    ///   - primitivesCount: The maximum number of triangles or edges for `vertexToTriangle` and `edgeToEdge`.
+    /// - Throws: An error if the Metal library or pipeline states cannot be created.
+    public convenience init(
+        device: MTLDevice,
+        configuration: Configuration,
+        positions: [SIMD4<Float>],
+        primitivesCount: Int = 0
+    ) throws {
+        try self.init(
+            device: device,
+            configuration: configuration,
+            capacity: positions.count,
+            primitivesCount: primitivesCount
         )
     }
 
     private init(
         bufferAllocator: MTLBufferAllocator,
+        scratchBufferAllocator: MTLBufferAllocator? = nil,
         configuration: Configuration,
-        positions: [SIMD4<Float>],
-        heap: MTLHeap? = nil
+        capacity vertexCount: Int,
+        primitivesCount: Int
     ) throws {
-        let library = try bufferAllocator.device.makeDefaultLibrary(bundle: .module)
+        precondition(
+            (1 ... 65535).contains(configuration.primitiveCellsLimit),
+            "The primitive cells limit is 1 to 65535"
+        )
+        precondition(
+            (1 ... 16).contains(configuration.levelsCount),
+            "The hierarchical grid has 1 to 16 levels"
+        )
+        if configuration.levelsCount > 1 {
+            precondition(
+                configuration.denseGridCells == nil && configuration.positionStorage != .cellRelative,
+                "The hierarchical grid requires the hashed grid and world positions"
+            )
+            precondition(
+                configuration.sortBackend != .counting && configuration.rebuildMode == .full,
+                "The hierarchical grid requires a bitonic or radix full rebuild"
+            )
+        }
+        let library = try PipelineLibrary.shared(device: bufferAllocator.device)
         let deviceSupportsNonuniformThreadgroups = library.device
             .supports(feature: .nonUniformThreadgroups)
 
-        let constantValues = MTLFunctionConstantValues()
+        var constantValues = FunctionConstants()
         constantValues.set(deviceSupportsNonuniformThreadgroups, at: 0)
-
-        let vertexCount = positions.count
+        constantValues.set(configuration.sortBackend == .counting, at: 1)
+        constantValues.set(configuration.collisionType == .vertexToVertex, at: 2)
+        constantValues.set(configuration.hashTableCapacity.isPowerOfTwo, at: 3)
+        constantValues.set(configuration.denseGridCells != nil, at: 4)
+        constantValues.set(configuration.denseGridCells?.lower ?? .zero, at: 5)
+        constantValues.set(configuration.denseGridCells?.count ?? .one, at: 6)
+        constantValues.set(configuration.positionStorage == .cellRelative, at: 7)
+        constantValues.set(configuration.positionStorage == .float, at: 8)
+        constantValues.set(configuration.connectedVerticesFormat == .adjacencyLists, at: 9)
+        constantValues.set(configuration.usesCollisionGroups, at: 10)
+        constantValues.set(configuration.outputOrder == .sorted, at: 12)
 
         self.configuration = configuration
-        self.computeVertexHashAndIndexState = try library.computePipelineState(
-            function: "computeVertexHashAndIndex",
+        self.convertPositionsAndComputeVertexHashAndIndexState = try library.computePipelineState(
+            function: "convertPositionsAndComputeVertexHashAndIndex",
             constants: constantValues
         )
-        self.computeCellBoundariesState = try library.computePipelineState(
-            function: "computeCellBoundaries",
+        self.convertPositionsAndCountCellVerticesState = try library.computePipelineState(
+            function: "convertPositionsAndCountCellVertices",
+            constants: constantValues
+        )
+        self.convertPositionsAndComputeLevelHashAndIndexState = try library.computePipelineState(
+            function: "convertPositionsAndComputeLevelHashAndIndex",
+            constants: constantValues
+        )
+        self.reorderPositionsAndComputeCellBoundariesState = try library.computePipelineState(
+            function: "reorderPositionsAndComputeCellBoundaries",
             constants: constantValues
         )
         self.findCollisionCandidatesState = try library.computePipelineState(
             function: "findCollisionCandidates",
             constants: constantValues
         )
+        self.findCollisionCandidatesCooperativeState = try library.computePipelineState(
+            function: "findCollisionCandidatesCooperative",
+            constants: constantValues
+        )
+        self.findCollisionCandidatesHalfStencilState = try library.computePipelineState(
+            function: "findCollisionCandidatesHalfStencil",
+            constants: constantValues
+        )
+        self.findNearestCollisionCandidatesState = try library.computePipelineState(
+            function: "findNearestCollisionCandidates",
+            constants: constantValues
+        )
+        self.terminateCollisionCandidatesState = try library.computePipelineState(
+            function: "terminateCollisionCandidates",
+            constants: constantValues
+        )
+        self.findCollisionPairsHalfStencilState = try library.computePipelineState(
+            function: "findCollisionPairsHalfStencil",
+            constants: constantValues
+        )
+        self.findCollisionPairsState = try library.computePipelineState(
+            function: "findCollisionPairs",
+            constants: constantValues
+        )
+        self.findCompactCollisionCandidatesState = try library.computePipelineState(
+            function: "findCompactCollisionCandidates",
+            constants: constantValues
+        )
+        self.writeCollisionPairsDispatchArgumentsState = try library.computePipelineState(
+            function: "writeCollisionPairsDispatchArguments",
+            constants: constantValues
+        )
+        self.findHierarchicalCollisionPairsState = try library.computePipelineState(
+            function: "findHierarchicalCollisionPairs",
+            constants: constantValues
+        )
+        self.findPointPairsState = try library.computePipelineState(
+            function: "findPointPairs",
+            constants: constantValues
+        )
+        self.findNearestPointVerticesState = try library.computePipelineState(
+            function: "findNearestPointVertices",
+            constants: constantValues
+        )
         self.convertToHalfPrecisionPositionsState = try library.computePipelineState(
             function: "convertToHalfPrecisionPositions",
             constants: constantValues
@@ -109,97 +641,1429 @@ public final class SpatialHashing {
             function: "reorderHalfPrecisionPositions",
             constants: constantValues
         )
+        self.scatterVertexHashAndIndexState = try library.computePipelineState(
+            function: "scatterVertexHashAndIndex",
+            constants: constantValues
+        )
+        self.resetCellBoundariesState = try library.computePipelineState(
+            function: "resetCellBoundaries",
+            constants: constantValues
+        )
+        self.computeHashTableDiagnosticsState = try library.computePipelineState(
+            function: "computeHashTableDiagnostics",
+            constants: constantValues
+        )
+        self.computeCollisionCandidatesStatisticsState = try library.computePipelineState(
+            function: "computeCollisionCandidatesStatistics",
+            constants: constantValues
+        )
+        self.writeCollisionPairsStatisticsState = try library.computePipelineState(
+            function: "writeCollisionPairsStatistics",
+            constants: constantValues
+        )
+        self.computeSlotOccupancyStatisticsState = try library.computePipelineState(
+            function: "computeSlotOccupancyStatistics",
+            constants: constantValues
+        )
+        self.writeSortedVerticesState = try library.computePipelineState(
+            function: "writeSortedVertices",
+            constants: constantValues
+        )
+        self.writeSortedRanksState = try library.computePipelineState(
+            function: "writeSortedRanks",
+            constants: constantValues
+        )
+        self.permuteToSortedOrderState = try library.computePipelineState(
+            function: "permuteToSortedOrder",
+            constants: constantValues
+        )
+        self.permuteFromSortedOrderState = try library.computePipelineState(
+            function: "permuteFromSortedOrder",
+            constants: constantValues
+        )
 
-        self.bitonicSort = try .init(library: library)
-        
-        self.hashTableCapacity = vertexCount * 2
-        self.hashTable = try BitonicSort.buffer(count: vertexCount, bufferAllocator: bufferAllocator)
-        self.cellStart = try bufferAllocator.buffer(for: UInt32.self, count: self.hashTableCapacity)
-        self.cellEnd = try bufferAllocator.buffer(for: UInt32.self, count: self.hashTableCapacity)
-        self.halfPositions = try bufferAllocator.buffer(for: SIMD4<Float16>.self, count: vertexCount)
-        self.sortedHalfPositions = try bufferAllocator.buffer(for: SIMD4<Float16>.self, count: vertexCount)
+        self.capacity = vertexCount
+        self.primitivesCount = primitivesCount
+        self.bufferAllocator = bufferAllocator
+        let scratchBufferAllocator = scratchBufferAllocator ?? bufferAllocator
+        self.scratchBufferAllocator = scratchBufferAllocator
+        self.buffers = try .init(configuration: configuration, capacity: vertexCount, bufferAllocator: bufferAllocator)
+        self.scratchBuffers = try .init(
+            configuration: configuration,
+            capacity: vertexCount,
+            bufferAllocator: scratchBufferAllocator
+        )
+        self.bufferFill = try .init(library: library)
+        self.overflowedVerticesCount = try .init(count: 1, bufferAllocator: bufferAllocator)
+        self.clampedVerticesCount = try .init(count: 1, bufferAllocator: bufferAllocator)
+        self.primitiveGridCounts = try .init(count: 2, bufferAllocator: bufferAllocator)
+
+        switch configuration.sortBackend {
+        case .bitonic:
+            self.hashTableSort = try .bitonic(.init(library: library))
+        case .radix:
+            self.hashTableSort = try .radix(.init(
+                library: library,
+                capacity: vertexCount,
+                bufferAllocator: scratchBufferAllocator
+            ))
+        case .counting:
+            self.hashTableSort = try .counting(.init(
+                library: library,
+                maxCount: self.buffers.hashTableCapacity + 1,
+                bufferAllocator: scratchBufferAllocator
+            ))
+        }
+
+        switch (configuration.rebuildMode, self.hashTableSort) {
+        case (.full, _), (.incremental, .counting):
+            self.incrementalRebuild = nil
+        case let (.incremental(fullSortThreshold), hashTableSort):
+            var radixSort: RadixSort?
+            if case let .radix(hashTableRadixSort) = hashTableSort {
+                radixSort = hashTableRadixSort
+            }
+            self.incrementalRebuild = try .init(
+                library: library,
+                constantValues: constantValues,
+                capacity: vertexCount,
+                fullSortThreshold: fullSortThreshold,
+                radixSort: radixSort,
+                bufferAllocator: scratchBufferAllocator
+            )
+        }
+
+        if configuration.collisionType == .vertexToVertex && !configuration.sweptVertexBounds {
+            self.primitiveGrid = nil
+        } else {
+            self.primitiveGrid = try .init(
+                library: library,
+                constantValues: constantValues,
+                collisionType: configuration.collisionType,
+                cellsLimit: configuration.primitiveCellsLimit,
+                hashTableCapacity: self.buffers.hashTableCapacity,
+                cellEntriesCapacity: Self.primitiveCellEntriesCapacity(
+                    configuration: configuration,
+                    vertexCount: vertexCount,
+                    primitivesCount: primitivesCount
+                ),
+                bufferAllocator: scratchBufferAllocator
+            )
+        }
+    }
+
+    // MARK: - Capacity
+
+    /// Grows the buffers to hold at least `minimumCapacity` vertices, keeping the pipeline states.
+    ///
+    /// The capacity grows by at least half, so a vertex count growing frame by frame reallocates rarely.
+    /// The next build is a full rebuild. Has no effect when the capacity suffices.
+    /// - Parameter minimumCapacity: The number of vertices the next builds hash.
+    /// - Throws: An error if the buffers cannot be allocated.
+    public func reserveCapacity(_ minimumCapacity: Int) throws {
+        guard minimumCapacity > self.capacity else { return }
+        try self.reallocate(capacity: max(minimumCapacity, self.capacity + self.capacity / 2))
+    }
+
+    /// Shrinks the buffers to hold `capacity` vertices, keeping the pipeline states.
+    ///
+    /// The next build is a full rebuild. Has no effect when the capacity is already smaller.
+    /// - Parameter capacity: The number of vertices the next builds hash at most.
+    /// - Throws: An error if the buffers cannot be allocated.
+    public func shrinkCapacity(to capacity: Int) throws {
+        guard capacity < self.capacity else { return }
+        try self.reallocate(capacity: max(capacity, 1))
+    }
+
+    private func reallocate(capacity: Int) throws {
+        let buffers = try Buffers(configuration: self.configuration, capacity: capacity, bufferAllocator: self.bufferAllocator)
+        try self.reallocateScratchBuffers(capacity: capacity, hashTableCapacity: buffers.hashTableCapacity)
+        self.buffers = buffers
+        self.capacity = capacity
+        // The previous hash table doesn't describe the new cell table.
+        self.sortedHashTableCount = nil
+    }
+
+    private func reallocateScratchBuffers(capacity: Int, hashTableCapacity: Int) throws {
+        let scratchBuffers = try ScratchBuffers(
+            configuration: self.configuration,
+            capacity: capacity,
+            bufferAllocator: self.scratchBufferAllocator
+        )
+        switch self.hashTableSort {
+        case .bitonic:
+            break
+        case let .radix(radixSort):
+            try radixSort.reallocate(capacity: capacity, bufferAllocator: self.scratchBufferAllocator)
+        case let .counting(prefixSum):
+            try prefixSum.reallocate(maxCount: hashTableCapacity + 1, bufferAllocator: self.scratchBufferAllocator)
+        }
+        try self.incrementalRebuild?.reallocate(capacity: capacity, bufferAllocator: self.scratchBufferAllocator)
+        try self.primitiveGrid?.reallocate(
+            hashTableCapacity: hashTableCapacity,
+            cellEntriesCapacity: max(
+                Self.primitiveCellEntriesCapacity(
+                    configuration: self.configuration,
+                    vertexCount: capacity,
+                    primitivesCount: self.primitivesCount
+                ),
+                self.reservedPrimitiveCellEntriesCapacity
+            ),
+            bufferAllocator: self.scratchBufferAllocator
+        )
+        self.scratchBuffers = scratchBuffers
+        self.hasScratchBuffers = true
+    }
+
+    /// Grows the cell entries of the primitive grid to at least `minimumCapacity`, usually the required entries
+    /// `primitiveGridCounts[0]` of a build which exceeded `primitiveCellEntriesCapacity`.
+    ///
+    /// The capacity grows by at least half. Has no effect when the capacity suffices.
+    /// A scratch heap sized with `scratchHeapSizeAndAlign` has no room for the larger entries.
+    /// - Parameter minimumCapacity: The number of cell entries the next primitive grid builds require at most.
+    /// - Throws: An error if the buffers cannot be allocated.
+    public func reservePrimitiveCellEntriesCapacity(_ minimumCapacity: Int) throws {
+        guard let primitiveGrid = self.primitiveGrid
+        else { preconditionFailure("The primitive grid isn't allocated for this configuration") }
+        let capacity = primitiveGrid.cellEntriesCapacity
+        guard minimumCapacity > capacity else { return }
+        self.reservedPrimitiveCellEntriesCapacity = max(minimumCapacity, capacity + capacity / 2)
+        try primitiveGrid.reallocate(
+            hashTableCapacity: self.hashTableCapacity,
+            cellEntriesCapacity: self.reservedPrimitiveCellEntriesCapacity,
+            bufferAllocator: self.scratchBufferAllocator
+        )
+    }
+
+    // MARK: - Scratch Buffers
+
+    /// Allocates the scratch buffers from the scratch heap after `makeScratchBuffersAliasable`, before the next build.
+    /// Has no effect when the scratch buffers are allocated.
+    /// - Throws: An error if the scratch heap has no room for the buffers.
+    public func allocateScratchBuffers() throws {
+        guard !self.hasScratchBuffers else { return }
+        try self.reallocateScratchBuffers(capacity: self.capacity, hashTableCapacity: self.hashTableCapacity)
+    }
+
+    /// Makes the scratch buffers aliasable once the builds using them are encoded, so the passes allocating
+    /// from the scratch heap afterwards can reuse their memory. The grid stays allocated, so `query`,
+    /// the sorted order and the diagnostics remain valid. Work aliasing the memory has to run after the builds,
+    /// which the hazard tracking of a tracked heap or a fence ensures.
+    /// Has no effect without a scratch heap.
+    public func makeScratchBuffersAliasable() {
+        guard self.scratchBufferAllocator.isTransient else { return }
+        self.scratchBufferAllocator.makeAllocatedBuffersAliasable()
+        self.hasScratchBuffers = false
+    }
+
+    private static func primitiveCellEntriesCapacity(
+        configuration: Configuration,
+        vertexCount: Int,
+        primitivesCount: Int
+    ) -> Int {
+        let primitivesCount = configuration.collisionType == .vertexToVertex ? vertexCount : primitivesCount
+        return primitivesCount * configuration.maxCellsPerPrimitive
     }
     
     /// Builds the spatial hash and collision pairs for the given positions.
+    ///
+    /// The whole build is encoded into a single compute encoder, whose serial dispatches order the dependent passes.
+    /// Every vertex has `collisionCandidates.count / positions.count` candidate slots, a vertex finding more keeps
+    /// the first ones and is counted in `overflowedVerticesCount`, or the nearest ones with the `nearest` candidates selection.
     /// - Parameters:
-    ///   - commandBuffer: The Metal command buffer to encode the commands into.
     ///   - positions: The buffer containing vertex positions.
     ///   - collisionCandidates: The buffer to store collision pairs.
-    ///   - connectedVertices: The buffer containing vertex neighborhood information.
+    ///   - connectedVertices: The buffer containing vertex neighborhood information in the `connectedVerticesFormat` layout.
+    ///   - collisionObjects: The objects the positions belong to, required with `usesCollisionGroups`.
+    ///   - activeCount: The number of leading positions to hash, at most `capacity`. All positions when `nil`.
+    ///   - commandBuffer: The Metal command buffer to encode the commands into.
     public func build(
         positions: MTLTypedBuffer<SIMD4<Float>>,
         collisionCandidates: MTLTypedBuffer<UInt32>,
         connectedVertices: MTLTypedBuffer<UInt32>?,
+        collisionObjects: CollisionObjects? = nil,
+        activeCount: Int? = nil,
         in commandBuffer: MTLCommandBuffer
     ) {
-        commandBuffer.pushDebugGroup("Convert To Half Precision & Compute Vertex Hash And Index")
-        commandBuffer.compute { encoder in
-            encoder.setBuffer(positions.buffer, offset: 0, index: 0)
-            encoder.setBuffer(self.halfPositions, offset: 0, index: 1)
-            encoder.setValue(UInt32(positions.count), at: 2)
-            encoder.dispatch1d(state: self.convertToHalfPrecisionPositionsState, exactlyOrCovering: positions.count)
+        self.encodeBuild(in: commandBuffer) { encoder in
+            self.build(
+                positions: positions,
+                collisionCandidates: collisionCandidates,
+                connectedVertices: connectedVertices,
+                collisionObjects: collisionObjects,
+                activeCount: activeCount,
+                using: encoder
+            )
+        }
+    }
 
-            encoder.setBuffer(self.halfPositions, offset: 0, index: 0)
-            encoder.setBuffer(self.hashTable.buffer, offset: 0, index: 1)
-            encoder.setValue(UInt32(self.hashTableCapacity), at: 2)
-            encoder.setValue(self.configuration.cellSize, at: 3)
-            encoder.setValue(UInt32(positions.count), at: 4)
-            encoder.dispatch1d(state: self.computeVertexHashAndIndexState, exactlyOrCovering: positions.count)
+    /// Encodes `build(positions:collisionCandidates:connectedVertices:collisionObjects:activeCount:in:)`
+    /// into `encoder`, so the broad phase can share the compute encoder of the simulation step.
+    /// The encoder has to dispatch serially.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        collisionCandidates: MTLTypedBuffer<UInt32>,
+        connectedVertices: MTLTypedBuffer<UInt32>?,
+        collisionObjects: CollisionObjects? = nil,
+        activeCount: Int? = nil,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        let count = activeCount ?? positions.count
+        // The candidates stride follows the positions buffer, so it doesn't change with the active count.
+        let maxCollisionCandidatesCount = UInt32(collisionCandidates.count / positions.count)
+        let selectsNearest = self.configuration.candidatesSelection == .nearest
+        precondition(
+            !selectsNearest || maxCollisionCandidatesCount <= Self.maxNearestCandidatesCount,
+            "The nearest candidates are limited to maxNearestCandidatesCount per vertex"
+        )
+
+        self.beginInstrumentation(using: encoder)
+        self.bufferFill.encode(buffer: self.overflowedVerticesCount.buffer, value: .zero, count: 1, using: encoder)
+        if let collisionCandidatesCounts = self.collisionCandidatesCounts {
+            self.bufferFill.encode(buffer: collisionCandidatesCounts, value: .zero, count: count, using: encoder)
         }
-        commandBuffer.popDebugGroup()
-        
-        commandBuffer.pushDebugGroup("Sort")
-        self.bitonicSort.encode(data: self.hashTable.buffer, count: self.hashTable.paddedCount, in: commandBuffer)
-        commandBuffer.popDebugGroup()
-        
-        commandBuffer.pushDebugGroup("Compute Cell Bounds & Find Collision Candidates")
-        commandBuffer.compute { encoder in
-            encoder.setBuffer(self.halfPositions, offset: 0, index: 0)
-            encoder.setBuffer(self.sortedHalfPositions, offset: 0, index: 1)
-            encoder.setBuffer(self.hashTable.buffer, offset: 0, index: 2)
-            encoder.setValue(UInt32(positions.count), at: 3)
-            encoder.dispatch1d(state: self.reorderHalfPrecisionPositionsState, exactlyOrCovering: positions.count)
 
-            let threadgroupWidth = 256
-            encoder.setBuffer(self.cellStart, offset: 0, index: 0)
-            encoder.setBuffer(self.cellEnd, offset: 0, index: 1)
-            encoder.setThreadgroupMemoryLength((threadgroupWidth + 16) * MemoryLayout<UInt32>.size, index: 0)
-            encoder.dispatch1d(state: self.computeCellBoundariesState, exactlyOrCovering: positions.count, threadgroupWidth: threadgroupWidth)
+        self.encodeGrid(positions: positions, count: count, using: encoder)
+
+        encoder.pushDebugGroup("Find Collision Candidates")
+        encoder.setBuffer(collisionCandidates.buffer, offset: 0, index: 0)
+        self.setQueryInputs(
+            positions: positions,
+            count: count,
+            connectedVertices: connectedVertices,
+            collisionObjects: collisionObjects,
+            using: encoder
+        )
+        encoder.setValue(maxCollisionCandidatesCount, at: 9)
+        encoder.setBuffer(self.overflowedVerticesCount.buffer, offset: 0, index: 15)
+
+        switch self.configuration.queryStrategy {
+        case _ where selectsNearest:
+            encoder.dispatch1d(state: self.findNearestCollisionCandidatesState, exactlyOrCovering: count)
+        case .perVertex:
+            encoder.dispatch1d(state: self.findCollisionCandidatesState, exactlyOrCovering: count)
+        case .simdGroup:
+            let state = self.findCollisionCandidatesCooperativeState
+            encoder.dispatch1d(state: state, covering: count, threadgroupWidth: state.threadExecutionWidth)
+        case .halfStencil:
+            encoder.setBuffer(self.collisionCandidatesCounts, offset: 0, index: 12)
+            encoder.dispatch1d(state: self.findCollisionCandidatesHalfStencilState, exactlyOrCovering: count)
 
             encoder.setBuffer(collisionCandidates.buffer, offset: 0, index: 0)
-            encoder.setBuffer(self.hashTable.buffer, offset: 0, index: 1)
-            encoder.setBuffer(self.cellStart, offset: 0, index: 2)
-            encoder.setBuffer(self.cellEnd, offset: 0, index: 3)
-            encoder.setBuffer(self.sortedHalfPositions, offset: 0, index: 4)
-            if let connectedVertices {
-                encoder.setBuffer(connectedVertices.buffer, offset: 0, index: 5)
-            } else {
-                encoder.setValue([UInt32.zero], at: 5)
-            }
-            encoder.setValue(UInt32(self.hashTableCapacity), at: 6)
-            encoder.setValue(self.configuration.spacingScale, at: 7)
-            encoder.setValue(self.configuration.cellSize, at: 8)
-            encoder.setValue(UInt32(collisionCandidates.count / positions.count), at: 9)
-            encoder.setValue(UInt32((connectedVertices?.count ?? 0) / positions.count), at: 10)
-            encoder.setValue(UInt32(positions.count), at: 11)
+            encoder.setBuffer(self.collisionCandidatesCounts, offset: 0, index: 1)
+            encoder.setValue(maxCollisionCandidatesCount, at: 2)
+            encoder.setValue(UInt32(count), at: 3)
+            encoder.setBuffer(self.overflowedVerticesCount.buffer, offset: 0, index: 4)
+            encoder.dispatch1d(state: self.terminateCollisionCandidatesState, exactlyOrCovering: count)
+        }
+        encoder.popDebugGroup()
+
+        self.encodeStatistics(
+            after: .query,
+            collisionCandidates: (collisionCandidates, maxCollisionCandidatesCount),
+            vertexCount: count,
+            using: encoder
+        )
+    }
 
-            encoder.dispatch1d(state: self.findCollisionCandidatesState, exactlyOrCovering: positions.count)
+    /// Builds the spatial hash and the compact collision candidates of the given positions.
+    ///
+    /// Unlike the `collisionCandidates` buffer, the candidates of every vertex are counted before they are written,
+    /// so no vertex drops candidates while the list has capacity and the budget grows only where vertices are crowded.
+    /// The candidates are found per vertex whatever the query strategy.
+    /// - Parameters:
+    ///   - positions: The buffer containing vertex positions.
+    ///   - collisionCandidates: The candidates list to store the candidates of every vertex.
+    ///   - connectedVertices: The buffer containing vertex neighborhood information in the `connectedVerticesFormat` layout.
+    ///   - collisionObjects: The objects the positions belong to, required with `usesCollisionGroups`.
+    ///   - activeCount: The number of leading positions to hash, at most `capacity`. All positions when `nil`.
+    ///   - commandBuffer: The Metal command buffer to encode the commands into.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        collisionCandidates: CollisionCandidates,
+        connectedVertices: MTLTypedBuffer<UInt32>?,
+        collisionObjects: CollisionObjects? = nil,
+        activeCount: Int? = nil,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        self.encodeBuild(in: commandBuffer) { encoder in
+            self.build(
+                positions: positions,
+                collisionCandidates: collisionCandidates,
+                connectedVertices: connectedVertices,
+                collisionObjects: collisionObjects,
+                activeCount: activeCount,
+                using: encoder
+            )
         }
-        commandBuffer.popDebugGroup()
     }
-}
 
-public extension SpatialHashing {
-    /// Calculates the total size of buffers required for spatial hashing.
+    /// Encodes `build(positions:collisionCandidates:connectedVertices:collisionObjects:activeCount:in:)`
+    /// with a `CollisionCandidates` list into `encoder`, which has to dispatch serially.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        collisionCandidates: CollisionCandidates,
+        connectedVertices: MTLTypedBuffer<UInt32>?,
+        collisionObjects: CollisionObjects? = nil,
+        activeCount: Int? = nil,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        let count = activeCount ?? positions.count
+        precondition(
+            collisionCandidates.vertexCandidateRanges.count >= count,
+            "Collision candidates have fewer candidate ranges than vertices"
+        )
+        self.beginInstrumentation(using: encoder)
+        self.bufferFill.encode(buffer: collisionCandidates.count.buffer, value: .zero, count: 1, using: encoder)
+
+        self.encodeGrid(positions: positions, count: count, using: encoder)
+
+        encoder.pushDebugGroup("Find Compact Collision Candidates")
+        encoder.setBuffer(collisionCandidates.candidates.buffer, offset: 0, index: 0)
+        self.setQueryInputs(
+            positions: positions,
+            count: count,
+            connectedVertices: connectedVertices,
+            collisionObjects: collisionObjects,
+            using: encoder
+        )
+        encoder.setValue(UInt32(collisionCandidates.capacity), at: 9)
+        encoder.setBuffer(collisionCandidates.vertexCandidateRanges.buffer, offset: 0, index: 12)
+        encoder.setBuffer(collisionCandidates.count.buffer, offset: 0, index: 13)
+        encoder.dispatch1d(state: self.findCompactCollisionCandidatesState, exactlyOrCovering: count)
+        encoder.popDebugGroup()
+
+        self.encodeStatistics(
+            after: .query,
+            compactList: (collisionCandidates.count, collisionCandidates.capacity),
+            vertexCount: count,
+            using: encoder
+        )
+    }
+
+    /// Builds the spatial hash and a compact list of collision pairs for the given positions.
     ///
-    /// - Parameter positionsCount: The number of positions to hash.
-    /// - Returns: The total size of buffers in bytes.
-    static func totalBuffersSize(positionsCount: Int) -> Int {
-        let halfPositionsSize = positionsCount * MemoryLayout<SIMD4<Float16>>.stride * 2
-        let cellStartSize = positionsCount * MemoryLayout<UInt32>.stride * 2
-        let cellEndSize = positionsCount * MemoryLayout<UInt32>.stride * 2
-        let hashTableSize = positionsCount * MemoryLayout<SIMD2<UInt32>>.stride * 2
-        
-        return halfPositionsSize + cellStartSize + cellEndSize + hashTableSize
+    /// Every pair is written once with the smaller vertex index first.
+    /// `collisionPairs.dispatchArguments` are updated on the GPU to cover the found pairs.
+    /// - Parameters:
+    ///   - positions: The buffer containing vertex positions.
+    ///   - collisionPairs: The pairs list to store collision pairs.
+    ///   - connectedVertices: The buffer containing vertex neighborhood information in the `connectedVerticesFormat` layout.
+    ///   - collisionObjects: The objects the positions belong to, required with `usesCollisionGroups`.
+    ///   - activeCount: The number of leading positions to hash, at most `capacity`. All positions when `nil`.
+    ///   - commandBuffer: The Metal command buffer to encode the commands into.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        collisionPairs: CollisionPairs,
+        connectedVertices: MTLTypedBuffer<UInt32>?,
+        collisionObjects: CollisionObjects? = nil,
+        activeCount: Int? = nil,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        self.encodeBuild(in: commandBuffer) { encoder in
+            self.build(
+                positions: positions,
+                collisionPairs: collisionPairs,
+                connectedVertices: connectedVertices,
+                collisionObjects: collisionObjects,
+                activeCount: activeCount,
+                using: encoder
+            )
+        }
+    }
+
+    /// Encodes `build(positions:collisionPairs:connectedVertices:collisionObjects:activeCount:in:)`
+    /// into `encoder`, which has to dispatch serially.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        collisionPairs: CollisionPairs,
+        connectedVertices: MTLTypedBuffer<UInt32>?,
+        collisionObjects: CollisionObjects? = nil,
+        activeCount: Int? = nil,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        let count = activeCount ?? positions.count
+        precondition(collisionPairs.vertexPairRanges.count >= count, "Collision pairs have fewer pair ranges than vertices")
+        self.beginInstrumentation(using: encoder)
+        self.bufferFill.encode(buffer: collisionPairs.count.buffer, value: .zero, count: 1, using: encoder)
+
+        self.encodeGrid(positions: positions, count: count, using: encoder)
+
+        encoder.pushDebugGroup("Find Collision Pairs")
+        encoder.setBuffer(collisionPairs.pairs.buffer, offset: 0, index: 0)
+        self.setQueryInputs(
+            positions: positions,
+            count: count,
+            connectedVertices: connectedVertices,
+            collisionObjects: collisionObjects,
+            using: encoder
+        )
+        encoder.setValue(UInt32(collisionPairs.capacity), at: 9)
+        encoder.setBuffer(collisionPairs.vertexPairRanges.buffer, offset: 0, index: 12)
+        encoder.setBuffer(collisionPairs.count.buffer, offset: 0, index: 13)
+
+        let state = self.configuration.queryStrategy == .halfStencil
+                  ? self.findCollisionPairsHalfStencilState
+                  : self.findCollisionPairsState
+        encoder.dispatch1d(state: state, exactlyOrCovering: count)
+
+        self.encodeDispatchArguments(collisionPairs: collisionPairs, using: encoder)
+        encoder.popDebugGroup()
+
+        self.encodeStatistics(
+            after: .query,
+            compactList: (collisionPairs.count, collisionPairs.capacity),
+            vertexCount: count,
+            using: encoder
+        )
+    }
+
+    /// Builds the hierarchical grid of vertices of mixed radii and a compact list of the vertex pairs
+    /// closer than the sum of their radii.
+    ///
+    /// Every vertex is inserted at the finest of the `levelsCount` levels which cells are at least its diameter,
+    /// so large vertices don't crowd the cells of small ones, and queries the 27 cells around it at its own level
+    /// and at every coarser one. The levels are hashed into the same hash table and sorted together.
+    /// Every pair is written once with the smaller vertex index first and `vertexPairRanges[i]` describes
+    /// the pairs found by vertex `i`, which also contain pairs `(j, i)`.
+    /// The coarsest cells have to be at least the largest diameter, the wider vertices are counted in `clampedVerticesCount`
+    /// and may miss pairs. `spacingScale` and the connected vertices don't apply,
+    /// and the point queries don't apply to the hierarchical grid.
+    /// - Parameters:
+    ///   - positions: The buffer containing vertex positions.
+    ///   - radii: The radius of every vertex.
+    ///   - collisionPairs: The pairs list to store collision pairs.
+    ///   - collisionObjects: The objects the positions belong to, required with `usesCollisionGroups`.
+    ///   - activeCount: The number of leading positions to hash, at most `capacity`. All positions when `nil`.
+    ///   - commandBuffer: The Metal command buffer to encode the commands into.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        radii: MTLTypedBuffer<Float>,
+        collisionPairs: CollisionPairs,
+        collisionObjects: CollisionObjects? = nil,
+        activeCount: Int? = nil,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        self.encodeBuild(in: commandBuffer) { encoder in
+            self.build(
+                positions: positions,
+                radii: radii,
+                collisionPairs: collisionPairs,
+                collisionObjects: collisionObjects,
+                activeCount: activeCount,
+                using: encoder
+            )
+        }
+    }
+
+    /// Encodes `build(positions:radii:collisionPairs:collisionObjects:activeCount:in:)` into `encoder`,
+    /// which has to dispatch serially.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        radii: MTLTypedBuffer<Float>,
+        collisionPairs: CollisionPairs,
+        collisionObjects: CollisionObjects? = nil,
+        activeCount: Int? = nil,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        let count = activeCount ?? positions.count
+        precondition(radii.count >= count, "The radii don't cover the positions")
+        precondition(collisionPairs.vertexPairRanges.count >= count, "Collision pairs have fewer pair ranges than vertices")
+        self.beginInstrumentation(using: encoder)
+        self.bufferFill.encode(buffer: collisionPairs.count.buffer, value: .zero, count: 1, using: encoder)
+        self.bufferFill.encode(buffer: self.clampedVerticesCount.buffer, value: .zero, count: 1, using: encoder)
+
+        self.encodeGrid(positions: positions, radii: radii, count: count, using: encoder)
+
+        encoder.pushDebugGroup("Find Hierarchical Collision Pairs")
+        encoder.setBuffer(collisionPairs.pairs.buffer, offset: 0, index: 0)
+        encoder.setBuffer(self.hashTable, offset: 0, index: 1)
+        encoder.setBuffer(self.cellStart, offset: 0, index: 2)
+        encoder.setBuffer(self.cellEnd ?? self.cellStart, offset: 0, index: 3)
+        encoder.setBuffer(self.sortedHalfPositions, offset: 0, index: 4)
+        encoder.setBuffer(radii.buffer, offset: 0, index: 5)
+        encoder.setValue(UInt32(self.hashTableCapacity), at: 6)
+        encoder.setValue(UInt32(self.configuration.levelsCount), at: 7)
+        encoder.setValue(self.configuration.cellSize, at: 8)
+        encoder.setValue(UInt32(collisionPairs.capacity), at: 9)
+        encoder.setValue(UInt32(count), at: 11)
+        encoder.setBuffer(collisionPairs.vertexPairRanges.buffer, offset: 0, index: 12)
+        encoder.setBuffer(collisionPairs.count.buffer, offset: 0, index: 13)
+        self.setCollisionFilters(collisionObjects: collisionObjects, count: count, using: encoder)
+        encoder.dispatch1d(state: self.findHierarchicalCollisionPairsState, exactlyOrCovering: count)
+
+        self.encodeDispatchArguments(collisionPairs: collisionPairs, using: encoder)
+        encoder.popDebugGroup()
+
+        self.encodeStatistics(
+            after: .query,
+            compactList: (collisionPairs.count, collisionPairs.capacity),
+            vertexCount: count,
+            using: encoder
+        )
+    }
+
+    /// Builds the spatial hash of the given positions without querying it, so other points can be
+    /// queried against it with `query` until the next build. A static collider is built once and queried every frame.
+    /// - Parameters:
+    ///   - positions: The buffer containing vertex positions.
+    ///   - activeCount: The number of leading positions to hash, at most `capacity`. All positions when `nil`.
+    ///   - commandBuffer: The Metal command buffer to encode the commands into.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        activeCount: Int? = nil,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        self.encodeBuild(in: commandBuffer) { encoder in
+            self.build(positions: positions, activeCount: activeCount, using: encoder)
+        }
+    }
+
+    /// Encodes `build(positions:activeCount:in:)` into `encoder`, which has to dispatch serially.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        activeCount: Int? = nil,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        let count = activeCount ?? positions.count
+        self.beginInstrumentation(using: encoder)
+        self.encodeGrid(positions: positions, count: count, using: encoder)
+        self.encodeStatistics(after: nil, vertexCount: count, using: encoder)
+    }
+
+    /// Finds the vertices of the last build closer than `radius` to every point.
+    ///
+    /// The pairs are written as `(point, vertex)`, the pairs of a point are contiguous and described by
+    /// `collisionPairs.vertexPairRanges[point]`. The grid isn't modified, so any number of queries
+    /// can follow a build. A radius above `cellSize` visits more than the 27 neighbor cells.
+    /// - Parameters:
+    ///   - points: The buffer containing the query points.
+    ///   - radius: The distance within which vertices are reported.
+    ///   - collisionPairs: The pairs list with at least one pair range per point.
+    ///   - commandBuffer: The Metal command buffer encoded after a vertex `build` other than the hierarchical one.
+    public func query(
+        points: MTLTypedBuffer<SIMD4<Float>>,
+        radius: Float,
+        collisionPairs: CollisionPairs,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        commandBuffer.compute { encoder in
+            encoder.label = "Spatial Hashing Query"
+            self.query(points: points, radius: radius, collisionPairs: collisionPairs, using: encoder)
+        }
+    }
+
+    /// Encodes `query(points:radius:collisionPairs:in:)` into `encoder`, which has to dispatch serially.
+    public func query(
+        points: MTLTypedBuffer<SIMD4<Float>>,
+        radius: Float,
+        collisionPairs: CollisionPairs,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        precondition(self.sortedHashTableCount != nil, "Queries require a previous build")
+        precondition(!self.sortedHashTableIsHierarchical, "Queries don't apply to the hierarchical grid")
+        precondition(
+            collisionPairs.vertexPairRanges.count >= points.count,
+            "Collision pairs have fewer pair ranges than points"
+        )
+        encoder.pushDebugGroup("Find Point Pairs")
+        self.bufferFill.encode(buffer: collisionPairs.count.buffer, value: .zero, count: 1, using: encoder)
+
+        encoder.setBuffer(collisionPairs.pairs.buffer, offset: 0, index: 0)
+        encoder.setBuffer(self.hashTable, offset: 0, index: 1)
+        encoder.setBuffer(self.cellStart, offset: 0, index: 2)
+        encoder.setBuffer(self.cellEnd ?? self.cellStart, offset: 0, index: 3)
+        encoder.setBuffer(self.sortedHalfPositions, offset: 0, index: 4)
+        encoder.setBuffer(points.buffer, offset: 0, index: 5)
+        encoder.setValue(UInt32(self.hashTableCapacity), at: 6)
+        encoder.setValue(radius, at: 7)
+        encoder.setValue(self.configuration.cellSize, at: 8)
+        encoder.setValue(UInt32(collisionPairs.capacity), at: 9)
+        encoder.setBuffer(collisionPairs.vertexPairRanges.buffer, offset: 0, index: 10)
+        encoder.setBuffer(collisionPairs.count.buffer, offset: 0, index: 11)
+        encoder.setValue(UInt32(points.count), at: 12)
+        encoder.dispatch1d(state: self.findPointPairsState, exactlyOrCovering: points.count)
+
+        self.encodeDispatchArguments(collisionPairs: collisionPairs, using: encoder)
+        encoder.popDebugGroup()
+    }
+
+    /// Finds the vertices of the last build nearest to every point and closer than `radius`.
+    ///
+    /// Every point has `nearestVertices.count / points.count` slots, up to `maxNearestCandidatesCount`,
+    /// which receive its nearest vertices by increasing distance, terminated with `UInt32.max` when fewer are found.
+    /// A single slot per point gives the closest vertex.
+    /// - Parameters:
+    ///   - points: The buffer containing the query points.
+    ///   - radius: The distance within which vertices are reported.
+    ///   - nearestVertices: The buffer to store the nearest vertices of every point.
+    ///   - commandBuffer: The Metal command buffer encoded after a vertex `build` other than the hierarchical one.
+    public func query(
+        points: MTLTypedBuffer<SIMD4<Float>>,
+        radius: Float,
+        nearestVertices: MTLTypedBuffer<UInt32>,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        commandBuffer.compute { encoder in
+            encoder.label = "Spatial Hashing Query"
+            self.query(points: points, radius: radius, nearestVertices: nearestVertices, using: encoder)
+        }
+    }
+
+    /// Encodes `query(points:radius:nearestVertices:in:)` into `encoder`, which has to dispatch serially.
+    public func query(
+        points: MTLTypedBuffer<SIMD4<Float>>,
+        radius: Float,
+        nearestVertices: MTLTypedBuffer<UInt32>,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        precondition(self.sortedHashTableCount != nil, "Queries require a previous build")
+        precondition(!self.sortedHashTableIsHierarchical, "Queries don't apply to the hierarchical grid")
+        let nearestCount = nearestVertices.count / max(points.count, 1)
+        precondition(
+            nearestCount >= 1 && nearestCount <= Self.maxNearestCandidatesCount,
+            "Nearest vertices need 1 to maxNearestCandidatesCount slots per point"
+        )
+        encoder.pushDebugGroup("Find Nearest Point Vertices")
+        encoder.setBuffer(nearestVertices.buffer, offset: 0, index: 0)
+        encoder.setBuffer(self.hashTable, offset: 0, index: 1)
+        encoder.setBuffer(self.cellStart, offset: 0, index: 2)
+        encoder.setBuffer(self.cellEnd ?? self.cellStart, offset: 0, index: 3)
+        encoder.setBuffer(self.sortedHalfPositions, offset: 0, index: 4)
+        encoder.setBuffer(points.buffer, offset: 0, index: 5)
+        encoder.setValue(UInt32(self.hashTableCapacity), at: 6)
+        encoder.setValue(radius, at: 7)
+        encoder.setValue(self.configuration.cellSize, at: 8)
+        encoder.setValue(UInt32(nearestCount), at: 9)
+        encoder.setValue(UInt32(points.count), at: 10)
+        encoder.dispatch1d(state: self.findNearestPointVerticesState, exactlyOrCovering: points.count)
+        encoder.popDebugGroup()
+    }
+
+    /// Builds the grid of the vertex bounds swept from `previousPositions` to `positions`
+    /// and a compact list of the vertex pairs, which swept bounds are closer than `cellSize * spacingScale`.
+    ///
+    /// Every pair is written once with the smaller vertex index first. Requires `sweptVertexBounds`.
+    /// Unlike the static build, a vertex is inserted into every cell its swept bounds overlap
+    /// and queries only the cells overlapped by its inflated swept bounds.
+    /// - Parameters:
+    ///   - positions: The buffer containing vertex positions at the end of the step.
+    ///   - previousPositions: The buffer containing vertex positions at the start of the step.
+    ///   - collisionPairs: The pairs list to store collision pairs.
+    ///   - commandBuffer: The Metal command buffer to encode the commands into.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        previousPositions: MTLTypedBuffer<SIMD4<Float>>,
+        collisionPairs: CollisionPairs,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        self.encodeBuild(in: commandBuffer) { encoder in
+            self.build(
+                positions: positions,
+                previousPositions: previousPositions,
+                collisionPairs: collisionPairs,
+                using: encoder
+            )
+        }
+    }
+
+    /// Encodes `build(positions:previousPositions:collisionPairs:in:)` into `encoder`, which has to dispatch serially.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        previousPositions: MTLTypedBuffer<SIMD4<Float>>,
+        collisionPairs: CollisionPairs,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        precondition(
+            self.configuration.collisionType == .vertexToVertex,
+            "Swept vertex pairs require vertexToVertex"
+        )
+        self.encodePrimitiveGrid(
+            positions: positions,
+            previousPositions: previousPositions,
+            primitives: nil,
+            collisionPairs: collisionPairs,
+            using: encoder
+        )
+    }
+
+    /// Builds the primitive grid and finds the collision pairs of `vertexToTriangle` or `edgeToEdge`.
+    ///
+    /// - `vertexToTriangle`: `primitives` are triangles of 3 vertex indices,
+    ///   the pairs are `(vertex, triangle)` and the pair ranges are per vertex.
+    /// - `edgeToEdge`: `primitives` are edges of 2 vertex indices,
+    ///   the pairs are `(e, f)` with `e < f` and the pair ranges are per edge.
+    ///
+    /// A pair is found when the primitive bounds are closer than `cellSize * spacingScale`.
+    /// With `previousPositions` the bounds are swept over the step, which gives continuous collision candidates.
+    /// Primitives sharing a vertex with the query are skipped.
+    /// - Parameters:
+    ///   - positions: The buffer containing vertex positions.
+    ///   - previousPositions: The buffer containing vertex positions at the start of the step.
+    ///   - primitives: The buffer containing the vertex indices of the triangles or edges.
+    ///   - collisionPairs: The pairs list to store collision pairs.
+    ///   - commandBuffer: The Metal command buffer to encode the commands into.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        previousPositions: MTLTypedBuffer<SIMD4<Float>>? = nil,
+        primitives: MTLTypedBuffer<UInt32>,
+        collisionPairs: CollisionPairs,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        self.encodeBuild(in: commandBuffer) { encoder in
+            self.build(
+                positions: positions,
+                previousPositions: previousPositions,
+                primitives: primitives,
+                collisionPairs: collisionPairs,
+                using: encoder
+            )
+        }
+    }
+
+    /// Encodes `build(positions:previousPositions:primitives:collisionPairs:in:)` into `encoder`,
+    /// which has to dispatch serially.
+    public func build(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        previousPositions: MTLTypedBuffer<SIMD4<Float>>? = nil,
+        primitives: MTLTypedBuffer<UInt32>,
+        collisionPairs: CollisionPairs,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        precondition(
+            self.configuration.collisionType != .vertexToVertex,
+            "Primitive collision pairs require vertexToTriangle or edgeToEdge"
+        )
+        self.encodePrimitiveGrid(
+            positions: positions,
+            previousPositions: previousPositions,
+            primitives: primitives,
+            collisionPairs: collisionPairs,
+            using: encoder
+        )
+    }
+
+    private func encodePrimitiveGrid(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        previousPositions: MTLTypedBuffer<SIMD4<Float>>?,
+        primitives: MTLTypedBuffer<UInt32>?,
+        collisionPairs: CollisionPairs,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        guard let primitiveGrid = self.primitiveGrid
+        else { preconditionFailure("The primitive grid isn't allocated for this configuration") }
+        precondition(self.hasScratchBuffers, "The scratch buffers are aliasable, call allocateScratchBuffers first")
+        precondition(
+            !self.configuration.usesCollisionGroups,
+            "The primitive grid builds don't filter by collision groups, they require usesCollisionGroups off"
+        )
+        if let primitives {
+            precondition(
+                primitives.count / primitiveGrid.primitiveVerticesCount <= self.primitivesCount,
+                "The primitives count exceeds the primitives count the grid was allocated for"
+            )
+        } else {
+            precondition(positions.count <= self.capacity, "The vertex count exceeds the capacity, call reserveCapacity first")
+        }
+
+        self.beginInstrumentation(using: encoder)
+        encoder.pushDebugGroup("Insert Primitives & Find Collision Pairs")
+        self.bufferFill.encode(buffer: collisionPairs.count.buffer, value: .zero, count: 1, using: encoder)
+        self.bufferFill.encode(buffer: self.primitiveGridCounts.buffer, value: .zero, count: 2, using: encoder)
+        primitiveGrid.encode(
+            positions: positions,
+            previousPositions: previousPositions,
+            primitives: primitives,
+            collisionPairs: collisionPairs,
+            counts: self.primitiveGridCounts,
+            cellSize: self.configuration.cellSize,
+            spacingScale: self.configuration.spacingScale,
+            using: encoder
+        )
+
+        self.encodeDispatchArguments(collisionPairs: collisionPairs, using: encoder)
+        encoder.popDebugGroup()
+
+        self.encodeStatistics(
+            after: .primitiveGrid,
+            compactList: (collisionPairs.count, collisionPairs.capacity),
+            vertexCount: nil,
+            using: encoder
+        )
+    }
+
+    private func encodeDispatchArguments(
+        collisionPairs: CollisionPairs,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        encoder.setBuffer(collisionPairs.dispatchArguments.buffer, offset: 0, index: 0)
+        encoder.setBuffer(collisionPairs.count.buffer, offset: 0, index: 1)
+        encoder.setValue(UInt32(collisionPairs.capacity), at: 2)
+        encoder.setValue(UInt32(collisionPairs.dispatchThreadgroupWidth), at: 3)
+        encoder.dispatch1d(state: self.writeCollisionPairsDispatchArgumentsState, exactlyOrCovering: 1)
+    }
+
+    /// Encodes hashing, sorting and the cell bounds of the grid.
+    /// With `radii` every vertex is hashed in the cell of its level of the hierarchical grid.
+    private func encodeGrid(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        radii: MTLTypedBuffer<Float>? = nil,
+        count: Int,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        precondition(self.hasScratchBuffers, "The scratch buffers are aliasable, call allocateScratchBuffers first")
+        precondition(count <= self.capacity, "The vertex count exceeds the capacity, call reserveCapacity first")
+        precondition(count <= positions.count, "The vertex count exceeds the positions count")
+        let rebuildsIncrementally = self.incrementalRebuild != nil
+                                 && self.sortedHashTableCount == count
+
+        encoder.pushDebugGroup("Reset Cell Bounds")
+        if self.configuration.sortBackend == .counting {
+            self.bufferFill.encode(buffer: self.cellStart, value: .zero, count: self.hashTableCapacity + 1, using: encoder)
+        } else if let sortedHashTableCount = self.sortedHashTableCount {
+            encoder.setBuffer(self.cellStart, offset: 0, index: 0)
+            encoder.setBuffer(self.hashTable, offset: 0, index: 1)
+            encoder.setValue(UInt32(sortedHashTableCount), at: 2)
+            encoder.dispatch1d(state: self.resetCellBoundariesState, exactlyOrCovering: sortedHashTableCount)
+        } else {
+            // Only a cell with a set start is read, so `cellEnd` doesn't need a reset.
+            self.bufferFill.encode(buffer: self.cellStart, value: .max, count: self.hashTableCapacity, using: encoder)
+        }
+        encoder.popDebugGroup()
+        self.instrumentation?.record(.resetCellBounds, using: encoder)
+
+        encoder.pushDebugGroup("Convert Positions & Compute Vertex Hash And Index")
+        encoder.setBuffer(positions.buffer, offset: 0, index: 0)
+        encoder.setBuffer(self.halfPositions, offset: 0, index: 1)
+
+        if let radii {
+            encoder.setBuffer(self.hashTable, offset: 0, index: 2)
+            encoder.setValue(UInt32(self.hashTableCapacity), at: 3)
+            encoder.setValue(self.configuration.cellSize, at: 4)
+            encoder.setValue(UInt32(count), at: 5)
+            encoder.setBuffer(radii.buffer, offset: 0, index: 6)
+            encoder.setValue(UInt32(self.configuration.levelsCount), at: 7)
+            encoder.setBuffer(self.clampedVerticesCount.buffer, offset: 0, index: 8)
+            encoder.dispatch1d(
+                state: self.convertPositionsAndComputeLevelHashAndIndexState,
+                exactlyOrCovering: count
+            )
+        } else if let hashAndRank = self.scratchBuffers.hashAndRank {
+            encoder.setBuffer(hashAndRank, offset: 0, index: 2)
+            encoder.setBuffer(self.cellStart, offset: 0, index: 3)
+            encoder.setValue(UInt32(self.hashTableCapacity), at: 4)
+            encoder.setValue(self.configuration.cellSize, at: 5)
+            encoder.setValue(UInt32(count), at: 6)
+            encoder.dispatch1d(state: self.convertPositionsAndCountCellVerticesState, exactlyOrCovering: count)
+        } else if rebuildsIncrementally {
+            // The hashes are recomputed in the previous sorted order by the incremental rebuild.
+            encoder.setValue(self.configuration.cellSize, at: 2)
+            encoder.setValue(UInt32(count), at: 3)
+            encoder.dispatch1d(state: self.convertToHalfPrecisionPositionsState, exactlyOrCovering: count)
+        } else {
+            encoder.setBuffer(self.hashTable, offset: 0, index: 2)
+            encoder.setValue(UInt32(self.hashTableCapacity), at: 3)
+            encoder.setValue(self.configuration.cellSize, at: 4)
+            encoder.setValue(UInt32(count), at: 5)
+            encoder.dispatch1d(
+                state: self.convertPositionsAndComputeVertexHashAndIndexState,
+                exactlyOrCovering: count
+            )
+        }
+        encoder.popDebugGroup()
+        self.instrumentation?.record(.hashing, using: encoder)
+        
+        encoder.pushDebugGroup("Sort")
+        switch self.hashTableSort {
+        case _ where rebuildsIncrementally:
+            self.incrementalRebuild?.encode(
+                positions: self.halfPositions,
+                hashTable: self.hashTable,
+                count: count,
+                hashTableCapacity: self.hashTableCapacity,
+                cellSize: self.configuration.cellSize,
+                using: encoder
+            )
+        case let .bitonic(bitonicSort):
+            bitonicSort.encode(data: self.hashTable, count: count, using: encoder)
+        case let .radix(radixSort):
+            radixSort.encode(
+                data: self.hashTable,
+                count: count,
+                keyBits: RadixSort.keyBits(keysCount: self.hashTableCapacity),
+                using: encoder
+            )
+        case let .counting(prefixSum):
+            let hashAndRank = self.scratchBuffers.hashAndRank!
+            // The extra trailing zero count turns into the end offset of the last cell.
+            prefixSum.encode(data: self.cellStart, count: self.hashTableCapacity + 1, using: encoder)
+            encoder.setBuffer(hashAndRank, offset: 0, index: 0)
+            encoder.setBuffer(self.cellStart, offset: 0, index: 1)
+            encoder.setBuffer(self.hashTable, offset: 0, index: 2)
+            encoder.setValue(UInt32(count), at: 3)
+            encoder.dispatch1d(state: self.scatterVertexHashAndIndexState, exactlyOrCovering: count)
+        }
+        encoder.popDebugGroup()
+        self.instrumentation?.record(.sort, using: encoder)
+
+        self.sortedHashTableCount = count
+        self.sortedHashTableIsHierarchical = radii != nil
+        
+        encoder.pushDebugGroup("Reorder Positions & Compute Cell Bounds")
+        if let cellEnd = self.cellEnd {
+            let threadgroupWidth = 256
+            encoder.setBuffer(self.cellStart, offset: 0, index: 0)
+            encoder.setBuffer(cellEnd, offset: 0, index: 1)
+            encoder.setBuffer(self.hashTable, offset: 0, index: 2)
+            encoder.setValue(UInt32(count), at: 3)
+            encoder.setBuffer(self.halfPositions, offset: 0, index: 4)
+            encoder.setBuffer(self.sortedHalfPositions, offset: 0, index: 5)
+            encoder.setThreadgroupMemoryLength((threadgroupWidth + 16) * MemoryLayout<UInt32>.size, index: 0)
+            encoder.dispatch1d(
+                state: self.reorderPositionsAndComputeCellBoundariesState,
+                exactlyOrCovering: count,
+                threadgroupWidth: threadgroupWidth
+            )
+        } else {
+            // The cell offsets come out of the counting sort scan.
+            encoder.setBuffer(self.halfPositions, offset: 0, index: 0)
+            encoder.setBuffer(self.sortedHalfPositions, offset: 0, index: 1)
+            encoder.setBuffer(self.hashTable, offset: 0, index: 2)
+            encoder.setValue(UInt32(count), at: 3)
+            encoder.dispatch1d(state: self.reorderHalfPrecisionPositionsState, exactlyOrCovering: count)
+        }
+        encoder.popDebugGroup()
+        self.instrumentation?.record(.cellBounds, using: encoder)
+    }
+
+    /// Encodes the occupancy statistics of the hash table sorted by the last vertex build into `diagnostics`.
+    ///
+    /// - Parameters:
+    ///   - diagnostics: The diagnostics to write, readable after `commandBuffer` completes.
+    ///   - commandBuffer: The Metal command buffer encoded after a `build` with `collisionCandidates` or `collisionPairs`,
+    ///     other than the hierarchical one.
+    public func encodeDiagnostics(
+        into diagnostics: HashTableDiagnostics,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        guard let sortedHashTableCount = self.sortedHashTableCount
+        else { preconditionFailure("Diagnostics require a previous build") }
+        precondition(!self.sortedHashTableIsHierarchical, "Diagnostics don't apply to the hierarchical grid")
+        diagnostics.hashTableCapacity = self.hashTableCapacity
+
+        commandBuffer.compute { encoder in
+            encoder.label = "Hash Table Diagnostics"
+            self.bufferFill.encode(buffer: diagnostics.counters.buffer, value: .zero, count: diagnostics.counters.count, using: encoder)
+            encoder.setBuffer(self.hashTable, offset: 0, index: 0)
+            encoder.setBuffer(self.sortedHalfPositions, offset: 0, index: 1)
+            encoder.setBuffer(diagnostics.counters.buffer, offset: 0, index: 2)
+            encoder.setValue(self.configuration.cellSize, at: 3)
+            encoder.setValue(UInt32(sortedHashTableCount), at: 4)
+            encoder.dispatch1d(state: self.computeHashTableDiagnosticsState, exactlyOrCovering: sortedHashTableCount)
+        }
+    }
+
+    // MARK: - Sorted Order
+
+    /// The number of vertices sorted by the last vertex build, `nil` before the first one.
+    public var sortedVerticesCount: Int? { self.sortedHashTableCount }
+
+    /// Writes the vertex index of every position of the hash table sorted by the last vertex build,
+    /// the vertex order of the `sorted` output order.
+    /// - Parameters:
+    ///   - sortedVertices: The buffer with at least `sortedVerticesCount` elements to write.
+    ///   - commandBuffer: The Metal command buffer encoded after a vertex `build`.
+    public func encodeSortedVertices(
+        into sortedVertices: MTLTypedBuffer<UInt32>,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        commandBuffer.compute { encoder in
+            encoder.label = "Spatial Hashing Sorted Order"
+            self.encodeSortedVertices(into: sortedVertices, using: encoder)
+        }
+    }
+
+    /// Encodes `encodeSortedVertices(into:in:)` into `encoder`, which has to dispatch serially.
+    public func encodeSortedVertices(
+        into sortedVertices: MTLTypedBuffer<UInt32>,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        self.encodeSortedOrder(into: sortedVertices, state: self.writeSortedVerticesState, using: encoder)
+    }
+
+    /// Writes the position of every vertex in the hash table sorted by the last vertex build,
+    /// the inverse permutation of `encodeSortedVertices`, which maps vertex indices to the `sorted` output order.
+    /// - Parameters:
+    ///   - sortedRanks: The buffer with at least `sortedVerticesCount` elements to write.
+    ///   - commandBuffer: The Metal command buffer encoded after a vertex `build`.
+    public func encodeSortedRanks(
+        into sortedRanks: MTLTypedBuffer<UInt32>,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        commandBuffer.compute { encoder in
+            encoder.label = "Spatial Hashing Sorted Order"
+            self.encodeSortedRanks(into: sortedRanks, using: encoder)
+        }
+    }
+
+    /// Encodes `encodeSortedRanks(into:in:)` into `encoder`, which has to dispatch serially.
+    public func encodeSortedRanks(
+        into sortedRanks: MTLTypedBuffer<UInt32>,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        self.encodeSortedOrder(into: sortedRanks, state: self.writeSortedRanksState, using: encoder)
+    }
+
+    private func encodeSortedOrder(
+        into output: MTLTypedBuffer<UInt32>,
+        state: MTLComputePipelineState,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        guard let sortedHashTableCount = self.sortedHashTableCount
+        else { preconditionFailure("The sorted order requires a previous build") }
+        precondition(output.count >= sortedHashTableCount, "The output has fewer elements than sorted vertices")
+        encoder.setBuffer(self.hashTable, offset: 0, index: 0)
+        encoder.setBuffer(output.buffer, offset: 0, index: 1)
+        encoder.setValue(UInt32(sortedHashTableCount), at: 2)
+        encoder.dispatch1d(state: state, exactlyOrCovering: sortedHashTableCount)
+    }
+
+    /// Moves the per-vertex `values` into or out of the order of the hash table sorted by the last vertex build.
+    ///
+    /// With the `sorted` output order a solver gathers its attributes into the sorted order once per build,
+    /// runs over the candidates in that order and scatters the results back.
+    /// The values are copied as 32 bit words, so the stride of `T` has to be a multiple of 4 bytes.
+    /// - Parameters:
+    ///   - values: The values to permute, at least `sortedVerticesCount` of them.
+    ///   - output: The buffer to write the permuted values to, distinct from `values`.
+    ///   - direction: Whether the values are gathered into or scattered out of the sorted order.
+    ///   - commandBuffer: The Metal command buffer encoded after a vertex `build`.
+    public func permute<T>(
+        _ values: MTLTypedBuffer<T>,
+        into output: MTLTypedBuffer<T>,
+        direction: PermutationDirection,
+        in commandBuffer: MTLCommandBuffer
+    ) {
+        commandBuffer.compute { encoder in
+            encoder.label = "Spatial Hashing Permutation"
+            self.permute(values, into: output, direction: direction, using: encoder)
+        }
+    }
+
+    /// Encodes `permute(_:into:direction:in:)` into `encoder`, which has to dispatch serially.
+    public func permute<T>(
+        _ values: MTLTypedBuffer<T>,
+        into output: MTLTypedBuffer<T>,
+        direction: PermutationDirection,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        guard let sortedHashTableCount = self.sortedHashTableCount
+        else { preconditionFailure("The permutation requires a previous build") }
+        let wordSize = MemoryLayout<UInt32>.stride
+        precondition(MemoryLayout<T>.stride % wordSize == 0, "The values stride has to be a multiple of 4 bytes")
+        precondition(
+            values.count >= sortedHashTableCount && output.count >= sortedHashTableCount,
+            "The values have fewer elements than sorted vertices"
+        )
+        precondition(values.buffer !== output.buffer, "The values can't be permuted in place")
+
+        encoder.pushDebugGroup("Permute Vertex Values")
+        encoder.setBuffer(values.buffer, offset: 0, index: 0)
+        encoder.setBuffer(output.buffer, offset: 0, index: 1)
+        encoder.setBuffer(self.hashTable, offset: 0, index: 2)
+        encoder.setValue(UInt32(MemoryLayout<T>.stride / wordSize), at: 3)
+        encoder.setValue(UInt32(sortedHashTableCount), at: 4)
+        let state = direction == .toSortedOrder ? self.permuteToSortedOrderState : self.permuteFromSortedOrderState
+        encoder.dispatch1d(state: state, exactlyOrCovering: sortedHashTableCount)
+        encoder.popDebugGroup()
+    }
+
+    // MARK: - Instrumentation
+
+    /// Encodes `body` into a new compute encoder, which samples its start and end
+    /// when the instrumentation can't sample within the encoder.
+    private func encodeBuild(
+        in commandBuffer: MTLCommandBuffer,
+        _ body: (MTLComputeCommandEncoder) -> Void
+    ) {
+        guard let descriptor = self.instrumentation?.computePassDescriptor()
+        else {
+            commandBuffer.compute { encoder in
+                encoder.label = "Spatial Hashing"
+                body(encoder)
+            }
+            return
+        }
+        guard let encoder = commandBuffer.makeComputeCommandEncoder(descriptor: descriptor)
+        else { return }
+        encoder.label = "Spatial Hashing"
+        body(encoder)
+        encoder.endEncoding()
+    }
+
+    private func beginInstrumentation(using encoder: MTLComputeCommandEncoder) {
+        guard let instrumentation = self.instrumentation else { return }
+        self.bufferFill.encode(
+            buffer: instrumentation.statistics.buffer,
+            value: .zero,
+            count: BuildInstrumentation.statisticsCount,
+            using: encoder
+        )
+        instrumentation.begin(using: encoder)
+    }
+
+    /// Samples the end of `stage` and encodes the statistics of the build outputs into the instrumentation.
+    /// - Parameters:
+    ///   - stage: The last stage of the build, `nil` when the grid isn't queried.
+    ///   - compactList: The count and capacity of the collision pairs or compact candidates.
+    ///   - vertexCount: The vertex count of the sorted hash table, `nil` for the primitive grid builds.
+    private func encodeStatistics(
+        after stage: BuildInstrumentation.Stage?,
+        collisionCandidates: (buffer: MTLTypedBuffer<UInt32>, maxCount: UInt32)? = nil,
+        compactList: (count: MTLTypedBuffer<UInt32>, capacity: Int)? = nil,
+        vertexCount: Int?,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        guard let instrumentation = self.instrumentation else { return }
+        if let stage {
+            instrumentation.record(stage, using: encoder)
+        }
+
+        encoder.pushDebugGroup("Build Statistics")
+        if let collisionCandidates, let vertexCount {
+            encoder.setBuffer(collisionCandidates.buffer.buffer, offset: 0, index: 0)
+            encoder.setBuffer(instrumentation.statistics.buffer, offset: 0, index: 1)
+            encoder.setValue(collisionCandidates.maxCount, at: 2)
+            encoder.setValue(UInt32(vertexCount), at: 3)
+            encoder.setBuffer(self.overflowedVerticesCount.buffer, offset: 0, index: 4)
+            encoder.dispatch1d(state: self.computeCollisionCandidatesStatisticsState, exactlyOrCovering: vertexCount)
+        }
+        if let compactList {
+            encoder.setBuffer(compactList.count.buffer, offset: 0, index: 0)
+            encoder.setBuffer(instrumentation.statistics.buffer, offset: 0, index: 1)
+            encoder.setValue(UInt32(compactList.capacity), at: 2)
+            encoder.dispatch1d(state: self.writeCollisionPairsStatisticsState, exactlyOrCovering: 1)
+        }
+        if let vertexCount {
+            encoder.setBuffer(self.hashTable, offset: 0, index: 0)
+            encoder.setBuffer(instrumentation.statistics.buffer, offset: 0, index: 1)
+            encoder.setValue(UInt32(vertexCount), at: 2)
+            encoder.dispatch1d(state: self.computeSlotOccupancyStatisticsState, exactlyOrCovering: vertexCount)
+        }
+        encoder.popDebugGroup()
+
+        instrumentation.end(using: encoder)
+    }
+
+    /// Sets the grid inputs shared by the query kernels at indices 1 to 8, 10, 11 and 14.
+    private func setQueryInputs(
+        positions: MTLTypedBuffer<SIMD4<Float>>,
+        count: Int,
+        connectedVertices: MTLTypedBuffer<UInt32>?,
+        collisionObjects: CollisionObjects?,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        encoder.setBuffer(self.hashTable, offset: 0, index: 1)
+        encoder.setBuffer(self.cellStart, offset: 0, index: 2)
+        encoder.setBuffer(self.cellEnd ?? self.cellStart, offset: 0, index: 3)
+        encoder.setBuffer(self.sortedHalfPositions, offset: 0, index: 4)
+        if let connectedVertices {
+            encoder.setBuffer(connectedVertices.buffer, offset: 0, index: 5)
+        } else {
+            encoder.setValue([UInt32.zero], at: 5)
+        }
+        encoder.setValue(UInt32(self.hashTableCapacity), at: 6)
+        encoder.setValue(self.configuration.spacingScale, at: 7)
+        encoder.setValue(self.configuration.cellSize, at: 8)
+        let connectedVerticesCount: Int
+        switch self.configuration.connectedVerticesFormat {
+        case .fixedCount:
+            connectedVerticesCount = (connectedVertices?.count ?? 0) / positions.count
+            precondition(connectedVerticesCount <= 32, "More than 32 connected vertices require adjacency lists")
+        case .adjacencyLists:
+            precondition(
+                (connectedVertices?.count ?? 0) > count,
+                "Adjacency lists don't cover the positions"
+            )
+            connectedVerticesCount = 0
+        }
+        encoder.setValue(UInt32(connectedVerticesCount), at: 10)
+        encoder.setValue(UInt32(count), at: 11)
+        self.setCollisionFilters(collisionObjects: collisionObjects, count: count, using: encoder)
+    }
+
+    /// Sets the vertex filters of `collisionObjects` at index 14, or a placeholder without collision groups.
+    private func setCollisionFilters(
+        collisionObjects: CollisionObjects?,
+        count: Int,
+        using encoder: MTLComputeCommandEncoder
+    ) {
+        if self.configuration.usesCollisionGroups {
+            guard let collisionObjects
+            else { preconditionFailure("Collision groups require the collision objects") }
+            precondition(collisionObjects.vertexCount >= count, "Collision objects don't cover the positions")
+            encoder.setBuffer(collisionObjects.vertexFilters.buffer, offset: 0, index: 14)
+        } else {
+            precondition(collisionObjects == nil, "Collision objects require usesCollisionGroups")
+            encoder.setValue([SIMD2<UInt32>.zero], at: 14)
+        }
+    }
+}
+
+public extension SpatialHashing {
+    /// Calculates the total size of buffers required for spatial hashing.
+    ///
+    /// - Parameters:
+    ///   - positionsCount: The number of positions to hash.
+    ///   - sortBackend: The sort backend the buffers are allocated for.
+    ///   - rebuildMode: The rebuild mode the buffers are allocated for.
+    /// - Returns: The total size of buffers in bytes.
+    static func totalBuffersSize(
+        positionsCount: Int,
+        sortBackend: SortBackend = .bitonic,
+        rebuildMode: RebuildMode = .full
+    ) -> Int {
+        self.totalBuffersSize(
+            positionsCount: positionsCount,
+            configuration: .init(cellSize: 1, sortBackend: sortBackend, rebuildMode: rebuildMode)
+        )
+    }
+
+    /// Calculates the total size of buffers required for spatial hashing, the sum of their exact lengths.
+    ///
+    /// A heap also aligns every buffer, `heapSizeAndAlign` returns the size a heap needs.
+    /// - Parameters:
+    ///   - positionsCount: The number of positions to hash.
+    ///   - configuration: The configuration the buffers are allocated for.
+    ///   - primitivesCount: The maximum number of triangles or edges for `vertexToTriangle` and `edgeToEdge`.
+    /// - Returns: The total size of buffers in bytes.
+    static func totalBuffersSize(
+        positionsCount: Int,
+        configuration: Configuration,
+        primitivesCount: Int = 0
+    ) -> Int {
+        let lengths = self.bufferLengths(
+            positionsCount: positionsCount,
+            configuration: configuration,
+            primitivesCount: primitivesCount
+        )
+        return (lengths.persistent + lengths.scratch).reduce(0, +)
+    }
+
+    /// Calculates the size and alignment of a heap holding the buffers of spatial hashing.
+    ///
+    /// - Parameters:
+    ///   - device: The device the heap is created on, which decides the alignment of the buffers.
+    ///   - positionsCount: The number of positions to hash.
+    ///   - configuration: The configuration the buffers are allocated for.
+    ///   - primitivesCount: The maximum number of triangles or edges for `vertexToTriangle` and `edgeToEdge`.
+    ///   - includesScratchBuffers: Whether the heap also holds the scratch buffers,
+    ///     `false` for the heap of `init(heap:scratchHeap:configuration:capacity:primitivesCount:)`.
+    ///   - options: The resource options of the heap.
+    /// - Returns: The size and alignment to create the heap with.
+    static func heapSizeAndAlign(
+        device: MTLDevice,
+        positionsCount: Int,
+        configuration: Configuration,
+        primitivesCount: Int = 0,
+        includesScratchBuffers: Bool = true,
+        options: MTLResourceOptions = .storageModeShared
+    ) -> MTLSizeAndAlign {
+        let lengths = self.bufferLengths(
+            positionsCount: positionsCount,
+            configuration: configuration,
+            primitivesCount: primitivesCount
+        )
+        return self.heapSizeAndAlign(
+            device: device,
+            lengths: lengths.persistent + (includesScratchBuffers ? lengths.scratch : []),
+            options: options
+        )
+    }
+
+    /// Calculates the size and alignment of the scratch heap of `init(heap:scratchHeap:configuration:capacity:primitivesCount:)`.
+    ///
+    /// The heap can be larger to hold the transient buffers of the other passes aliasing the scratch buffers.
+    /// - Parameters:
+    ///   - device: The device the heap is created on, which decides the alignment of the buffers.
+    ///   - positionsCount: The number of positions to hash.
+    ///   - configuration: The configuration the buffers are allocated for.
+    ///   - primitivesCount: The maximum number of triangles or edges for `vertexToTriangle` and `edgeToEdge`.
+    ///   - options: The resource options of the heap.
+    /// - Returns: The size and alignment to create the heap with.
+    static func scratchHeapSizeAndAlign(
+        device: MTLDevice,
+        positionsCount: Int,
+        configuration: Configuration,
+        primitivesCount: Int = 0,
+        options: MTLResourceOptions = .storageModeShared
+    ) -> MTLSizeAndAlign {
+        let lengths = self.bufferLengths(
+            positionsCount: positionsCount,
+            configuration: configuration,
+            primitivesCount: primitivesCount
+        )
+        return self.heapSizeAndAlign(device: device, lengths: lengths.scratch, options: options)
+    }
+}
+
+extension SpatialHashing {
+    /// The lengths of the buffers kept from one build to the next and of the buffers only used within a build.
+    static func bufferLengths(
+        positionsCount: Int,
+        configuration: Configuration,
+        primitivesCount: Int
+    ) -> (persistent: [Int], scratch: [Int]) {
+        let sortBackend = configuration.sortBackend
+        let slotsCount = configuration.cellTableCapacity(vertexCount: positionsCount)
+        let persistent = Buffers.lengths(configuration: configuration, capacity: positionsCount)
+                       // The overflowed and clamped vertices and the primitive grid counts.
+                       + [MemoryLayout<UInt32>.stride, MemoryLayout<UInt32>.stride, MemoryLayout<UInt32>.stride * 2]
+
+        var scratch = ScratchBuffers.lengths(configuration: configuration, capacity: positionsCount)
+        switch sortBackend {
+        case .bitonic:
+            break
+        case .radix:
+            scratch += RadixSort.scratchBufferLengths(capacity: positionsCount)
+        case .counting:
+            scratch += PrefixSum.scratchBufferLengths(maxCount: slotsCount + 1)
+        }
+        switch (configuration.rebuildMode, sortBackend) {
+        case (.full, _), (.incremental, .counting):
+            break
+        case (.incremental, _):
+            scratch += IncrementalRebuild.bufferLengths(
+                capacity: positionsCount,
+                sharesRadixSort: sortBackend == .radix
+            )
+        }
+        if configuration.collisionType != .vertexToVertex || configuration.sweptVertexBounds {
+            scratch += PrimitiveGrid.bufferLengths(
+                hashTableCapacity: slotsCount,
+                cellEntriesCapacity: self.primitiveCellEntriesCapacity(
+                    configuration: configuration,
+                    vertexCount: positionsCount,
+                    primitivesCount: primitivesCount
+                )
+            )
+        }
+        return (persistent, scratch)
+    }
+
+    /// Places the buffers one after another at the offsets aligned for the device.
+    private static func heapSizeAndAlign(
+        device: MTLDevice,
+        lengths: [Int],
+        options: MTLResourceOptions
+    ) -> MTLSizeAndAlign {
+        var heapSizeAndAlign = MTLSizeAndAlign(size: 0, align: 1)
+        for length in lengths {
+            let sizeAndAlign = device.heapBufferSizeAndAlign(length: max(length, 1), options: options)
+            let offset = (heapSizeAndAlign.size + sizeAndAlign.align - 1) / sizeAndAlign.align * sizeAndAlign.align
+            heapSizeAndAlign.size = offset + sizeAndAlign.size
+            heapSizeAndAlign.align = max(heapSizeAndAlign.align, sizeAndAlign.align)
+        }
+        return heapSizeAndAlign
     }
 }
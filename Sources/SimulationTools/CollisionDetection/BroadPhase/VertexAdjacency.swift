@@ -0,0 +1,79 @@
+import MetalTools
+
+/// The vertices excluded from the collision candidates of every vertex, as sorted adjacency lists.
+///
+/// `buffer` holds `vertexCount + 1` offsets into itself followed by the lists, the vertices connected to
+/// vertex `i` are `buffer[buffer[i] ..< buffer[i + 1]]`. Pass it as `connectedVertices` to a `SpatialHashing`
+/// configured with the `adjacencyLists` format. The lists can be of any length.
+public final class VertexAdjacency {
+    /// The offsets followed by the sorted adjacency lists.
+    public let buffer: MTLTypedBuffer<UInt32>
+    public let vertexCount: Int
+
+    /// Creates the adjacency lists excluding the vertices up to `rings` edges away.
+    ///
+    /// - Parameters:
+    ///   - device: The Metal device for resource allocation.
+    ///   - neighbors: The vertices sharing an edge with every vertex.
+    ///   - rings: The topological distance of the excluded vertices, `1` excludes the direct neighbors.
+    /// - Throws: An error if the buffer cannot be created.
+    public init(
+        device: MTLDevice,
+        neighbors: [[UInt32]],
+        rings: Int = 1
+    ) throws {
+        let lists = Self.rings(neighbors: neighbors, count: rings)
+        var values = [UInt32]()
+        values.reserveCapacity(lists.count + 1 + lists.reduce(0) { $0 + $1.count })
+        var offset = UInt32(lists.count + 1)
+        for list in lists {
+            values.append(offset)
+            offset += UInt32(list.count)
+        }
+        values.append(offset)
+        lists.forEach { values.append(contentsOf: $0) }
+
+        self.buffer = try device.typedBuffer(with: values)
+        self.vertexCount = lists.count
+    }
+
+    /// Creates the adjacency lists of a triangle mesh excluding the vertices up to `rings` edges away.
+    ///
+    /// - Parameters:
+    ///   - device: The Metal device for resource allocation.
+    ///   - triangles: The vertex indices of the triangles, three per triangle.
+    ///   - vertexCount: The number of vertices of the mesh.
+    ///   - rings: The topological distance of the excluded vertices, `1` excludes the direct neighbors.
+    /// - Throws: An error if the buffer cannot be created.
+    public convenience init(
+        device: MTLDevice,
+        triangles: [UInt32],
+        vertexCount: Int,
+        rings: Int = 1
+    ) throws {
+        var neighbors = [Set<UInt32>](repeating: [], count: vertexCount)
+        for triangle in stride(from: 0, to: triangles.count - 2, by: 3) {
+            for corner in 0 ..< 3 {
+                let vertex = triangles[triangle + corner]
+                let next = triangles[triangle + (corner + 1) % 3]
+                neighbors[Int(vertex)].insert(next)
+                neighbors[Int(next)].insert(vertex)
+            }
+        }
+        try self.init(device: device, neighbors: neighbors.map { Array($0) }, rings: rings)
+    }
+
+    /// The sorted vertices within `count` edges of every vertex, excluding the vertex itself.
+    static func rings(neighbors: [[UInt32]], count: Int) -> [[UInt32]] {
+        neighbors.indices.map { vertex in
+            var visited: Set<UInt32> = [UInt32(vertex)]
+            var frontier: [UInt32] = [UInt32(vertex)]
+            for _ in 0 ..< count {
+                frontier = frontier.flatMap { neighbors[Int($0)] }.filter { visited.insert($0).inserted }
+                if frontier.isEmpty { break }
+            }
+            visited.remove(UInt32(vertex))
+            return visited.sorted()
+        }
+    }
+}
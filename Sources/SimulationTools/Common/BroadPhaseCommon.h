@@ -6,12 +6,59 @@ using namespace metal;
 
 #define MAX_CONNECTED_VERTICES 32
 
+/// Set when the cells of a bounded domain are indexed with Morton codes instead of hashed.
+constant bool usesDenseGrid [[ function_constant(4) ]];
+/// The first cell of the dense grid domain.
+constant int3 denseGridLowerCell [[ function_constant(5) ]];
+/// The number of cells of the dense grid domain along every axis.
+constant int3 denseGridCellsCount [[ function_constant(6) ]];
+/// Set when the sorted positions are stored relative to their cell with 16 bit cell coordinates.
+constant bool usesCellRelativePositions [[ function_constant(7) ]];
+/// Set when the sorted positions are stored as `float4`.
+constant bool usesFullPrecisionPositions [[ function_constant(8) ]];
+
+/// The grid cell of a cell. In the dense grid the cells outside the domain are clamped to the boundary cells.
+METAL_FUNC int3 gridCell(int3 cell) {
+    if (usesDenseGrid) {
+        return clamp(cell, denseGridLowerCell, denseGridLowerCell + denseGridCellsCount - 1);
+    }
+    return cell;
+}
+
+/// The cell of a position. In the dense grid the positions outside the domain are clamped to the boundary cells.
 METAL_FUNC int3 hashCoord(float3 position, float gridSpacing) {
     int x = floor(position.x / gridSpacing);
     int y = floor(position.y / gridSpacing);
     int z = floor(position.z / gridSpacing);
-        
-    return int3(x, y, z);
+
+    return gridCell(int3(x, y, z));
+}
+
+/// The cell coordinates as stored with cell-relative positions, which wrap around every 65536 cells.
+METAL_FUNC int3 wrapCell(int3 cell) {
+    if (usesCellRelativePositions) {
+        return (cell << 16) >> 16;
+    }
+    return cell;
+}
+
+/// Whether a neighbor cell exists in the grid. Every cell exists in the hashed grid.
+METAL_FUNC bool isGridCell(int3 cell) {
+    if (usesDenseGrid) {
+        int3 localCell = cell - denseGridLowerCell;
+        return all(localCell >= 0) && all(localCell < denseGridCellsCount);
+    }
+    return true;
+}
+
+/// Interleaves the low 10 bits of the coordinates.
+METAL_FUNC uint mortonCode(uint3 cell) {
+    uint3 bits = cell & 0x3FF;
+    bits = (bits | (bits << 16)) & 0x030000FF;
+    bits = (bits | (bits << 8)) & 0x0300F00F;
+    bits = (bits | (bits << 4)) & 0x030C30C3;
+    bits = (bits | (bits << 2)) & 0x09249249;
+    return bits.x | (bits.y << 1) | (bits.z << 2);
 }
 
 METAL_FUNC int computeHash(int3 position) {
@@ -24,9 +71,20 @@ METAL_FUNC int computeHash(int3 position) {
     return hash;
 }
 
+/// Set when the hash table capacity is a power of two.
+constant bool hashTableCapacityIsPowerOfTwo [[ function_constant(3) ]];
+
 METAL_FUNC uint getHash(int3 position, uint hashTableCapacity) {
-    int hash = computeHash(position);
-    return uint(abs(hash % hashTableCapacity));
+    if (usesDenseGrid) {
+        return mortonCode(uint3(position - denseGridLowerCell));
+    }
+    uint hash = uint(computeHash(wrapCell(position)));
+    if (hashTableCapacityIsPowerOfTwo) {
+        // The low bits of the XOR hash only depend on the low bits of the coordinates,
+        // so the high bits of a Fibonacci hash are taken in place of a mask.
+        return (hash * 2654435769u) >> (32 - popcount(hashTableCapacity - 1));
+    }
+    return hash % hashTableCapacity;
 }
 
 #endif /* BroadPhaseCommon_h */
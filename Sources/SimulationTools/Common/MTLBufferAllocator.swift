@@ -13,10 +13,37 @@ final class MTLBufferAllocator {
         }
     }
 
+    /// Whether the heap buffers are tracked until `makeAllocatedBuffersAliasable`.
+    let isTransient: Bool
+
     private let type: `Type`
+    private var transientBuffers: [MTLBuffer] = []
 
-    init(type: Type) {
+    /// - Parameters:
+    ///   - type: The device or heap the buffers are allocated from.
+    ///   - isTransient: Tracks the allocated buffers so they can be made aliasable, requires a heap.
+    init(type: Type, isTransient: Bool = false) {
+        if case .device = type {
+            precondition(!isTransient, "Transient buffers require a heap")
+        }
         self.type = type
+        self.isTransient = isTransient
+    }
+
+    /// Makes the buffers allocated since the last call aliasable, so the following allocations from the heap
+    /// may reuse their memory. The buffers must not be used by commands encoded after the call.
+    func makeAllocatedBuffersAliasable() {
+        for buffer in self.transientBuffers {
+            buffer.makeAliasable()
+        }
+        self.transientBuffers = []
+    }
+
+    private func track(_ buffer: MTLBuffer) -> MTLBuffer {
+        if self.isTransient {
+            self.transientBuffers.append(buffer)
+        }
+        return buffer
     }
 
     func buffer<T>(
@@ -32,11 +59,11 @@ final class MTLBufferAllocator {
                 options: options
             )
         case let .heap(heap):
-            return try heap.buffer(
+            return try self.track(heap.buffer(
                 for: type,
                 count: count,
                 options: heap.resourceOptions
-            )
+            ))
         }
     }
 
@@ -51,10 +78,10 @@ final class MTLBufferAllocator {
                 options: options
             )
         case let .heap(heap):
-            return try heap.buffer(
+            return try self.track(heap.buffer(
                 with: value,
                 options: heap.resourceOptions
-            )
+            ))
         }
     }
 
@@ -69,10 +96,10 @@ final class MTLBufferAllocator {
                 options: options
             )
         case let .heap(heap):
-            return try heap.buffer(
+            return try self.track(heap.buffer(
                 with: values,
                 options: heap.resourceOptions
-            )
+            ))
         }
     }
 
@@ -88,7 +115,7 @@ final class MTLBufferAllocator {
         case let .heap(heap):
             guard let buffer = heap.makeBuffer(length: length, options: heap.resourceOptions)
             else { throw MetalError.MTLDeviceError.bufferCreationFailed }
-            return buffer
+            return self.track(buffer)
         }
     }
 }
@@ -0,0 +1,177 @@
+import Foundation
+import MetalTools
+
+/// The function constant values of a pipeline state, hashable so specialized pipeline states can be cached.
+struct FunctionConstants: Hashable {
+    private enum Value: Hashable {
+        case bool(Bool)
+        case uint(UInt32)
+        case int3(SIMD3<Int32>)
+    }
+
+    private var values: [Int: Value] = [:]
+
+    var isEmpty: Bool { self.values.isEmpty }
+
+    mutating func set(_ value: Bool, at index: Int) {
+        self.values[index] = .bool(value)
+    }
+
+    mutating func set(_ value: UInt32, at index: Int) {
+        self.values[index] = .uint(value)
+    }
+
+    mutating func set(_ value: SIMD3<Int32>, at index: Int) {
+        self.values[index] = .int3(value)
+    }
+
+    func makeConstantValues() -> MTLFunctionConstantValues {
+        let constantValues = MTLFunctionConstantValues()
+        for (index, value) in self.values {
+            switch value {
+            case let .bool(value):
+                constantValues.set(value, at: index)
+            case var .uint(value):
+                constantValues.setConstantValue(&value, type: .uint, index: index)
+            case var .int3(value):
+                constantValues.setConstantValue(&value, type: .int3, index: index)
+            }
+        }
+        return constantValues
+    }
+}
+
+/// The default library of the module and the pipeline states specialized from it.
+///
+/// A library is shared by every instance created on the same device,
+/// so the library is loaded and every specialization is compiled once per process.
+/// With a binary archive the compiled pipelines also outlive the process:
+/// pipelines found in the archive are loaded without compilation, the others are compiled and added to it.
+public final class PipelineLibrary {
+    public enum Error: Swift.Error {
+        case functionNotFound(String)
+    }
+
+    private struct Key: Hashable {
+        let function: String
+        let constants: FunctionConstants
+    }
+
+    let library: MTLLibrary
+    public var device: MTLDevice { self.library.device }
+
+    private let lock = NSLock()
+    private var pipelineStates: [Key: MTLComputePipelineState] = [:]
+    private var binaryArchive: (archive: MTLBinaryArchive, url: URL)?
+
+    private static let sharedLock = NSLock()
+    private static var sharedLibraries: [UInt64: PipelineLibrary] = [:]
+
+    init(library: MTLLibrary) {
+        self.library = library
+    }
+
+    /// The library shared by every instance on `device`, loaded on the first call.
+    public static func shared(device: MTLDevice) throws -> PipelineLibrary {
+        self.sharedLock.lock()
+        defer { self.sharedLock.unlock() }
+        if let library = self.sharedLibraries[device.registryID] {
+            return library
+        }
+        let library = try PipelineLibrary(library: device.makeDefaultLibrary(bundle: .module))
+        self.sharedLibraries[device.registryID] = library
+        return library
+    }
+
+    // MARK: - Binary Archive
+
+    /// Loads the pipelines of the following instances from the binary archive at `url`.
+    ///
+    /// Call it before creating the instances, the pipelines compiled before aren't added to the archive.
+    /// A missing or unreadable archive is replaced by an empty one, which `serializeBinaryArchive` writes to `url`.
+    /// - Parameter url: The file URL of the archive, usually in the caches directory of the app.
+    /// - Throws: An error if an empty archive cannot be created.
+    public func useBinaryArchive(at url: URL) throws {
+        let descriptor = MTLBinaryArchiveDescriptor()
+        descriptor.url = url
+        let archive: MTLBinaryArchive
+        if FileManager.default.fileExists(atPath: url.path),
+           let existingArchive = try? self.device.makeBinaryArchive(descriptor: descriptor) {
+            archive = existingArchive
+        } else {
+            descriptor.url = nil
+            archive = try self.device.makeBinaryArchive(descriptor: descriptor)
+        }
+        self.lock.lock()
+        defer { self.lock.unlock() }
+        self.binaryArchive = (archive: archive, url: url)
+    }
+
+    /// Writes the binary archive with every pipeline compiled since `useBinaryArchive`, so the next launch skips the compilation.
+    /// - Throws: An error if the archive cannot be written.
+    public func serializeBinaryArchive() throws {
+        self.lock.lock()
+        defer { self.lock.unlock() }
+        guard let binaryArchive = self.binaryArchive
+        else { preconditionFailure("Serializing requires useBinaryArchive") }
+        try binaryArchive.archive.serialize(to: binaryArchive.url)
+    }
+
+    // MARK: - Pipeline States
+
+    /// Returns the pipeline state of `function` specialized with `constants`, compiled on the first request.
+    func computePipelineState(
+        function: String,
+        constants: FunctionConstants = .init()
+    ) throws -> MTLComputePipelineState {
+        let key = Key(function: function, constants: constants)
+        self.lock.lock()
+        defer { self.lock.unlock() }
+        if let pipelineState = self.pipelineStates[key] {
+            return pipelineState
+        }
+        let pipelineState: MTLComputePipelineState
+        if let archive = self.binaryArchive?.archive {
+            pipelineState = try self.computePipelineState(function: function, constants: constants, archive: archive)
+        } else {
+            pipelineState = try constants.isEmpty
+                          ? self.library.computePipelineState(function: function)
+                          : self.library.computePipelineState(
+                              function: function,
+                              constants: constants.makeConstantValues()
+                            )
+        }
+        self.pipelineStates[key] = pipelineState
+        return pipelineState
+    }
+
+    private func computePipelineState(
+        function functionName: String,
+        constants: FunctionConstants,
+        archive: MTLBinaryArchive
+    ) throws -> MTLComputePipelineState {
+        let function: MTLFunction
+        if constants.isEmpty {
+            guard let libraryFunction = self.library.makeFunction(name: functionName)
+            else { throw Error.functionNotFound(functionName) }
+            function = libraryFunction
+        } else {
+            function = try self.library.makeFunction(
+                name: functionName,
+                constantValues: constants.makeConstantValues()
+            )
+        }
+        let descriptor = MTLComputePipelineDescriptor()
+        descriptor.computeFunction = function
+        descriptor.binaryArchives = [archive]
+
+        // Adding first compiles a missing pipeline once into the archive, which the pipeline state is then
+        // loaded from. Pipelines already in the archive aren't added twice.
+        try archive.addComputePipelineFunctions(descriptor: descriptor)
+        return try self.device.makeComputePipelineState(
+            descriptor: descriptor,
+            options: [],
+            reflection: nil
+        )
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef PrefixSumCommon_h
+#define PrefixSumCommon_h
+
+#include <metal_stdlib>
+using namespace metal;
+
+/// Computes an exclusive prefix sum of `value` across the threadgroup.
+/// Returns the exclusive sum for the calling thread in `x` and the threadgroup total in `y`.
+/// `shared` must hold at least `threadgroupSize` elements and every thread of the threadgroup must call it.
+template <uint threadgroupSize>
+METAL_FUNC uint2 threadgroupExclusiveSum(
+    const uint value,
+    threadgroup uint* shared,
+    const uint threadIndex
+) {
+    shared[threadIndex] = value;
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    for (uint offset = 1; offset < threadgroupSize; offset <<= 1) {
+        const uint addend = threadIndex >= offset ? shared[threadIndex - offset] : 0;
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+        shared[threadIndex] += addend;
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+
+    const uint inclusive = shared[threadIndex];
+    const uint total = shared[threadgroupSize - 1];
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    return uint2(inclusive - value, total);
+}
+
+#endif /* PrefixSumCommon_h */
@@ -32,3 +32,15 @@ extension Collection {
     
     var isNotEmpty: Bool { !isEmpty }
 }
+
+extension Int {
+    /// The smallest power of two greater than or equal to `self`, `1` for non-positive values.
+    var nextPowerOfTwo: Int {
+        self > 1 ? 1 << (Int.bitWidth - (self - 1).leadingZeroBitCount) : 1
+    }
+
+    /// The largest power of two less than or equal to `self`, `1` for non-positive values.
+    var previousPowerOfTwo: Int {
+        self > 1 ? 1 << (Int.bitWidth - 1 - self.leadingZeroBitCount) : 1
+    }
+}
@@ -0,0 +1,249 @@
+import XCTest
+import Metal
+import SimulationTools
+
+/// GPU timings of `SpatialHashing.build` across scene types, sizes, sort backends and query strategies.
+///
+/// Skipped unless `SPATIAL_HASHING_BENCHMARKS` is set, run them in release on the target device:
+/// `SPATIAL_HASHING_BENCHMARKS=1 swift test -c release --filter SimulationToolsBenchmarks`.
+/// Every line reports the median GPU time of the build, of its stages and the found candidates per second.
+/// `SPATIAL_HASHING_BENCHMARK_MAX_COUNT` caps the point counts, 4M by default.
+final class SpatialHashingBenchmarks: XCTestCase {
+    /// The point sets, generated from a fixed seed so runs on different devices hash the same points.
+    enum Scene: String, CaseIterable {
+        /// A cube filled uniformly with about one point per cell.
+        case uniform
+        /// A square cloth with a point per cell along both axes, gently folded.
+        case clothGrid
+        /// Dense spherical clusters in a cube of mostly empty cells.
+        case clustered
+        /// A cube a thousand times sparser than `uniform`, spanning thousands of cells per axis.
+        case sparseLargeDomain
+
+        func positions(count: Int) -> [SIMD4<Float>] {
+            var generator = SplitMix64(seed: 0x5EED)
+            func random(in range: ClosedRange<Float>) -> SIMD3<Float> {
+                .random(in: range, using: &generator)
+            }
+            let side = Float(count).squareRoot()
+            let cubeSide = Float(pow(Double(count), 1.0 / 3.0))
+
+            switch self {
+            case .uniform:
+                return (0 ..< count).map { _ in SIMD4(random(in: 0 ... cubeSide), 1) }
+            case .clothGrid:
+                let rowLength = Int(side.rounded(.up))
+                return (0 ..< count).map { index in
+                    let x = Float(index % rowLength)
+                    let z = Float(index / rowLength)
+                    return SIMD4(x, 4 * sin(x * 0.05) * cos(z * 0.05), z, 1)
+                }
+            case .clustered:
+                let clustersCount = 64
+                let centers = (0 ..< clustersCount).map { _ in random(in: 0 ... cubeSide * 4) }
+                let radius = cubeSide / 8
+                return (0 ..< count).map { index in
+                    var offset: SIMD3<Float>
+                    repeat {
+                        offset = random(in: -1 ... 1)
+                    } while (offset * offset).sum() > 1
+                    return SIMD4(centers[index % clustersCount] + offset * radius, 1)
+                }
+            case .sparseLargeDomain:
+                return (0 ..< count).map { _ in SIMD4(random(in: 0 ... cubeSide * 10), 1) }
+            }
+        }
+
+        /// Half precision positions are too coarse for the cells of the large domain.
+        var positionStorage: SpatialHashing.PositionStorage {
+            self == .sparseLargeDomain ? .cellRelative : .half
+        }
+    }
+
+    /// A 64 bit SplitMix generator, fast enough for millions of points and reproducible across platforms.
+    struct SplitMix64: RandomNumberGenerator {
+        private var state: UInt64
+
+        init(seed: UInt64) {
+            self.state = seed
+        }
+
+        mutating func next() -> UInt64 {
+            self.state &+= 0x9E3779B97F4A7C15
+            var z = self.state
+            z = (z ^ (z >> 30)) &* 0xBF58476D1CE4E5B9
+            z = (z ^ (z >> 27)) &* 0x94D049BB133111EB
+            return z ^ (z >> 31)
+        }
+    }
+
+    static let counts = [10_000, 100_000, 1_000_000, 4_000_000]
+    static let iterationsCount = 10
+    static let maxCollisionCandidatesCount = 8
+
+    var device: MTLDevice!
+    var commandQueue: MTLCommandQueue!
+
+    override func setUpWithError() throws {
+        try super.setUpWithError()
+        try XCTSkipUnless(
+            ProcessInfo.processInfo.environment["SPATIAL_HASHING_BENCHMARKS"] != nil,
+            "Set SPATIAL_HASHING_BENCHMARKS to run the benchmarks"
+        )
+        self.device = MTLCreateSystemDefaultDevice()
+        self.commandQueue = self.device.makeCommandQueue()
+    }
+
+    override func tearDown() {
+        self.device = nil
+        self.commandQueue = nil
+        super.tearDown()
+    }
+
+    var counts: [Int] {
+        let maxCount = ProcessInfo.processInfo.environment["SPATIAL_HASHING_BENCHMARK_MAX_COUNT"].flatMap(Int.init)
+        return Self.counts.filter { $0 <= maxCount ?? .max }
+    }
+
+    // MARK: - Sort Backends
+
+    func testUniformSortBackends() throws {
+        try self.benchmarkSortBackends(scene: .uniform)
+    }
+
+    func testClothGridSortBackends() throws {
+        try self.benchmarkSortBackends(scene: .clothGrid)
+    }
+
+    func testClusteredSortBackends() throws {
+        try self.benchmarkSortBackends(scene: .clustered)
+    }
+
+    func testSparseLargeDomainSortBackends() throws {
+        try self.benchmarkSortBackends(scene: .sparseLargeDomain)
+    }
+
+    // MARK: - Query Strategies
+
+    func testUniformQueryStrategies() throws {
+        try self.benchmarkQueryStrategies(scene: .uniform)
+    }
+
+    func testClothGridQueryStrategies() throws {
+        try self.benchmarkQueryStrategies(scene: .clothGrid)
+    }
+
+    func testClusteredQueryStrategies() throws {
+        try self.benchmarkQueryStrategies(scene: .clustered)
+    }
+
+    func testSparseLargeDomainQueryStrategies() throws {
+        try self.benchmarkQueryStrategies(scene: .sparseLargeDomain)
+    }
+
+    // MARK: - Benchmark
+
+    func benchmarkSortBackends(scene: Scene) throws {
+        for count in self.counts {
+            let positions = scene.positions(count: count)
+            for sortBackend in SpatialHashing.SortBackend.allCases {
+                try self.benchmark(
+                    scene: scene,
+                    positions: positions,
+                    configuration: .init(
+                        cellSize: 1,
+                        sortBackend: sortBackend,
+                        positionStorage: scene.positionStorage
+                    ),
+                    variant: "sort: \(sortBackend)"
+                )
+            }
+        }
+    }
+
+    func benchmarkQueryStrategies(scene: Scene) throws {
+        for count in self.counts {
+            let positions = scene.positions(count: count)
+            for queryStrategy in SpatialHashing.QueryStrategy.allCases {
+                try self.benchmark(
+                    scene: scene,
+                    positions: positions,
+                    configuration: .init(
+                        cellSize: 1,
+                        queryStrategy: queryStrategy,
+                        positionStorage: scene.positionStorage
+                    ),
+                    variant: "query: \(queryStrategy)"
+                )
+            }
+        }
+    }
+
+    /// Builds the collision candidates of `positions` once to warm up and `iterationsCount` times
+    /// to measure, and prints the median timings.
+    func benchmark(
+        scene: Scene,
+        positions: [SIMD4<Float>],
+        configuration: SpatialHashing.Configuration,
+        variant: String
+    ) throws {
+        let spatialHashing = try SpatialHashing(
+            device: self.device,
+            configuration: configuration,
+            capacity: positions.count
+        )
+        let instrumentation = try BuildInstrumentation(device: self.device)
+        spatialHashing.instrumentation = instrumentation
+        let positionsBuffer = try self.device.typedBuffer(with: positions)
+        let collisionCandidatesBuffer = try self.device.typedBuffer(
+            for: UInt32.self,
+            count: positions.count * Self.maxCollisionCandidatesCount
+        )
+
+        var buildDurations: [TimeInterval] = []
+        var stageDurations: [BuildInstrumentation.Stage: [TimeInterval]] = [:]
+        var foundCount = 0
+        for iteration in 0 ... Self.iterationsCount {
+            let commandBuffer = try XCTUnwrap(self.commandQueue.makeCommandBuffer())
+            spatialHashing.build(
+                positions: positionsBuffer,
+                collisionCandidates: collisionCandidatesBuffer,
+                connectedVertices: nil,
+                in: commandBuffer
+            )
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+            XCTAssertNil(commandBuffer.error, "\(scene), \(positions.count), \(variant)")
+            // The first build is a warm-up, it pays for the first touch of the buffers.
+            guard iteration > 0 else { continue }
+
+            buildDurations.append(
+                instrumentation.buildDuration ?? commandBuffer.gpuEndTime - commandBuffer.gpuStartTime
+            )
+            for (stage, duration) in instrumentation.stageDurations {
+                stageDurations[stage, default: []].append(duration)
+            }
+            foundCount = instrumentation.foundCount
+        }
+
+        let buildDuration = Self.median(buildDurations)
+        let stages = BuildInstrumentation.Stage.allCases.compactMap { stage in
+            stageDurations[stage].map { "\(stage) \(Self.milliseconds(Self.median($0)))" }
+        }
+        let candidatesPerSecond = buildDuration > 0 ? Double(foundCount) / buildDuration : 0
+        print(
+            "\(scene) \(positions.count) points, \(variant): \(Self.milliseconds(buildDuration))",
+            stages.isEmpty ? "" : "(\(stages.joined(separator: ", ")))",
+            "\(foundCount) candidates, \(String(format: "%.1f", candidatesPerSecond / 1e6)) M candidates/s"
+        )
+    }
+
+    static func median(_ values: [TimeInterval]) -> TimeInterval {
+        let sorted = values.sorted()
+        return sorted.isEmpty ? 0 : sorted[sorted.count / 2]
+    }
+
+    static func milliseconds(_ duration: TimeInterval) -> String {
+        String(format: "%.3f ms", duration * 1000)
+    }
+}
@@ -40,6 +40,77 @@ final class SpatialHashingTests: XCTestCase {
         )
     }
     
+    func testInstancesSharePipelineStates() throws {
+        let library = try PipelineLibrary.shared(device: self.device)
+        XCTAssertTrue(library === (try PipelineLibrary.shared(device: self.device)))
+        
+        var constants = FunctionConstants()
+        constants.set(true, at: 0)
+        let state = try library.computePipelineState(function: "bitonicSortFirstPass", constants: constants)
+        XCTAssertTrue(state === (try library.computePipelineState(function: "bitonicSortFirstPass", constants: constants)))
+        
+        // The capacity initializer doesn't need the positions on the CPU.
+        let positions = self.generateMockData()
+        let spatialHashing = try SpatialHashing(
+            device: self.device,
+            configuration: .init(cellSize: 1.0),
+            capacity: positions.count
+        )
+        XCTAssertEqual(spatialHashing.capacity, positions.count)
+        
+        let positionsBuffer = try device.typedBuffer(with: positions)
+        let collisionCandidatesBuffer = try device.typedBuffer(
+            with: Array(repeating: UInt32.max, count: positions.count * 8)
+        )
+        guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+            XCTFail("Failed to create command buffer")
+            return
+        }
+        spatialHashing.build(
+            positions: positionsBuffer,
+            collisionCandidates: collisionCandidatesBuffer,
+            connectedVertices: nil,
+            in: commandBuffer
+        )
+        commandBuffer.commit()
+        commandBuffer.waitUntilCompleted()
+        
+        XCTAssertEqual(
+            collisionCandidatesBuffer.values!.chunked(into: 8).map { Set($0) },
+            try collisionCandidates(positions: positions, cellSize: 1.0).values!.chunked(into: 8).map { Set($0) }
+        )
+    }
+    
+    func testBinaryArchiveStoresCompiledPipelines() throws {
+        let url = FileManager.default.temporaryDirectory
+            .appendingPathComponent(UUID().uuidString)
+            .appendingPathExtension("metallib")
+        defer { try? FileManager.default.removeItem(at: url) }
+        
+        // A separate library keeps the archive away from the shared one of the other tests.
+        let library = try PipelineLibrary(library: self.device.makeDefaultLibrary(bundle: .module))
+        try library.useBinaryArchive(at: url)
+        _ = try BitonicSort(library: library)
+        try library.serializeBinaryArchive()
+        XCTAssertTrue(FileManager.default.fileExists(atPath: url.path))
+        
+        // The next launch loads the archive and gets the same kernels without recompiling them.
+        let relaunchedLibrary = try PipelineLibrary(library: self.device.makeDefaultLibrary(bundle: .module))
+        try relaunchedLibrary.useBinaryArchive(at: url)
+        let bitonicSort = try BitonicSort(library: relaunchedLibrary)
+        
+        let entries = (0..<5000).map { SIMD2<UInt32>(.random(in: 0..<100), UInt32($0)) }
+        let buffer = try device.typedBuffer(with: entries)
+        guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+            XCTFail("Failed to create command buffer")
+            return
+        }
+        bitonicSort.encode(data: buffer.buffer, count: entries.count, in: commandBuffer)
+        commandBuffer.commit()
+        commandBuffer.waitUntilCompleted()
+        XCTAssertEqual(buffer.values!.map(\.x), entries.map(\.x).sorted())
+    }
+    
     func generateMockData() -> [SIMD4<Float>] {
         return (0..<100).map { i in
             let angle = Float(i) * Float.pi / 50.0
@@ -47,11 +118,25 @@ final class SpatialHashingTests: XCTestCase {
         }
     }
     
-    func collisionCandidates(positions: [SIMD4<Float>], candidatesCount: Int = 8, cellSize: Float) throws -> MTLTypedBuffer<UInt32> {
+    func collisionCandidates(
+        positions: [SIMD4<Float>],
+        candidatesCount: Int = 8,
+        cellSize: Float,
+        sortBackend: SpatialHashing.SortBackend = .bitonic,
+        hashTableCapacity: SpatialHashing.HashTableCapacity = .vertexCountMultiple(),
+        grid: SpatialHashing.Grid = .hashed,
+        queryStrategy: SpatialHashing.QueryStrategy = .perVertex,
+        positionStorage: SpatialHashing.PositionStorage = .half
+    ) throws -> MTLTypedBuffer<UInt32> {
         let config = SpatialHashing.Configuration(
             cellSize: cellSize,
             spacingScale: 1.0,
-            collisionType: .vertexToVertex
+            collisionType: .vertexToVertex,
+            sortBackend: sortBackend,
+            hashTableCapacity: hashTableCapacity,
+            grid: grid,
+            queryStrategy: queryStrategy,
+            positionStorage: positionStorage
         )
         
         let spatialHashing = try SpatialHashing(
@@ -155,78 +240,1673 @@ final class SpatialHashingTests: XCTestCase {
         }
     }
     
-    func testConnectedVerticesExclusion() throws {
+    func testSortBackendsProduceSameCandidates() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            [
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                1.0
+            ]
+        }
+        let candidatesCount = 64
+        let bitonicCandidates = try collisionCandidates(
+            positions: positions,
+            candidatesCount: candidatesCount,
+            cellSize: 1.0,
+            sortBackend: .bitonic
+        ).values!.chunked(into: candidatesCount).map { Set($0) }
+        
+        for sortBackend in SpatialHashing.SortBackend.allCases where sortBackend != .bitonic {
+            let candidates = try collisionCandidates(
+                positions: positions,
+                candidatesCount: candidatesCount,
+                cellSize: 1.0,
+                sortBackend: sortBackend
+            ).values!.chunked(into: candidatesCount).map { Set($0) }
+            
+            XCTAssertEqual(bitonicCandidates, candidates, "Candidates mismatch for \(sortBackend) sort backend")
+        }
+    }
+    
+    func testSortBackendsContainClosestProximity() throws {
         let positions: [SIMD4<Float>] = [
+            [-0.5, 0.0, 0.0, 1.0],
             [0.0, 0.0, 0.0, 1.0],
-            [0.1, 0.0, 0.0, 1.0],  // Connected to 0, closer than cell size
-            [0.5, 0.0, 0.0, 1.0],  // Not connected, within cell size
-            [1.5, 0.0, 0.0, 1.0]   // Not connected, outside cell size
+            [1.0, 0.0, 0.0, 1.0],
+            [1.5, 0.0, 0.0, 1.0],
+            [10.0, 0.0, 0.0, 1.0]
         ]
+        let candidatesCount = 4
         
-        let cellSize: Float = 1.0
-        let candidatesCount = 8
-        let config = SpatialHashing.Configuration(
-            cellSize: cellSize,
-            spacingScale: 1.0,
-            collisionType: .vertexToVertex
-        )
+        for sortBackend in SpatialHashing.SortBackend.allCases {
+            let collisionCandidatesBuffer = try collisionCandidates(
+                positions: positions,
+                candidatesCount: candidatesCount,
+                cellSize: 1.0,
+                sortBackend: sortBackend
+            )
+            let collisionCandidates = collisionCandidatesBuffer.values!.chunked(into: candidatesCount).map { Set($0) }
+            
+            XCTAssertTrue(collisionCandidates[0].contains(1), "\(sortBackend)")
+            XCTAssertTrue(collisionCandidates[1].contains(0), "\(sortBackend)")
+            XCTAssertTrue(collisionCandidates[2].contains(3), "\(sortBackend)")
+            XCTAssertTrue(collisionCandidates[3].contains(2), "\(sortBackend)")
+            XCTAssertEqual(collisionCandidates[4], [UInt32.max], "\(sortBackend)")
+        }
+    }
+    
+    func testBitonicSortHandlesNonPowerOfTwoCounts() throws {
+        let bitonicSort = try BitonicSort(library: .shared(device: self.device))
+        let tileSize = bitonicSort.tileSize
+        
+        for count in [1, 3, 1000, tileSize - 1, tileSize + 1, 3 * tileSize + 17] {
+            let entries = (0..<count).map { SIMD2<UInt32>(.random(in: 0..<UInt32(count)), UInt32($0)) }
+            // The trailing sentinel must not be touched by a sort of `count` entries.
+            let sentinel = SIMD2<UInt32>(0, 0xDEAD)
+            let buffer = try device.typedBuffer(with: entries + [sentinel])
+            
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                XCTFail("Failed to create command buffer")
+                return
+            }
+            bitonicSort.encode(data: buffer.buffer, count: count, in: commandBuffer)
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+            
+            let sorted = Array(buffer.values!.prefix(count))
+            XCTAssertEqual(sorted.map(\.x), entries.map(\.x).sorted(), "Keys aren't sorted for count \(count)")
+            XCTAssertEqual(Set(sorted.map(\.y)), Set(entries.map(\.y)), "Entries were lost for count \(count)")
+            XCTAssertEqual(buffer.values![count], sentinel, "The entry beyond count \(count) was written")
+        }
+    }
+    
+    func testSharedEncoderBuildMatchesCommandBufferBuild() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            [
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                1.0
+            ]
+        }
+        let candidatesCount = 64
+        
+        for sortBackend in SpatialHashing.SortBackend.allCases {
+            let spatialHashing = try SpatialHashing(
+                device: self.device,
+                configuration: .init(cellSize: 1.0, sortBackend: sortBackend),
+                capacity: positions.count
+            )
+            let positionsBuffer = try device.typedBuffer(with: positions)
+            let collisionCandidatesBuffer = try device.typedBuffer(
+                with: Array(repeating: UInt32.max, count: positions.count * candidatesCount)
+            )
+            
+            // Two builds share the encoder, the second one must see the results of the first.
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer(),
+                  let encoder = commandBuffer.makeComputeCommandEncoder()
+            else {
+                XCTFail("Failed to create command encoder")
+                return
+            }
+            spatialHashing.build(positions: positionsBuffer, using: encoder)
+            spatialHashing.build(
+                positions: positionsBuffer,
+                collisionCandidates: collisionCandidatesBuffer,
+                connectedVertices: nil,
+                using: encoder
+            )
+            encoder.endEncoding()
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+            
+            let sharedEncoderCandidates = collisionCandidatesBuffer.values!.chunked(into: candidatesCount).map {
+                Set($0.prefix { $0 != UInt32.max })
+            }
+            let commandBufferCandidates = try collisionCandidates(
+                positions: positions,
+                candidatesCount: candidatesCount,
+                cellSize: 1.0,
+                sortBackend: sortBackend
+            ).values!.chunked(into: candidatesCount).map { Set($0.prefix { $0 != UInt32.max }) }
+            
+            XCTAssertEqual(sharedEncoderCandidates, commandBufferCandidates, "Candidates mismatch for \(sortBackend)")
+        }
+    }
+    
+    func testHashTableCapacitiesProduceSameCandidates() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -10 ... 10), 1.0)
+        }
+        let candidatesCount = 64
+        let defaultCandidates = try collisionCandidates(
+            positions: positions,
+            candidatesCount: candidatesCount,
+            cellSize: 1.0
+        ).values!.chunked(into: candidatesCount).map { Set($0) }
+        
+        let hashTableCapacities: [SpatialHashing.HashTableCapacity] = [
+            .vertexCountMultiple(factor: 4),
+            .fixed(257),
+            .powerOfTwo(atLeast: 1000)
+        ]
+        for hashTableCapacity in hashTableCapacities {
+            for sortBackend in SpatialHashing.SortBackend.allCases {
+                let candidates = try collisionCandidates(
+                    positions: positions,
+                    candidatesCount: candidatesCount,
+                    cellSize: 1.0,
+                    sortBackend: sortBackend,
+                    hashTableCapacity: hashTableCapacity
+                ).values!.chunked(into: candidatesCount).map { Set($0) }
+                
+                XCTAssertEqual(defaultCandidates, candidates, "Candidates mismatch for \(hashTableCapacity), \(sortBackend)")
+            }
+        }
+    }
+    
+    func testDenseGridProducesSameCandidates() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -10 ... 10), 1.0)
+        }
+        let candidatesCount = 64
+        let hashedCandidates = try collisionCandidates(
+            positions: positions,
+            candidatesCount: candidatesCount,
+            cellSize: 1.0
+        ).values!.chunked(into: candidatesCount).map { Set($0) }
+        
+        // The second domain clamps the positions outside it to the boundary cells.
+        let grids: [SpatialHashing.Grid] = [
+            .dense(lowerBound: [-10, -10, -10], upperBound: [10, 10, 10]),
+            .dense(lowerBound: [-5, -5, -5], upperBound: [5, 5, 5])
+        ]
+        for grid in grids {
+            for sortBackend in SpatialHashing.SortBackend.allCases {
+                let candidates = try collisionCandidates(
+                    positions: positions,
+                    candidatesCount: candidatesCount,
+                    cellSize: 1.0,
+                    sortBackend: sortBackend,
+                    grid: grid
+                ).values!.chunked(into: candidatesCount).map { Set($0) }
+                
+                XCTAssertEqual(hashedCandidates, candidates, "Candidates mismatch for \(grid), \(sortBackend)")
+            }
+        }
+    }
+    
+    func testQueryStrategiesProduceSameCandidates() throws {
+        // Dense clusters put tens of vertices into a cell.
+        let centers = (0..<20).map { _ in SIMD3<Float>.random(in: -10 ... 10) }
+        let positions: [SIMD4<Float>] = (0..<2000).map { i in
+            SIMD4<Float>(centers[i % centers.count] + SIMD3<Float>.random(in: -1 ... 1), 1.0)
+        }
+        let candidatesCount = 256
+        
+        for sortBackend in SpatialHashing.SortBackend.allCases {
+            let perVertexCandidates = try collisionCandidates(
+                positions: positions,
+                candidatesCount: candidatesCount,
+                cellSize: 0.5,
+                sortBackend: sortBackend
+            ).values!.chunked(into: candidatesCount).map { Set($0) }
+            for queryStrategy in SpatialHashing.QueryStrategy.allCases where queryStrategy != .perVertex {
+                let candidates = try collisionCandidates(
+                    positions: positions,
+                    candidatesCount: candidatesCount,
+                    cellSize: 0.5,
+                    sortBackend: sortBackend,
+                    queryStrategy: queryStrategy
+                ).values!.chunked(into: candidatesCount).map { Set($0) }
+                
+                XCTAssertEqual(perVertexCandidates, candidates, "Candidates mismatch for \(sortBackend), \(queryStrategy)")
+            }
+        }
+    }
+    
+    func testPrecisePositionStoragesFarFromOrigin() throws {
+        // The positions are beyond the half precision range, and the lattice spacing keeps
+        // every distance well away from the proximity despite the float precision this far out.
+        let origin = SIMD3<Float>(100_000.3, -200_000.7, 50_000.1)
+        let spacing: Float = 0.65
+        let positions: [SIMD4<Float>] = (0..<512).map { i in
+            let index = SIMD3<Float>(Float(i % 8), Float(i / 8 % 8), Float(i / 64))
+            return SIMD4<Float>(origin + index * spacing, 1.0)
+        }
+        let candidatesCount = 32
+        let expectedCandidates = positions.indices.map { i in
+            Set(positions.indices.filter { j in
+                let difference = SIMD4<Double>(positions[i]) - SIMD4<Double>(positions[j])
+                return j != i && (difference * difference).sum() < 1.0
+            }.map { UInt32($0) })
+        }
+
+        for positionStorage in SpatialHashing.PositionStorage.allCases where positionStorage != .half {
+            for queryStrategy in SpatialHashing.QueryStrategy.allCases {
+                let candidates = try collisionCandidates(
+                    positions: positions,
+                    candidatesCount: candidatesCount,
+                    cellSize: 1.0,
+                    queryStrategy: queryStrategy,
+                    positionStorage: positionStorage
+                ).values!.chunked(into: candidatesCount).map { Set($0.filter { $0 != .max }) }
+
+                XCTAssertEqual(expectedCandidates, candidates, "Candidates mismatch for \(positionStorage), \(queryStrategy)")
+            }
+        }
+    }
+
+    func testHashTableDiagnostics() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -10 ... 10), 1.0)
+        }
+        let cellSize: Float = 2.0
+        // The grid is built from half precision positions.
+        let cells = positions.map { position in
+            SIMD3<Int32>((SIMD3<Float>(Float(Float16(position.x)), Float(Float16(position.y)), Float(Float16(position.z))) / cellSize).rounded(.down))
+        }
+        let occupiedCellsCount = Set(cells).count
+        
+        func diagnostics(
+            hashTableCapacity: SpatialHashing.HashTableCapacity = .vertexCountMultiple(),
+            grid: SpatialHashing.Grid = .hashed
+        ) throws -> HashTableDiagnostics {
+            let spatialHashing = try SpatialHashing(
+                device: self.device,
+                configuration: .init(cellSize: cellSize, hashTableCapacity: hashTableCapacity, grid: grid),
+                positions: positions
+            )
+            let positionsBuffer = try device.typedBuffer(with: positions)
+            let collisionCandidatesBuffer = try device.typedBuffer(for: UInt32.self, count: positions.count * 8)
+            let diagnostics = try HashTableDiagnostics(device: self.device)
+            
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                XCTFail("Failed to create command buffer")
+                throw NSError(domain: "SpatialHashingTests", code: 1, userInfo: nil)
+            }
+            spatialHashing.build(
+                positions: positionsBuffer,
+                collisionCandidates: collisionCandidatesBuffer,
+                connectedVertices: nil,
+                in: commandBuffer
+            )
+            spatialHashing.encodeDiagnostics(into: diagnostics, in: commandBuffer)
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+            return diagnostics
+        }
+        
+        let singleSlot = try diagnostics(hashTableCapacity: .fixed(1))
+        XCTAssertEqual(singleSlot.occupiedSlotsCount, 1)
+        XCTAssertEqual(singleSlot.maxSlotOccupancy, positions.count)
+        // Only the first vertices of the crowded slot are told apart.
+        XCTAssertEqual(singleSlot.saturatedSlotsCount, 1)
+        XCTAssertGreaterThan(singleSlot.occupiedCellsCount, 1)
+        XCTAssertLessThanOrEqual(singleSlot.occupiedCellsCount, min(occupiedCellsCount, HashTableDiagnostics.maxDiagnosedSlotOccupancy))
+        XCTAssertEqual(singleSlot.collidingSlotsCount, 1)
+        XCTAssertEqual(singleSlot.collisionRate, 1)
         
+        let sparse = try diagnostics(hashTableCapacity: .powerOfTwo(atLeast: 1 << 16))
+        XCTAssertEqual(sparse.saturatedSlotsCount, 0)
+        XCTAssertEqual(sparse.occupiedCellsCount, occupiedCellsCount)
+        XCTAssertLessThanOrEqual(sparse.occupiedSlotsCount, occupiedCellsCount)
+        XCTAssertLessThan(sparse.collisionRate, 0.1)
+        XCTAssertLessThan(sparse.loadFactor, 0.05)
+        
+        let dense = try diagnostics(grid: .dense(lowerBound: [-10, -10, -10], upperBound: [10, 10, 10]))
+        XCTAssertEqual(dense.occupiedSlotsCount, occupiedCellsCount)
+        XCTAssertEqual(dense.collidingSlotsCount, 0)
+    }
+    
+    func testBuildInstrumentationMatchesOutputs() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -5 ... 5), 1.0)
+        }
+        let maxCollisionCandidatesCount = 4
         let spatialHashing = try SpatialHashing(
             device: self.device,
-            configuration: config,
+            configuration: .init(cellSize: 1.0),
             positions: positions
         )
-        
+        let instrumentation = try BuildInstrumentation(device: self.device)
+        spatialHashing.instrumentation = instrumentation
         let positionsBuffer = try device.typedBuffer(with: positions)
         let collisionCandidatesBuffer = try device.typedBuffer(
-            with: Array(repeating: UInt32.max, count: positions.count * candidatesCount)
+            for: UInt32.self,
+            count: positions.count * maxCollisionCandidatesCount
         )
-        
-        // Specify connected vertices: 0 and 1 are connected
-        let connectedVertices: [UInt32] = [
-            1, UInt32.max, UInt32.max, UInt32.max,  // For vertex 0
-            0, UInt32.max, UInt32.max, UInt32.max,  // For vertex 1
-            UInt32.max, UInt32.max, UInt32.max, UInt32.max,  // For vertex 2
-            UInt32.max, UInt32.max, UInt32.max, UInt32.max   // For vertex 3
-        ]
-        let connectedVerticesBuffer = try device.typedBuffer(with: connectedVertices)
-        
+        let diagnostics = try HashTableDiagnostics(device: self.device)
+
         guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
             XCTFail("Failed to create command buffer")
-            throw NSError(domain: "SpatialHashingTests", code: 1, userInfo: nil)
+            return
         }
-        
         spatialHashing.build(
             positions: positionsBuffer,
             collisionCandidates: collisionCandidatesBuffer,
-            connectedVertices: connectedVerticesBuffer,
+            connectedVertices: nil,
             in: commandBuffer
         )
-        
+        spatialHashing.encodeDiagnostics(into: diagnostics, in: commandBuffer)
         commandBuffer.commit()
         commandBuffer.waitUntilCompleted()
+
+        let candidatesCounts = (0..<positions.count).map { index in
+            collisionCandidatesBuffer.values!
+                .dropFirst(index * maxCollisionCandidatesCount)
+                .prefix(maxCollisionCandidatesCount)
+                .prefix { $0 != .max }
+                .count
+        }
+        XCTAssertEqual(instrumentation.foundCount, candidatesCounts.reduce(0, +))
+        XCTAssertEqual(instrumentation.overflowedVerticesCount, Int(spatialHashing.overflowedVerticesCount.values![0]))
+        XCTAssertGreaterThan(instrumentation.overflowedVerticesCount, 0)
+        XCTAssertLessThanOrEqual(
+            instrumentation.overflowedVerticesCount,
+            candidatesCounts.filter { $0 == maxCollisionCandidatesCount }.count
+        )
+        XCTAssertEqual(instrumentation.droppedPairsCount, 0)
+        XCTAssertEqual(instrumentation.occupiedSlotsCount, diagnostics.occupiedSlotsCount)
+        XCTAssertEqual(instrumentation.maxSlotOccupancy, diagnostics.maxSlotOccupancy)
+
+        if instrumentation.samplesAtDispatchBoundary {
+            let stageDurations = instrumentation.stageDurations
+            XCTAssertEqual(
+                Set(stageDurations.keys),
+                [.resetCellBounds, .hashing, .sort, .cellBounds, .query]
+            )
+            let buildDuration = try XCTUnwrap(instrumentation.buildDuration)
+            XCTAssertGreaterThanOrEqual(buildDuration + 1e-9, stageDurations.values.reduce(0, +))
+        } else if instrumentation.counterSampleBuffer != nil {
+            XCTAssertNotNil(instrumentation.buildDuration)
+        }
+    }
+    
+    func testIncrementalRebuildMatchesFullRebuild() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            [
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                1.0
+            ]
+        }
+        let candidatesCount = 64
         
-        let collisionCandidates = collisionCandidatesBuffer.values!.chunked(into: candidatesCount)
-        
-        // Verify that vertex 0 does not have vertex 1 as a collision candidate
-        XCTAssertFalse(collisionCandidates[0].contains(1), "Vertex 0 should not have connected vertex 1 as a collision candidate")
-        XCTAssertTrue(collisionCandidates[0].contains(2), "Vertex 0 should have vertex 2 as a collision candidate")
-        XCTAssertFalse(collisionCandidates[0].contains(3), "Vertex 0 should not have vertex 3 as a collision candidate (outside cell size)")
-        
-        // Verify that vertex 1 does not have vertex 0 as a collision candidate
-        XCTAssertFalse(collisionCandidates[1].contains(0), "Vertex 1 should not have connected vertex 0 as a collision candidate")
-        XCTAssertTrue(collisionCandidates[1].contains(2), "Vertex 1 should have vertex 2 as a collision candidate")
-        XCTAssertFalse(collisionCandidates[1].contains(3), "Vertex 1 should not have vertex 3 as a collision candidate (outside cell size)")
+        for sortBackend in [SpatialHashing.SortBackend.bitonic, .radix] {
+            let spatialHashing = try SpatialHashing(
+                device: self.device,
+                configuration: .init(
+                    cellSize: 1.0,
+                    sortBackend: sortBackend,
+                    rebuildMode: .incremental(fullSortThreshold: 0.5)
+                ),
+                positions: positions
+            )
+            let positionsBuffer = try device.typedBuffer(with: positions)
+            let collisionCandidatesBuffer = try device.typedBuffer(
+                with: Array(repeating: UInt32.max, count: positions.count * candidatesCount)
+            )
+            
+            // The last frame moves every vertex far enough to trigger the full sort fallback.
+            for displacement: Float in [0.0, 0.1, 0.3, 5.0] {
+                let displacedPositions = positions.map { $0 + SIMD4<Float>(displacement, displacement * 0.5, 0.0, 0.0) }
+                try positionsBuffer.put(values: displacedPositions)
+                
+                guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                    XCTFail("Failed to create command buffer")
+                    return
+                }
+                spatialHashing.build(
+                    positions: positionsBuffer,
+                    collisionCandidates: collisionCandidatesBuffer,
+                    connectedVertices: nil,
+                    in: commandBuffer
+                )
+                commandBuffer.commit()
+                commandBuffer.waitUntilCompleted()
+                
+                // The buffer is reused between frames, so only the candidates before the terminator are valid.
+                let incrementalCandidates = collisionCandidatesBuffer.values!.chunked(into: candidatesCount).map {
+                    Set($0.prefix { $0 != UInt32.max })
+                }
+                let fullCandidates = try collisionCandidates(
+                    positions: displacedPositions,
+                    candidatesCount: candidatesCount,
+                    cellSize: 1.0,
+                    sortBackend: sortBackend
+                ).values!.chunked(into: candidatesCount).map { Set($0.prefix { $0 != UInt32.max }) }
+                
+                XCTAssertEqual(incrementalCandidates, fullCandidates, "Candidates mismatch for \(sortBackend) after displacement \(displacement)")
+            }
+        }
+    }
+    
+    func testActiveCountMatchesFreshInstance() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            [
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                1.0
+            ]
+        }
+        let candidatesCount = 64
         
-        // Verify that vertex 2 has both vertex 0 and 1 as collision candidates
-        XCTAssertTrue(collisionCandidates[2].contains(0), "Vertex 2 should have vertex 0 as a collision candidate")
-        XCTAssertTrue(collisionCandidates[2].contains(1), "Vertex 2 should have vertex 1 as a collision candidate")
-        XCTAssertFalse(collisionCandidates[2].contains(3), "Vertex 2 should not have vertex 3 as a collision candidate (outside cell size)")
+        for sortBackend in SpatialHashing.SortBackend.allCases {
+            // The vertex count grows past the initial capacity and shrinks back, like an emitter.
+            let spatialHashing = try SpatialHashing(
+                device: self.device,
+                configuration: .init(
+                    cellSize: 1.0,
+                    sortBackend: sortBackend,
+                    rebuildMode: sortBackend == .counting ? .full : .incremental()
+                ),
+                positions: Array(positions.prefix(100))
+            )
+            let positionsBuffer = try device.typedBuffer(with: positions)
+            let collisionCandidatesBuffer = try device.typedBuffer(
+                with: Array(repeating: UInt32.max, count: positions.count * candidatesCount)
+            )
+            
+            for activeCount in [100, 400, 400, 1000, 250] {
+                try spatialHashing.reserveCapacity(activeCount)
+                XCTAssertGreaterThanOrEqual(spatialHashing.capacity, activeCount)
+                
+                guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                    XCTFail("Failed to create command buffer")
+                    return
+                }
+                spatialHashing.build(
+                    positions: positionsBuffer,
+                    collisionCandidates: collisionCandidatesBuffer,
+                    connectedVertices: nil,
+                    activeCount: activeCount,
+                    in: commandBuffer
+                )
+                commandBuffer.commit()
+                commandBuffer.waitUntilCompleted()
+                
+                let activeCandidates = collisionCandidatesBuffer.values!.chunked(into: candidatesCount)
+                    .prefix(activeCount)
+                    .map { Set($0.prefix { $0 != UInt32.max }) }
+                let freshCandidates = try collisionCandidates(
+                    positions: Array(positions.prefix(activeCount)),
+                    candidatesCount: candidatesCount,
+                    cellSize: 1.0,
+                    sortBackend: sortBackend
+                ).values!.chunked(into: candidatesCount).map { Set($0.prefix { $0 != UInt32.max }) }
+                
+                XCTAssertEqual(activeCandidates, freshCandidates, "Candidates mismatch for \(sortBackend) with \(activeCount) active vertices")
+            }
+            
+            try spatialHashing.shrinkCapacity(to: 250)
+            XCTAssertEqual(spatialHashing.capacity, 250)
+        }
+    }
+    
+    func testStaleCellsAreNotVisibleAfterRebuild() throws {
+        // Pairs of vertices in neighbouring cells that move into a single cell in the second frame.
+        let firstFramePositions: [SIMD4<Float>] = (0..<8).flatMap { i -> [SIMD4<Float>] in
+            let origin = Float(i) * 10.0
+            return [[origin + 0.5, 0.5, 0.5, 1.0], [origin + 1.5, 0.5, 0.5, 1.0]]
+        }
+        let secondFramePositions: [SIMD4<Float>] = (0..<8).flatMap { i -> [SIMD4<Float>] in
+            let origin = Float(i) * 10.0
+            return [[origin + 0.5, 0.5, 0.5, 1.0], [origin + 0.6, 0.5, 0.5, 1.0]]
+        }
+        let candidatesCount = 4
         
-        // Verify that vertex 3 has no collision candidates (all others are outside its cell)
-        XCTAssertFalse(collisionCandidates[3].contains(0), "Vertex 3 should not have vertex 0 as a collision candidate")
-        XCTAssertFalse(collisionCandidates[3].contains(1), "Vertex 3 should not have vertex 1 as a collision candidate")
-        XCTAssertFalse(collisionCandidates[3].contains(2), "Vertex 3 should not have vertex 2 as a collision candidate")
+        for sortBackend in SpatialHashing.SortBackend.allCases {
+            let spatialHashing = try SpatialHashing(
+                device: self.device,
+                configuration: .init(cellSize: 1.0, sortBackend: sortBackend),
+                positions: firstFramePositions
+            )
+            let positionsBuffer = try device.typedBuffer(with: firstFramePositions)
+            let collisionCandidatesBuffer = try device.typedBuffer(
+                with: Array(repeating: UInt32.max, count: firstFramePositions.count * candidatesCount)
+            )
+            
+            for framePositions in [firstFramePositions, secondFramePositions] {
+                try positionsBuffer.put(values: framePositions)
+                guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                    XCTFail("Failed to create command buffer")
+                    return
+                }
+                spatialHashing.build(
+                    positions: positionsBuffer,
+                    collisionCandidates: collisionCandidatesBuffer,
+                    connectedVertices: nil,
+                    in: commandBuffer
+                )
+                commandBuffer.commit()
+                commandBuffer.waitUntilCompleted()
+            }
+            
+            let collisionCandidates = collisionCandidatesBuffer.values!.chunked(into: candidatesCount)
+            for (i, candidates) in collisionCandidates.enumerated() {
+                let pairedVertex = UInt32(i ^ 1)
+                XCTAssertEqual(
+                    Array(candidates.prefix { $0 != UInt32.max }),
+                    [pairedVertex],
+                    "Stale cell visible for vertex \(i) with \(sortBackend) sort backend"
+                )
+            }
+        }
+    }
+    
+    func testOverflowedVerticesAreCounted() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -5 ... 5), 1.0)
+        }
+        let referenceCount = 64
+        let candidatesCounts = try collisionCandidates(
+            positions: positions,
+            candidatesCount: referenceCount,
+            cellSize: 1.0
+        ).values!.chunked(into: referenceCount).map { $0.prefix { $0 != .max }.count }
+        let budget = 2
+        let expectedOverflowedCount = candidatesCounts.filter { $0 > budget }.count
+        XCTAssertGreaterThan(expectedOverflowedCount, 0)
+
+        for queryStrategy in SpatialHashing.QueryStrategy.allCases {
+            let spatialHashing = try SpatialHashing(
+                device: self.device,
+                configuration: .init(cellSize: 1.0, queryStrategy: queryStrategy),
+                positions: positions
+            )
+            let collisionCandidatesBuffer = try device.typedBuffer(for: UInt32.self, count: positions.count * budget)
+
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                XCTFail("Failed to create command buffer")
+                return
+            }
+            spatialHashing.build(
+                positions: try device.typedBuffer(with: positions),
+                collisionCandidates: collisionCandidatesBuffer,
+                connectedVertices: nil,
+                in: commandBuffer
+            )
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+
+            XCTAssertEqual(
+                Int(spatialHashing.overflowedVerticesCount.values![0]),
+                expectedOverflowedCount,
+                "Overflow count mismatch for \(queryStrategy)"
+            )
+        }
+    }
+
+    func testCompactCollisionCandidatesMatchBruteForce() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -5 ... 5), 1.0)
+        }
+        // The proximity is `cellSize * spacingScale`.
+        let expectedCandidates = positions.indices.map { i in
+            Set(positions.indices.filter { j in
+                let difference = positions[i] - positions[j]
+                return j != i && (difference * difference).sum() < 1.0
+            }.map(UInt32.init))
+        }
+        let expectedCount = expectedCandidates.map(\.count).reduce(0, +)
+
+        let spatialHashing = try SpatialHashing(
+            device: self.device,
+            configuration: .init(cellSize: 1.0, positionStorage: .float),
+            positions: positions
+        )
+        let positionsBuffer = try device.typedBuffer(with: positions)
+        // Too small on purpose, the list grows to the count of the first build.
+        let compactCandidates = try CollisionCandidates(
+            device: self.device,
+            vertexCount: positions.count,
+            capacity: expectedCount / 4
+        )
+
+        func build() {
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                XCTFail("Failed to create command buffer")
+                return
+            }
+            spatialHashing.build(
+                positions: positionsBuffer,
+                collisionCandidates: compactCandidates,
+                connectedVertices: nil,
+                in: commandBuffer
+            )
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+        }
+
+        build()
+        let overflowedCount = Int(compactCandidates.count.values![0])
+        XCTAssertEqual(overflowedCount, expectedCount)
+        XCTAssertGreaterThan(overflowedCount, compactCandidates.capacity)
+
+        try compactCandidates.reserveCapacity(overflowedCount)
+        build()
+        XCTAssertEqual(Int(compactCandidates.count.values![0]), expectedCount)
+
+        let candidates = compactCandidates.candidates.values!
+        let ranges = compactCandidates.vertexCandidateRanges.values!
+        for (i, range) in ranges.enumerated() {
+            let vertexCandidates = candidates[Int(range.x) ..< Int(range.x + range.y)]
+            XCTAssertEqual(vertexCandidates.count, expectedCandidates[i].count, "Duplicate candidates of vertex \(i)")
+            XCTAssertEqual(Set(vertexCandidates), expectedCandidates[i], "Candidates mismatch for vertex \(i)")
+        }
+    }
+    
+    func testCollisionPairsMatchCollisionCandidates() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            [
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                1.0
+            ]
+        }
+        let candidatesCount = 64
+        let collisionCandidates = try collisionCandidates(
+            positions: positions,
+            candidatesCount: candidatesCount,
+            cellSize: 1.0
+        ).values!.chunked(into: candidatesCount)
+        let expectedPairs = Set(collisionCandidates.enumerated().flatMap { i, candidates in
+            candidates.prefix { $0 != UInt32.max }
+                .filter { $0 > UInt32(i) }
+                .map { SIMD2<UInt32>(UInt32(i), $0) }
+        })
+        
+        let spatialHashing = try SpatialHashing(
+            device: self.device,
+            configuration: .init(cellSize: 1.0),
+            positions: positions
+        )
+        let positionsBuffer = try device.typedBuffer(with: positions)
+        let collisionPairs = try CollisionPairs(device: self.device, vertexCount: positions.count, capacity: positions.count * 8)
+        
+        guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+            XCTFail("Failed to create command buffer")
+            return
+        }
+        spatialHashing.build(
+            positions: positionsBuffer,
+            collisionPairs: collisionPairs,
+            connectedVertices: nil,
+            in: commandBuffer
+        )
+        commandBuffer.commit()
+        commandBuffer.waitUntilCompleted()
+        
+        let pairsCount = Int(collisionPairs.count.values![0])
+        XCTAssertLessThanOrEqual(pairsCount, collisionPairs.capacity)
+        
+        let pairs = Array(collisionPairs.pairs.values!.prefix(pairsCount))
+        XCTAssertEqual(pairs.count, expectedPairs.count, "Every pair should be written exactly once")
+        XCTAssertEqual(Set(pairs), expectedPairs)
+        
+        let dispatchArguments = collisionPairs.dispatchArguments.values![0]
+        let threadgroupWidth = collisionPairs.dispatchThreadgroupWidth
+        XCTAssertEqual(
+            Int(dispatchArguments.threadgroupsPerGrid.0),
+            (pairsCount + threadgroupWidth - 1) / threadgroupWidth
+        )
+        XCTAssertEqual(dispatchArguments.threadgroupsPerGrid.1, 1)
+        XCTAssertEqual(dispatchArguments.threadgroupsPerGrid.2, 1)
+        
+        let vertexPairRanges = collisionPairs.vertexPairRanges.values!
+        for (i, range) in vertexPairRanges.enumerated() {
+            for pair in pairs[Int(range.x) ..< Int(range.x + range.y)] {
+                XCTAssertEqual(pair.x, UInt32(i))
+            }
+        }
+    }
+    
+    func primitivePairs(
+        collisionType: SelfCollisionType,
+        positions: [SIMD4<Float>],
+        previousPositions: [SIMD4<Float>]? = nil,
+        primitives: [UInt32]?,
+        cellSize: Float,
+        expectedSkippedCount: Int = 0
+    ) throws -> [SIMD2<UInt32>] {
+        let primitiveVerticesCount = collisionType.primitiveVerticesCount ?? 1
+        let primitivesCount = primitives.map { $0.count / primitiveVerticesCount } ?? positions.count
+        let queriesCount = collisionType == .vertexToTriangle ? positions.count : primitivesCount
+        
+        let spatialHashing = try SpatialHashing(
+            device: self.device,
+            configuration: .init(
+                cellSize: cellSize,
+                collisionType: collisionType,
+                sweptVertexBounds: collisionType == .vertexToVertex
+            ),
+            positions: positions,
+            primitivesCount: primitivesCount
+        )
+        let positionsBuffer = try device.typedBuffer(with: positions)
+        let previousPositionsBuffer = try previousPositions.map { try device.typedBuffer(with: $0) }
+        let primitivesBuffer = try primitives.map { try device.typedBuffer(with: $0) }
+        let collisionPairs = try CollisionPairs(device: self.device, vertexCount: queriesCount, capacity: queriesCount * 32)
+        
+        func build() throws {
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                XCTFail("Failed to create command buffer")
+                throw NSError(domain: "SpatialHashingTests", code: 1, userInfo: nil)
+            }
+            if let primitivesBuffer {
+                spatialHashing.build(
+                    positions: positionsBuffer,
+                    previousPositions: previousPositionsBuffer,
+                    primitives: primitivesBuffer,
+                    collisionPairs: collisionPairs,
+                    in: commandBuffer
+                )
+            } else {
+                spatialHashing.build(
+                    positions: positionsBuffer,
+                    previousPositions: previousPositionsBuffer!,
+                    collisionPairs: collisionPairs,
+                    in: commandBuffer
+                )
+            }
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+        }
+        
+        // The cell entries are sized by an average, the build tells the required count when they overflow.
+        try build()
+        let requiredCellEntriesCount = Int(spatialHashing.primitiveGridCounts.values![0])
+        if requiredCellEntriesCount > spatialHashing.primitiveCellEntriesCapacity {
+            try spatialHashing.reservePrimitiveCellEntriesCapacity(requiredCellEntriesCount)
+            try build()
+        }
+        XCTAssertLessThanOrEqual(Int(spatialHashing.primitiveGridCounts.values![0]), spatialHashing.primitiveCellEntriesCapacity)
+        XCTAssertEqual(Int(spatialHashing.primitiveGridCounts.values![1]), expectedSkippedCount)
+        
+        let pairsCount = Int(collisionPairs.count.values![0])
+        XCTAssertLessThanOrEqual(pairsCount, collisionPairs.capacity)
+        return Array(collisionPairs.pairs.values!.prefix(pairsCount))
+    }
+    
+    func expectedPrimitivePairs(
+        queries: [[UInt32]],
+        candidates: [[UInt32]],
+        positions: [SIMD4<Float>],
+        previousPositions: [SIMD4<Float>]? = nil,
+        proximity: Float,
+        isOrdered: Bool
+    ) -> Set<SIMD2<UInt32>> {
+        func bounds(_ vertices: [UInt32]) -> (lower: SIMD3<Float>, upper: SIMD3<Float>) {
+            let points = [positions, previousPositions ?? positions].flatMap { positions in
+                vertices.map { SIMD3<Float>(positions[Int($0)].x, positions[Int($0)].y, positions[Int($0)].z) }
+            }
+            return points.dropFirst().reduce((points[0], points[0])) { (pointwiseMin($0.0, $1), pointwiseMax($0.1, $1)) }
+        }
+        var pairs = Set<SIMD2<UInt32>>()
+        for (i, query) in queries.enumerated() {
+            let queryBounds = bounds(query)
+            let lower = queryBounds.lower - proximity
+            let upper = queryBounds.upper + proximity
+            for (j, candidate) in candidates.enumerated() {
+                guard !isOrdered || j > i,
+                      Set(query).isDisjoint(with: candidate)
+                else { continue }
+                let candidateBounds = bounds(candidate)
+                if any(upper .< candidateBounds.lower) || any(candidateBounds.upper .< lower) { continue }
+                pairs.insert(SIMD2<UInt32>(UInt32(i), UInt32(j)))
+            }
+        }
+        return pairs
+    }
+    
+    func randomTriangles(count: Int) -> (positions: [SIMD4<Float>], triangles: [UInt32]) {
+        var positions: [SIMD4<Float>] = []
+        for _ in 0 ..< count {
+            let center = SIMD3<Float>.random(in: -5 ... 5)
+            for _ in 0 ..< 3 {
+                let position = center + SIMD3<Float>.random(in: -0.4 ... 0.4)
+                positions.append(SIMD4<Float>(position, 1.0))
+            }
+        }
+        return (positions, (0 ..< UInt32(count * 3)).map { $0 })
+    }
+    
+    func testVertexTrianglePairsMatchBruteForce() throws {
+        let (positions, triangles) = randomTriangles(count: 500)
+        let cellSize: Float = 0.5
+        
+        let pairs = try primitivePairs(
+            collisionType: .vertexToTriangle,
+            positions: positions,
+            primitives: triangles,
+            cellSize: cellSize
+        )
+        let expectedPairs = expectedPrimitivePairs(
+            queries: positions.indices.map { [UInt32($0)] },
+            candidates: triangles.chunked(into: 3),
+            positions: positions,
+            proximity: cellSize,
+            isOrdered: false
+        )
+        
+        XCTAssertEqual(pairs.count, expectedPairs.count, "Every pair should be written exactly once")
+        XCTAssertEqual(Set(pairs), expectedPairs)
+    }
+    
+    func testEdgeEdgePairsMatchBruteForce() throws {
+        let (positions, triangles) = randomTriangles(count: 500)
+        let edges = triangles.chunked(into: 3).flatMap { [$0[0], $0[1], $0[1], $0[2], $0[2], $0[0]] }
+        let cellSize: Float = 0.5
+        
+        let pairs = try primitivePairs(
+            collisionType: .edgeToEdge,
+            positions: positions,
+            primitives: edges,
+            cellSize: cellSize
+        )
+        let expectedPairs = expectedPrimitivePairs(
+            queries: edges.chunked(into: 2),
+            candidates: edges.chunked(into: 2),
+            positions: positions,
+            proximity: cellSize,
+            isOrdered: true
+        )
+        
+        XCTAssertEqual(pairs.count, expectedPairs.count, "Every pair should be written exactly once")
+        XCTAssertEqual(Set(pairs), expectedPairs)
+    }
+    
+    func testOversizedPrimitivesAreSkippedAndCounted() throws {
+        let (trianglePositions, triangles) = randomTriangles(count: 500)
+        var positions = trianglePositions
+        var edges = triangles.chunked(into: 3).flatMap { [$0[0], $0[1], $0[1], $0[2], $0[2], $0[0]] }
+        // An edge spanning about 80^3 cells exceeds the default limit and is neither inserted nor queried.
+        positions += [SIMD4<Float>(-20, -20, -20, 1), SIMD4<Float>(20, 20, 20, 1)]
+        edges += [UInt32(positions.count - 2), UInt32(positions.count - 1)]
+        let oversizedEdge = UInt32(edges.count / 2 - 1)
+        let cellSize: Float = 0.5
+        
+        let pairs = try primitivePairs(
+            collisionType: .edgeToEdge,
+            positions: positions,
+            primitives: edges,
+            cellSize: cellSize,
+            expectedSkippedCount: 2
+        )
+        let expectedPairs = expectedPrimitivePairs(
+            queries: edges.chunked(into: 2),
+            candidates: edges.chunked(into: 2),
+            positions: positions,
+            proximity: cellSize,
+            isOrdered: true
+        ).filter { $0.x != oversizedEdge && $0.y != oversizedEdge }
+        
+        XCTAssertEqual(pairs.count, expectedPairs.count, "Every pair should be written exactly once")
+        XCTAssertEqual(Set(pairs), expectedPairs)
+    }
+    
+    func testSweptVertexPairsMatchBruteForce() throws {
+        let previousPositions: [SIMD4<Float>] = (0..<1000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -10 ... 10), 1.0)
+        }
+        // Fast vertices move across a few cells during the step.
+        let positions = previousPositions.enumerated().map { i, position in
+            position + SIMD4<Float>(SIMD3<Float>.random(in: i.isMultiple(of: 20) ? -0.75 ... 0.75 : -0.2 ... 0.2), 0.0)
+        }
+        let cellSize: Float = 0.5
+        
+        let pairs = try primitivePairs(
+            collisionType: .vertexToVertex,
+            positions: positions,
+            previousPositions: previousPositions,
+            primitives: nil,
+            cellSize: cellSize
+        )
+        let expectedPairs = expectedPrimitivePairs(
+            queries: positions.indices.map { [UInt32($0)] },
+            candidates: positions.indices.map { [UInt32($0)] },
+            positions: positions,
+            previousPositions: previousPositions,
+            proximity: cellSize,
+            isOrdered: true
+        )
+        
+        XCTAssertEqual(pairs.count, expectedPairs.count, "Every pair should be written exactly once")
+        XCTAssertEqual(Set(pairs), expectedPairs)
+    }
+    
+    func testFastSweptVertexPairsMatchBruteForce() throws {
+        let previousPositions: [SIMD4<Float>] = (0..<1000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -10 ... 10), 1.0)
+        }
+        // A few vertices cross about 10 cells along every axis, their swept bounds need about 2000 cell entries
+        // each, more than the 8 entries per vertex of the initial capacity on average, within the cells limit.
+        let positions = previousPositions.enumerated().map { i, position in
+            i < 4
+            ? SIMD4<Float>(SIMD3<Float>(repeating: i.isMultiple(of: 2) ? 2.5 : -2.5), 1.0)
+              + SIMD4<Float>(SIMD3<Float>.random(in: -0.25 ... 0.25), 0.0)
+            : position + SIMD4<Float>(SIMD3<Float>.random(in: -0.2 ... 0.2), 0.0)
+        }
+        let sweptPreviousPositions = previousPositions.enumerated().map { i, position in
+            i < 4 ? SIMD4<Float>(SIMD3<Float>(positions[i].x, positions[i].y, positions[i].z) * -1, 1.0) : position
+        }
+        let cellSize: Float = 0.5
+        
+        let pairs = try primitivePairs(
+            collisionType: .vertexToVertex,
+            positions: positions,
+            previousPositions: sweptPreviousPositions,
+            primitives: nil,
+            cellSize: cellSize
+        )
+        let expectedPairs = expectedPrimitivePairs(
+            queries: positions.indices.map { [UInt32($0)] },
+            candidates: positions.indices.map { [UInt32($0)] },
+            positions: positions,
+            previousPositions: sweptPreviousPositions,
+            proximity: cellSize,
+            isOrdered: true
+        )
+        
+        XCTAssertTrue(expectedPairs.contains { $0.x < 4 }, "The fast vertices should find pairs along their sweep")
+        XCTAssertEqual(pairs.count, expectedPairs.count, "Every pair should be written exactly once")
+        XCTAssertEqual(Set(pairs), expectedPairs)
+    }
+    
+    func testSweptVertexTrianglePairsMatchBruteForce() throws {
+        let (previousPositions, triangles) = randomTriangles(count: 500)
+        let positions = previousPositions.map { $0 + SIMD4<Float>(SIMD3<Float>.random(in: -0.5 ... 0.5), 0.0) }
+        let cellSize: Float = 0.5
+        
+        let pairs = try primitivePairs(
+            collisionType: .vertexToTriangle,
+            positions: positions,
+            previousPositions: previousPositions,
+            primitives: triangles,
+            cellSize: cellSize
+        )
+        let expectedPairs = expectedPrimitivePairs(
+            queries: positions.indices.map { [UInt32($0)] },
+            candidates: triangles.chunked(into: 3),
+            positions: positions,
+            previousPositions: previousPositions,
+            proximity: cellSize,
+            isOrdered: false
+        )
+        
+        XCTAssertEqual(pairs.count, expectedPairs.count, "Every pair should be written exactly once")
+        XCTAssertEqual(Set(pairs), expectedPairs)
+    }
+    
+    func testHalfStencilCollisionPairsMatchBruteForce() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -10 ... 10), 1.0)
+        }
+        let positionsBuffer = try device.typedBuffer(with: positions)
+        // The proximity is `cellSize * spacingScale`.
+        var expectedPairs = Set<SIMD2<UInt32>>()
+        for i in positions.indices {
+            for j in positions.indices where j > i {
+                let difference = positions[i] - positions[j]
+                if (difference * difference).sum() < 1.0 {
+                    expectedPairs.insert(SIMD2(UInt32(i), UInt32(j)))
+                }
+            }
+        }
+        
+        for queryStrategy in [SpatialHashing.QueryStrategy.perVertex, .halfStencil] {
+            let spatialHashing = try SpatialHashing(
+                device: self.device,
+                configuration: .init(cellSize: 1.0, queryStrategy: queryStrategy, positionStorage: .float),
+                positions: positions
+            )
+            let collisionPairs = try CollisionPairs(device: self.device, vertexCount: positions.count, capacity: positions.count * 8)
+            
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                XCTFail("Failed to create command buffer")
+                return
+            }
+            spatialHashing.build(
+                positions: positionsBuffer,
+                collisionPairs: collisionPairs,
+                connectedVertices: nil,
+                in: commandBuffer
+            )
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+            
+            let pairs = Array(collisionPairs.pairs.values!.prefix(Int(collisionPairs.count.values![0])))
+            XCTAssertEqual(pairs.count, Set(pairs).count, "Every pair should be written exactly once for \(queryStrategy)")
+            XCTAssertEqual(Set(pairs), expectedPairs, "Pairs mismatch for \(queryStrategy)")
+            XCTAssertTrue(pairs.allSatisfy { $0.x < $0.y })
+        }
+    }
+    
+    func testConnectedVerticesExclusion() throws {
+        let positions: [SIMD4<Float>] = [
+            [0.0, 0.0, 0.0, 1.0],
+            [0.1, 0.0, 0.0, 1.0],  // Connected to 0, closer than cell size
+            [0.5, 0.0, 0.0, 1.0],  // Not connected, within cell size
+            [1.5, 0.0, 0.0, 1.0]   // Not connected, outside cell size
+        ]
+        
+        let cellSize: Float = 1.0
+        let candidatesCount = 8
+        let config = SpatialHashing.Configuration(
+            cellSize: cellSize,
+            spacingScale: 1.0,
+            collisionType: .vertexToVertex
+        )
+        
+        let spatialHashing = try SpatialHashing(
+            device: self.device,
+            configuration: config,
+            positions: positions
+        )
+        
+        let positionsBuffer = try device.typedBuffer(with: positions)
+        let collisionCandidatesBuffer = try device.typedBuffer(
+            with: Array(repeating: UInt32.max, count: positions.count * candidatesCount)
+        )
+        
+        // Specify connected vertices: 0 and 1 are connected
+        let connectedVertices: [UInt32] = [
+            1, UInt32.max, UInt32.max, UInt32.max,  // For vertex 0
+            0, UInt32.max, UInt32.max, UInt32.max,  // For vertex 1
+            UInt32.max, UInt32.max, UInt32.max, UInt32.max,  // For vertex 2
+            UInt32.max, UInt32.max, UInt32.max, UInt32.max   // For vertex 3
+        ]
+        let connectedVerticesBuffer = try device.typedBuffer(with: connectedVertices)
+        
+        guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+            XCTFail("Failed to create command buffer")
+            throw NSError(domain: "SpatialHashingTests", code: 1, userInfo: nil)
+        }
+        
+        spatialHashing.build(
+            positions: positionsBuffer,
+            collisionCandidates: collisionCandidatesBuffer,
+            connectedVertices: connectedVerticesBuffer,
+            in: commandBuffer
+        )
+        
+        commandBuffer.commit()
+        commandBuffer.waitUntilCompleted()
+        
+        let collisionCandidates = collisionCandidatesBuffer.values!.chunked(into: candidatesCount)
+        
+        // Verify that vertex 0 does not have vertex 1 as a collision candidate
+        XCTAssertFalse(collisionCandidates[0].contains(1), "Vertex 0 should not have connected vertex 1 as a collision candidate")
+        XCTAssertTrue(collisionCandidates[0].contains(2), "Vertex 0 should have vertex 2 as a collision candidate")
+        XCTAssertFalse(collisionCandidates[0].contains(3), "Vertex 0 should not have vertex 3 as a collision candidate (outside cell size)")
+        
+        // Verify that vertex 1 does not have vertex 0 as a collision candidate
+        XCTAssertFalse(collisionCandidates[1].contains(0), "Vertex 1 should not have connected vertex 0 as a collision candidate")
+        XCTAssertTrue(collisionCandidates[1].contains(2), "Vertex 1 should have vertex 2 as a collision candidate")
+        XCTAssertFalse(collisionCandidates[1].contains(3), "Vertex 1 should not have vertex 3 as a collision candidate (outside cell size)")
+        
+        // Verify that vertex 2 has both vertex 0 and 1 as collision candidates
+        XCTAssertTrue(collisionCandidates[2].contains(0), "Vertex 2 should have vertex 0 as a collision candidate")
+        XCTAssertTrue(collisionCandidates[2].contains(1), "Vertex 2 should have vertex 1 as a collision candidate")
+        XCTAssertFalse(collisionCandidates[2].contains(3), "Vertex 2 should not have vertex 3 as a collision candidate (outside cell size)")
+        
+        // Verify that vertex 3 has no collision candidates (all others are outside its cell)
+        XCTAssertFalse(collisionCandidates[3].contains(0), "Vertex 3 should not have vertex 0 as a collision candidate")
+        XCTAssertFalse(collisionCandidates[3].contains(1), "Vertex 3 should not have vertex 1 as a collision candidate")
+        XCTAssertFalse(collisionCandidates[3].contains(2), "Vertex 3 should not have vertex 2 as a collision candidate")
+    }
+    
+    func connectedCollisionCandidates(
+        positions: [SIMD4<Float>],
+        candidatesCount: Int,
+        connectedVertices: MTLTypedBuffer<UInt32>,
+        connectedVerticesFormat: SpatialHashing.ConnectedVerticesFormat
+    ) throws -> [Set<UInt32>] {
+        let spatialHashing = try SpatialHashing(
+            device: self.device,
+            configuration: .init(cellSize: 1.0, connectedVerticesFormat: connectedVerticesFormat),
+            positions: positions
+        )
+        let positionsBuffer = try device.typedBuffer(with: positions)
+        let collisionCandidatesBuffer = try device.typedBuffer(
+            with: Array(repeating: UInt32.max, count: positions.count * candidatesCount)
+        )
+        
+        guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+            XCTFail("Failed to create command buffer")
+            throw NSError(domain: "SpatialHashingTests", code: 1, userInfo: nil)
+        }
+        
+        spatialHashing.build(
+            positions: positionsBuffer,
+            collisionCandidates: collisionCandidatesBuffer,
+            connectedVertices: connectedVertices,
+            in: commandBuffer
+        )
+        
+        commandBuffer.commit()
+        commandBuffer.waitUntilCompleted()
+        
+        return collisionCandidatesBuffer.values!.chunked(into: candidatesCount).map { Set($0.filter { $0 != .max }) }
+    }
+    
+    func testConnectedVerticesCountNotMultipleOfFour() throws {
+        let positions: [SIMD4<Float>] = [
+            [0.0, 0.0, 0.0, 1.0],
+            [0.1, 0.0, 0.0, 1.0],
+            [0.2, 0.0, 0.0, 1.0],
+            [0.3, 0.0, 0.0, 1.0],
+            [0.4, 0.0, 0.0, 1.0]
+        ]
+        // Vertex 0 is connected to 1, 2 and 3, the others are connected to themselves only.
+        let connectedVertices: [UInt32] = [
+            1, 2, 3,
+            1, 1, 1,
+            2, 2, 2,
+            3, 3, 3,
+            4, 4, 4
+        ]
+        let candidates = try connectedCollisionCandidates(
+            positions: positions,
+            candidatesCount: 8,
+            connectedVertices: device.typedBuffer(with: connectedVertices),
+            connectedVerticesFormat: .fixedCount
+        )
+        
+        XCTAssertEqual(candidates[0], [4])
+    }
+    
+    func testAdjacencyListsExcludeHighValenceNeighbors() throws {
+        // Vertex 0 is the center of a fan of 40 vertices, which exceeds the fixed count limit.
+        let fanCount = 40
+        var positions: [SIMD4<Float>] = [[0.0, 0.0, 0.0, 1.0]]
+        positions += (0..<fanCount).map { i in
+            let angle = Float(i) * 2 * Float.pi / Float(fanCount)
+            return [cos(angle) * 0.2, sin(angle) * 0.2, 0.0, 1.0]
+        }
+        positions.append([0.0, 0.0, 0.3, 1.0])
+        let unconnectedVertex = UInt32(fanCount + 1)
+        let fanVertices = Set((1 ... fanCount).map { UInt32($0) })
+
+        var neighbors = [[UInt32]](repeating: [], count: positions.count)
+        for vertex in fanVertices {
+            neighbors[0].append(vertex)
+            neighbors[Int(vertex)].append(0)
+        }
+        
+        let oneRingCandidates = try connectedCollisionCandidates(
+            positions: positions,
+            candidatesCount: 64,
+            connectedVertices: VertexAdjacency(device: self.device, neighbors: neighbors).buffer,
+            connectedVerticesFormat: .adjacencyLists
+        )
+        XCTAssertEqual(oneRingCandidates[0], [unconnectedVertex])
+        for vertex in fanVertices {
+            XCTAssertEqual(oneRingCandidates[Int(vertex)], fanVertices.subtracting([vertex]).union([unconnectedVertex]))
+        }
+        
+        // The fan vertices are two edges apart through the center.
+        let twoRingCandidates = try connectedCollisionCandidates(
+            positions: positions,
+            candidatesCount: 64,
+            connectedVertices: VertexAdjacency(device: self.device, neighbors: neighbors, rings: 2).buffer,
+            connectedVerticesFormat: .adjacencyLists
+        )
+        for vertex in fanVertices {
+            XCTAssertEqual(twoRingCandidates[Int(vertex)], [unconnectedVertex])
+        }
+        XCTAssertEqual(twoRingCandidates[Int(unconnectedVertex)], fanVertices.union([0]))
+    }
+    
+    func testCollisionGroupsFilterObjectPairs() throws {
+        // Object 0 collides with object 1 only, object 1 with both objects.
+        let collisionObjects = try CollisionObjects(device: self.device, objects: [
+            .init(vertexCount: 3, group: 0b01, mask: 0b10),
+            .init(vertexCount: 4, group: 0b10, mask: 0b11)
+        ])
+        let objectPositions: [[SIMD4<Float>]] = [
+            (0..<3).map { [Float($0) * 0.1, 0.0, 0.0, 1.0] },
+            (0..<4).map { [Float($0) * 0.1, 0.1, 0.0, 1.0] }
+        ]
+        let positions = objectPositions.flatMap { $0 }
+        let candidatesCount = 8
+        
+        XCTAssertEqual(collisionObjects.vertexRanges, [0 ..< 3, 3 ..< 7])
+        XCTAssertEqual((0 ..< 7).map { collisionObjects.objectIndex(of: $0) }, [0, 0, 0, 1, 1, 1, 1])
+        
+        for sortBackend in SpatialHashing.SortBackend.allCases {
+            for queryStrategy in SpatialHashing.QueryStrategy.allCases {
+                let spatialHashing = try SpatialHashing(
+                    device: self.device,
+                    configuration: .init(
+                        cellSize: 1.0,
+                        sortBackend: sortBackend,
+                        queryStrategy: queryStrategy,
+                        usesCollisionGroups: true
+                    ),
+                    positions: positions
+                )
+                let collisionCandidatesBuffer = try device.typedBuffer(
+                    with: Array(repeating: UInt32.max, count: positions.count * candidatesCount)
+                )
+                
+                guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                    XCTFail("Failed to create command buffer")
+                    throw NSError(domain: "SpatialHashingTests", code: 1, userInfo: nil)
+                }
+                
+                collisionObjects.encodeMerge(
+                    positions: try objectPositions.map { try device.typedBuffer(with: $0) },
+                    in: commandBuffer
+                )
+                spatialHashing.build(
+                    positions: collisionObjects.positions,
+                    collisionCandidates: collisionCandidatesBuffer,
+                    connectedVertices: nil,
+                    collisionObjects: collisionObjects,
+                    in: commandBuffer
+                )
+                
+                commandBuffer.commit()
+                commandBuffer.waitUntilCompleted()
+                
+                let candidates = collisionCandidatesBuffer.values!.chunked(into: candidatesCount).map {
+                    Set($0.filter { $0 != .max })
+                }
+                let secondObject = Set<UInt32>(3 ..< 7)
+                for vertex in 0 ..< 3 {
+                    XCTAssertEqual(candidates[vertex], secondObject, "Mismatch for \(sortBackend), \(queryStrategy)")
+                }
+                for vertex in 3 ..< 7 {
+                    XCTAssertEqual(
+                        candidates[vertex],
+                        Set<UInt32>(0 ..< 7).subtracting([UInt32(vertex)]),
+                        "Mismatch for \(sortBackend), \(queryStrategy)"
+                    )
+                }
+            }
+        }
+    }
+    
+    func testPointQueryMatchesBruteForce() throws {
+        let positions: [SIMD4<Float>] = (0..<2000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -5 ... 5), 1.0)
+        }
+        let points: [SIMD4<Float>] = (0..<300).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -6 ... 6), 1.0)
+        }
+        // The radius spans more than one cell.
+        let radius: Float = 0.7
+        var expectedPairs = Set<SIMD2<UInt32>>()
+        for (i, point) in points.enumerated() {
+            for (j, position) in positions.enumerated() {
+                let difference = point - position
+                if (difference * difference).sum() < radius * radius {
+                    expectedPairs.insert(SIMD2(UInt32(i), UInt32(j)))
+                }
+            }
+        }
+        
+        for sortBackend in SpatialHashing.SortBackend.allCases {
+            let spatialHashing = try SpatialHashing(
+                device: self.device,
+                configuration: .init(cellSize: 0.5, sortBackend: sortBackend, positionStorage: .float),
+                positions: positions
+            )
+            let collisionPairs = try CollisionPairs(
+                device: self.device,
+                vertexCount: points.count,
+                capacity: expectedPairs.count * 2
+            )
+            
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                XCTFail("Failed to create command buffer")
+                throw NSError(domain: "SpatialHashingTests", code: 1, userInfo: nil)
+            }
+            
+            spatialHashing.build(positions: try device.typedBuffer(with: positions), in: commandBuffer)
+            spatialHashing.query(
+                points: try device.typedBuffer(with: points),
+                radius: radius,
+                collisionPairs: collisionPairs,
+                in: commandBuffer
+            )
+            
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+            
+            let pairsCount = Int(collisionPairs.count.values![0])
+            let pairs = Array(collisionPairs.pairs.values!.prefix(pairsCount))
+            XCTAssertEqual(pairs.count, Set(pairs).count, "Duplicate pairs for \(sortBackend)")
+            XCTAssertEqual(Set(pairs), expectedPairs, "Pairs mismatch for \(sortBackend)")
+        }
+    }
+    
+    func testNearestCandidatesMatchBruteForce() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -4 ... 4), 1.0)
+        }
+        let k = 4
+        let expectedCandidates = positions.enumerated().map { i, position in
+            positions.indices
+                .filter { $0 != i }
+                .map { j -> (Int, Float) in
+                    let difference = position - positions[j]
+                    return (j, (difference * difference).sum())
+                }
+                .filter { $0.1 < 1 }
+                .sorted { $0.1 < $1.1 }
+                .prefix(k)
+                .map { UInt32($0.0) }
+        }
+
+        let spatialHashing = try SpatialHashing(
+            device: self.device,
+            configuration: .init(cellSize: 1.0, candidatesSelection: .nearest, positionStorage: .float),
+            positions: positions
+        )
+        let collisionCandidatesBuffer = try device.typedBuffer(for: UInt32.self, count: positions.count * k)
+
+        guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+            XCTFail("Failed to create command buffer")
+            return
+        }
+        spatialHashing.build(
+            positions: try device.typedBuffer(with: positions),
+            collisionCandidates: collisionCandidatesBuffer,
+            connectedVertices: nil,
+            in: commandBuffer
+        )
+        commandBuffer.commit()
+        commandBuffer.waitUntilCompleted()
+
+        let candidates = collisionCandidatesBuffer.values!.chunked(into: k).map { Array($0.prefix { $0 != .max }) }
+        for i in positions.indices {
+            XCTAssertEqual(candidates[i], expectedCandidates[i], "Nearest candidates mismatch for vertex \(i)")
+        }
+        XCTAssertEqual(Int(spatialHashing.overflowedVerticesCount.values![0]), 0)
+    }
+
+    func testNearestPointQueryMatchesBruteForce() throws {
+        let positions: [SIMD4<Float>] = (0..<2000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -5 ... 5), 1.0)
+        }
+        let points: [SIMD4<Float>] = (0..<300).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -6 ... 6), 1.0)
+        }
+        let radius: Float = 0.7
+        let spatialHashing = try SpatialHashing(
+            device: self.device,
+            configuration: .init(cellSize: 0.5, positionStorage: .float),
+            positions: positions
+        )
+
+        for k in [1, 6] {
+            let expectedVertices = points.map { point in
+                positions.indices
+                    .map { j -> (Int, Float) in
+                        let difference = point - positions[j]
+                        return (j, (difference * difference).sum())
+                    }
+                    .filter { $0.1 < radius * radius }
+                    .sorted { $0.1 < $1.1 }
+                    .prefix(k)
+                    .map { UInt32($0.0) }
+            }
+            let nearestVertices = try device.typedBuffer(for: UInt32.self, count: points.count * k)
+
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                XCTFail("Failed to create command buffer")
+                return
+            }
+            spatialHashing.build(positions: try device.typedBuffer(with: positions), in: commandBuffer)
+            spatialHashing.query(
+                points: try device.typedBuffer(with: points),
+                radius: radius,
+                nearestVertices: nearestVertices,
+                in: commandBuffer
+            )
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+
+            let vertices = nearestVertices.values!.chunked(into: k).map { Array($0.prefix { $0 != .max }) }
+            for i in points.indices {
+                XCTAssertEqual(vertices[i], expectedVertices[i], "Nearest vertices mismatch for point \(i), k = \(k)")
+            }
+        }
+    }
+    
+    func testSortedOutputOrderMatchesVertexOrder() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -4 ... 4), 1.0)
+        }
+        let candidatesCount = 32
+        let positionsBuffer = try device.typedBuffer(with: positions)
+
+        for queryStrategy in SpatialHashing.QueryStrategy.allCases {
+            let expectedCandidates = try collisionCandidates(
+                positions: positions,
+                candidatesCount: candidatesCount,
+                cellSize: 1.0,
+                queryStrategy: queryStrategy
+            ).values!.chunked(into: candidatesCount).map { Set($0.prefix { $0 != .max }) }
+
+            let spatialHashing = try SpatialHashing(
+                device: self.device,
+                configuration: .init(cellSize: 1.0, queryStrategy: queryStrategy, outputOrder: .sorted),
+                positions: positions
+            )
+            let collisionCandidatesBuffer = try device.typedBuffer(for: UInt32.self, count: positions.count * candidatesCount)
+            let sortedVerticesBuffer = try device.typedBuffer(for: UInt32.self, count: positions.count)
+            let sortedRanksBuffer = try device.typedBuffer(for: UInt32.self, count: positions.count)
+            let sortedPositionsBuffer = try device.typedBuffer(for: SIMD4<Float>.self, count: positions.count)
+            let unsortedPositionsBuffer = try device.typedBuffer(for: SIMD4<Float>.self, count: positions.count)
+
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                XCTFail("Failed to create command buffer")
+                return
+            }
+            spatialHashing.build(
+                positions: positionsBuffer,
+                collisionCandidates: collisionCandidatesBuffer,
+                connectedVertices: nil,
+                in: commandBuffer
+            )
+            spatialHashing.encodeSortedVertices(into: sortedVerticesBuffer, in: commandBuffer)
+            spatialHashing.encodeSortedRanks(into: sortedRanksBuffer, in: commandBuffer)
+            spatialHashing.permute(positionsBuffer, into: sortedPositionsBuffer, direction: .toSortedOrder, in: commandBuffer)
+            spatialHashing.permute(
+                sortedPositionsBuffer,
+                into: unsortedPositionsBuffer,
+                direction: .fromSortedOrder,
+                in: commandBuffer
+            )
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+
+            let sortedVertices = sortedVerticesBuffer.values!
+            let sortedRanks = sortedRanksBuffer.values!
+            XCTAssertEqual(Set(sortedVertices), Set(0 ..< UInt32(positions.count)), "Not a permutation for \(queryStrategy)")
+            for (rank, vertex) in sortedVertices.enumerated() {
+                XCTAssertEqual(Int(sortedRanks[Int(vertex)]), rank, "Ranks aren't the inverse for \(queryStrategy)")
+            }
+
+            let sortedCandidates = collisionCandidatesBuffer.values!.chunked(into: candidatesCount)
+            for (rank, candidates) in sortedCandidates.enumerated() {
+                let vertex = Int(sortedVertices[rank])
+                let vertexCandidates = Set(candidates.prefix { $0 != .max }.map { sortedVertices[Int($0)] })
+                XCTAssertEqual(vertexCandidates, expectedCandidates[vertex], "Candidates mismatch for \(queryStrategy), vertex \(vertex)")
+            }
+
+            let sortedPositions = sortedPositionsBuffer.values!
+            for (rank, vertex) in sortedVertices.enumerated() {
+                XCTAssertEqual(sortedPositions[rank], positions[Int(vertex)])
+            }
+            XCTAssertEqual(unsortedPositionsBuffer.values!, positions)
+        }
+    }
+
+    func testHierarchicalGridPairsMatchBruteForce() throws {
+        // Fine cloth-like vertices mixed with a few large proxies.
+        let positions: [SIMD4<Float>] = (0..<2000).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -4 ... 4), 1.0)
+        }
+        let radii: [Float] = positions.indices.map { i in
+            i % 100 == 0 ? .random(in: 0.5 ... 1.5) : .random(in: 0.05 ... 0.1)
+        }
+        var expectedPairs = Set<SIMD2<UInt32>>()
+        for i in positions.indices {
+            for j in positions.indices where j > i {
+                let difference = positions[i] - positions[j]
+                if (difference * difference).sum() < pow(radii[i] + radii[j], 2) {
+                    expectedPairs.insert(SIMD2(UInt32(i), UInt32(j)))
+                }
+            }
+        }
+
+        for sortBackend in [SpatialHashing.SortBackend.bitonic, .radix] {
+            let spatialHashing = try SpatialHashing(
+                device: self.device,
+                configuration: .init(cellSize: 0.2, sortBackend: sortBackend, positionStorage: .float, levelsCount: 5),
+                positions: positions
+            )
+            let collisionPairs = try CollisionPairs(device: self.device, vertexCount: positions.count, capacity: positions.count * 16)
+
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                XCTFail("Failed to create command buffer")
+                return
+            }
+            spatialHashing.build(
+                positions: try device.typedBuffer(with: positions),
+                radii: try device.typedBuffer(with: radii),
+                collisionPairs: collisionPairs,
+                in: commandBuffer
+            )
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+
+            let pairs = Array(collisionPairs.pairs.values!.prefix(Int(collisionPairs.count.values![0])))
+            XCTAssertEqual(pairs.count, Set(pairs).count, "Duplicate pairs for \(sortBackend)")
+            XCTAssertEqual(Set(pairs), expectedPairs, "Pairs mismatch for \(sortBackend)")
+            XCTAssertEqual(spatialHashing.clampedVerticesCount.values![0], 0, "Clamped vertices for \(sortBackend)")
+        }
+    }
+
+    func testHierarchicalGridCountsVerticesWiderThanCoarsestCells() throws {
+        let positions: [SIMD4<Float>] = (0..<100).map { _ in
+            SIMD4<Float>(SIMD3<Float>.random(in: -2 ... 2), 1.0)
+        }
+        // The coarsest cells are 0.4 wide, every tenth vertex is wider.
+        let radii: [Float] = positions.indices.map { i in i % 10 == 0 ? 0.5 : 0.05 }
+        let spatialHashing = try SpatialHashing(
+            device: self.device,
+            configuration: .init(cellSize: 0.2, positionStorage: .float, levelsCount: 2),
+            positions: positions
+        )
+        let collisionPairs = try CollisionPairs(device: self.device, vertexCount: positions.count, capacity: positions.count * 16)
+        let positionsBuffer = try device.typedBuffer(with: positions)
+        let radiiBuffer = try device.typedBuffer(with: radii)
+
+        // A second build resets the count.
+        for _ in 0..<2 {
+            guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                XCTFail("Failed to create command buffer")
+                return
+            }
+            spatialHashing.build(
+                positions: positionsBuffer,
+                radii: radiiBuffer,
+                collisionPairs: collisionPairs,
+                in: commandBuffer
+            )
+            commandBuffer.commit()
+            commandBuffer.waitUntilCompleted()
+
+            XCTAssertEqual(spatialHashing.clampedVerticesCount.values![0], 10)
+        }
+    }
+
+    func testScratchHeapBuildMatchesDeviceBuild() throws {
+        let positions: [SIMD4<Float>] = (0..<1000).map { _ in
+            [
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                Float.random(in: -10...10),
+                1.0
+            ]
+        }
+        let candidatesCount = 64
+        
+        for sortBackend in [SpatialHashing.SortBackend.bitonic, .radix, .counting] {
+            let configuration = SpatialHashing.Configuration(cellSize: 1.0, sortBackend: sortBackend)
+            let heapSize = SpatialHashing.heapSizeAndAlign(
+                device: self.device,
+                positionsCount: positions.count,
+                configuration: configuration,
+                includesScratchBuffers: false
+            ).size
+            let scratchHeapSizeAndAlign = SpatialHashing.scratchHeapSizeAndAlign(
+                device: self.device,
+                positionsCount: positions.count,
+                configuration: configuration
+            )
+            let heap = try self.device.heap(size: heapSize, storageMode: .shared)
+            let scratchHeap = try self.device.heap(size: scratchHeapSizeAndAlign.size, storageMode: .shared)
+            let spatialHashing = try SpatialHashing(
+                heap: heap,
+                scratchHeap: scratchHeap,
+                configuration: configuration,
+                capacity: positions.count
+            )
+            let positionsBuffer = try device.typedBuffer(with: positions)
+            let collisionCandidatesBuffer = try device.typedBuffer(
+                with: Array(repeating: UInt32.max, count: positions.count * candidatesCount)
+            )
+            
+            for displacement: Float in [0.0, 0.1, 0.3] {
+                let displacedPositions = positions.map { $0 + SIMD4<Float>(displacement, displacement * 0.5, 0.0, 0.0) }
+                try positionsBuffer.put(values: displacedPositions)
+                try spatialHashing.allocateScratchBuffers()
+                
+                guard let commandBuffer = self.commandQueue.makeCommandBuffer() else {
+                    XCTFail("Failed to create command buffer")
+                    return
+                }
+                spatialHashing.build(
+                    positions: positionsBuffer,
+                    collisionCandidates: collisionCandidatesBuffer,
+                    connectedVertices: nil,
+                    in: commandBuffer
+                )
+                commandBuffer.commit()
+                commandBuffer.waitUntilCompleted()
+                spatialHashing.makeScratchBuffersAliasable()
+                XCTAssertFalse(spatialHashing.hasScratchBuffers)
+                
+                // Another pass reuses the whole scratch heap and overwrites the memory of the scratch buffers.
+                let aliasingLength = scratchHeap.maxAvailableSize(alignment: scratchHeapSizeAndAlign.align)
+                let aliasingBuffer = try XCTUnwrap(scratchHeap.makeBuffer(length: aliasingLength, options: .storageModeShared))
+                memset(aliasingBuffer.contents(), 0xFF, aliasingLength)
+                aliasingBuffer.makeAliasable()
+                
+                let scratchHeapCandidates = collisionCandidatesBuffer.values!.chunked(into: candidatesCount).map {
+                    Set($0.prefix { $0 != UInt32.max })
+                }
+                let deviceCandidates = try collisionCandidates(
+                    positions: displacedPositions,
+                    candidatesCount: candidatesCount,
+                    cellSize: 1.0,
+                    sortBackend: sortBackend
+                ).values!.chunked(into: candidatesCount).map { Set($0.prefix { $0 != UInt32.max }) }
+                
+                XCTAssertEqual(scratchHeapCandidates, deviceCandidates, "Candidates mismatch for \(sortBackend) after displacement \(displacement)")
+            }
+        }
     }
     
     func testPerformanceForPositions(_ count: Int) throws {
@@ -245,7 +1925,8 @@ final class SpatialHashingTests: XCTestCase {
         )
         
         do {
-            let heap = try self.device.heap(size: SpatialHashing.totalBuffersSize(positionsCount: count), storageMode: .shared)
+            let heapSize = SpatialHashing.heapSizeAndAlign(device: self.device, positionsCount: count, configuration: config).size
+            let heap = try self.device.heap(size: heapSize, storageMode: .shared)
             let spatialHashing = try SpatialHashing(
                 heap: heap,
                 configuration: config,